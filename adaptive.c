@@ -0,0 +1,313 @@
+#include <ugeneric.h>
+#include "adaptive.h"
+
+struct _adaptive_encoder {
+    hcfg_t cfg; // config of per table encoders, progress output is disabled
+    size_t tables_count;
+    htable_t *tables;
+    hencoder_t **encoders;
+};
+
+// Decoders are built once per table, so switching tables between blocks
+// costs nothing.
+struct _adaptive_decoder {
+    hcfg_t cfg; // config of per table decoders, progress output is disabled
+    size_t decoders_count;
+    hdecoder_t **decoders;
+};
+
+static size_t get_best_table(htable_t *const *tables, size_t tables_count, const hstat_t *stat, size_t *bits)
+{
+    size_t best = 0;
+
+    *bits = SIZE_MAX;
+    for (size_t i = 0; i < tables_count; i++)
+    {
+        size_t b = get_coded_bits(tables[i], stat);
+        if (b < *bits)
+        {
+            *bits = b;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+hadaptive_model_t *build_adaptive_model(const hstat_t *stats, size_t blocks_count, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(stats);
+    UASSERT_INPUT(cfg);
+
+    hadaptive_model_t *model = uzalloc(sizeof(*model));
+    hstat_t total_stat = {0};
+
+    for (size_t i = 0; i < blocks_count; i++)
+    {
+        merge_stat(&total_stat, &stats[i]);
+    }
+    // Data appended later may have any symbols, table 0 must cover them.
+    if (cfg->append)
+    {
+        for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+        {
+            if (!total_stat.frequencies[i])
+            {
+                total_stat.frequencies[i] = 1;
+            }
+        }
+    }
+    model->tables = ucalloc(ADAPTIVE_MAX_TABLES, sizeof(htable_t *));
+    model->tables[model->tables_count++] = build_canonical_table(&total_stat, cfg);
+    extend_adaptive_model(model, stats, blocks_count, cfg);
+
+    if (cfg->verbose)
+    {
+        printf("Adaptive model: %zu tables for %zu blocks.\n", model->tables_count, blocks_count);
+    }
+
+    return model;
+}
+
+// Add tables for the blocks which save more than the table takes, existing
+// tables are kept.
+void extend_adaptive_model(hadaptive_model_t *model, const hstat_t *stats, size_t blocks_count, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(stats || !blocks_count);
+    UASSERT_INPUT(cfg);
+
+    size_t best_bits;
+
+    model->tables = urealloc(model->tables, ADAPTIVE_MAX_TABLES * sizeof(htable_t *));
+    for (size_t i = 0; i < blocks_count && model->tables_count < ADAPTIVE_MAX_TABLES; i++)
+    {
+        get_best_table(model->tables, model->tables_count, &stats[i], &best_bits);
+        htable_t *own = build_canonical_table(&stats[i], cfg);
+        if (get_coded_bits(own, &stats[i]) + get_packed_bits(own) < best_bits)
+        {
+            model->tables[model->tables_count++] = own;
+        }
+        else
+        {
+            ufree(own);
+        }
+    }
+}
+
+// Packed model: number of tables minus one, then packed code lengths of
+// every table.
+void pack_adaptive_model(const hadaptive_model_t *model, ubuffer_t *output)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(output);
+
+    ubuffer_append_byte(output, model->tables_count - 1);
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        pack_code_lengths(model->tables[i], output);
+    }
+}
+
+// Returns NULL if data is not a valid packed model.
+hadaptive_model_t *unpack_adaptive_model(const uint8_t *data, size_t size)
+{
+    UASSERT_INPUT(data);
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    hadaptive_model_t *model;
+
+    if (size < 1 || *p >= ADAPTIVE_MAX_TABLES)
+    {
+        return NULL;
+    }
+
+    model = uzalloc(sizeof(*model));
+    model->tables_count = *p++ + 1;
+    model->tables = ucalloc(model->tables_count, sizeof(htable_t *));
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        model->tables[i] = umalloc(sizeof(htable_t));
+        size_t used = unpack_code_lengths(p, end - p, model->tables[i]);
+        if (!used)
+        {
+            destroy_adaptive_model(model);
+            return NULL;
+        }
+        p += used;
+    }
+
+    return model;
+}
+
+void dump_adaptive_model(const hadaptive_model_t *model)
+{
+    UASSERT_INPUT(model);
+
+    printf("Adaptive model, %zu tables:\n", model->tables_count);
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        printf("  table %zu: %u symbols, max code length %u\n", i,
+               model->tables[i]->symbols_count, model->tables[i]->max_code_len);
+    }
+}
+
+void destroy_adaptive_model(hadaptive_model_t *model)
+{
+    if (model)
+    {
+        for (size_t i = 0; i < model->tables_count; i++)
+        {
+            ufree(model->tables[i]);
+        }
+        ufree(model->tables);
+        ufree(model);
+    }
+}
+
+hencoder_t *build_adaptive_encoder(const hadaptive_model_t *model, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(cfg);
+
+    hencoder_t *encoder = uzalloc(sizeof(*encoder));
+    hadaptive_encoder_t *adaptive = uzalloc(sizeof(*adaptive));
+    encoder->cfg = cfg;
+    encoder->adaptive = adaptive;
+
+    adaptive->cfg = *cfg;
+    adaptive->cfg.verbose = false;
+    adaptive->tables_count = model->tables_count;
+    adaptive->tables = ucalloc(model->tables_count, sizeof(htable_t));
+    adaptive->encoders = ucalloc(model->tables_count, sizeof(hencoder_t *));
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        adaptive->tables[i] = *model->tables[i];
+        adaptive->encoders[i] = build_encoder(&adaptive->tables[i], &adaptive->cfg);
+        if (adaptive->tables[i].max_code_len > encoder->max_code_len)
+        {
+            encoder->max_code_len = adaptive->tables[i].max_code_len;
+        }
+    }
+    encoder->type = adaptive->encoders[0]->type;
+
+    return encoder;
+}
+
+void destroy_adaptive_encoder(hadaptive_encoder_t *adaptive)
+{
+    if (adaptive)
+    {
+        for (size_t i = 0; i < adaptive->tables_count; i++)
+        {
+            destroy_encoder(adaptive->encoders[i]);
+        }
+        ufree(adaptive->encoders);
+        ufree(adaptive->tables);
+        ufree(adaptive);
+    }
+}
+
+// The block is coded with the table giving the shortest output, it is at
+// least as good as the one the model was built for.
+umemchunk_t encode_block_adaptive(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer)
+{
+    const hadaptive_encoder_t *adaptive = encoder->adaptive;
+    const uint8_t *in = input.data;
+    hstat_t stat = {0};
+    size_t bits;
+
+    for (size_t i = 0; i < input.size; i++)
+    {
+        stat.frequencies[in[i]]++;
+    }
+
+    htable_t *tables[ADAPTIVE_MAX_TABLES];
+    for (size_t i = 0; i < adaptive->tables_count; i++)
+    {
+        tables[i] = &adaptive->tables[i];
+    }
+    size_t best = get_best_table(tables, adaptive->tables_count, &stat, &bits);
+    UASSERT(bits != SIZE_MAX);
+
+    encode_block(adaptive->encoders[best], input, buffer);
+    ubuffer_append_byte(buffer, best);
+
+    umemchunk_t output = {
+        .data = buffer->data,
+        .size = buffer->data_size,
+    };
+
+    return output;
+}
+
+hdecoder_t *build_adaptive_decoder(const hadaptive_model_t *model, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(cfg);
+
+    hdecoder_t *decoder = uzalloc(sizeof(*decoder));
+    hadaptive_decoder_t *adaptive = uzalloc(sizeof(*adaptive));
+    decoder->cfg = cfg;
+    decoder->adaptive = adaptive;
+
+    adaptive->cfg = *cfg;
+    adaptive->cfg.verbose = false;
+    adaptive->cfg.dump_lookup_table = false;
+    adaptive->decoders_count = model->tables_count;
+    adaptive->cfg.max_table_size = cfg->max_table_size / model->tables_count;
+    adaptive->decoders = ucalloc(model->tables_count, sizeof(hdecoder_t *));
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        hnode_t *root = build_tree_from_codes(model->tables[i]);
+        adaptive->decoders[i] = build_decoder(root, &adaptive->cfg);
+        decoder->table_size += adaptive->decoders[i]->table_size;
+    }
+    decoder->type = adaptive->decoders[0]->type;
+
+    if (cfg->verbose)
+    {
+        printf("Using adaptive decoder, %zu tables, %zu bytes of decoding tables.\n",
+               adaptive->decoders_count, decoder->table_size);
+    }
+
+    return decoder;
+}
+
+void destroy_adaptive_decoder(hadaptive_decoder_t *adaptive)
+{
+    if (adaptive)
+    {
+        for (size_t i = 0; i < adaptive->decoders_count; i++)
+        {
+            // Trees are owned by the adaptive decoder.
+            hnode_t *root = (hnode_t *)adaptive->decoders[i]->root;
+            destroy_decoder(adaptive->decoders[i]);
+            destroy_tree(root);
+        }
+        ufree(adaptive->decoders);
+        ufree(adaptive);
+    }
+}
+
+// Corrupted table index yields empty output.
+umemchunk_t decode_block_adaptive(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer,
+                                  size_t original_size)
+{
+    const hadaptive_decoder_t *adaptive = decoder->adaptive;
+    umemchunk_t output = {.data = buffer->data, .size = 0};
+    uint8_t table;
+
+    if (input.size < 2)
+    {
+        return output;
+    }
+    table = ((uint8_t *)input.data)[--input.size];
+    if (table >= adaptive->decoders_count)
+    {
+        return output;
+    }
+
+    return decode_block(adaptive->decoders[table], input, buffer, original_size);
+}
@@ -0,0 +1,34 @@
+#ifndef __ADAPTIVE_H__
+#define __ADAPTIVE_H__
+
+#include "huffman.h"
+
+// Adaptive codec: every block is coded with one of the tables of the
+// archive. Table 0 is built from the whole input so it can code any block,
+// a block gets a table of its own only when the table saves more than its
+// packed size. Index of the table is stored in the byte following the guard
+// bytes of the block, so blocks stay self-contained.
+#define ADAPTIVE_MAX_TABLES 64
+
+typedef struct {
+    size_t tables_count;
+    htable_t **tables;
+} hadaptive_model_t;
+
+hadaptive_model_t *build_adaptive_model(const hstat_t *stats, size_t blocks_count, const hcfg_t *cfg);
+void extend_adaptive_model(hadaptive_model_t *model, const hstat_t *stats, size_t blocks_count, const hcfg_t *cfg);
+void pack_adaptive_model(const hadaptive_model_t *model, ubuffer_t *output);
+hadaptive_model_t *unpack_adaptive_model(const uint8_t *data, size_t size);
+void dump_adaptive_model(const hadaptive_model_t *model);
+void destroy_adaptive_model(hadaptive_model_t *model);
+
+hencoder_t *build_adaptive_encoder(const hadaptive_model_t *model, const hcfg_t *cfg);
+void destroy_adaptive_encoder(hadaptive_encoder_t *adaptive);
+umemchunk_t encode_block_adaptive(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer);
+
+hdecoder_t *build_adaptive_decoder(const hadaptive_model_t *model, const hcfg_t *cfg);
+void destroy_adaptive_decoder(hadaptive_decoder_t *adaptive);
+umemchunk_t decode_block_adaptive(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer,
+                                  size_t original_size);
+
+#endif
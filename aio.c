@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ugeneric.h>
+#include "aio.h"
+#include "archive.h"
+#include "crc32c.h"
+#include "profile.h"
+#include "sync.h"
+#include "uring.h"
+#include "util.h"
+
+static const char *io_engine_names[HIO_COUNT] = {
+    [HIO_UFILE] = "ufile",
+    [HIO_URING] = "uring",
+};
+
+const char *get_io_engine_name(hio_engine_t engine)
+{
+    UASSERT(engine < HIO_COUNT);
+    return io_engine_names[engine];
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t offset;
+    size_t done;
+    bool pending;
+} aio_request_t;
+
+typedef struct {
+    aio_request_t read;  // into the registered buffer
+    aio_request_t write; // from the output buffer
+    ubuffer_t output;
+} aio_slot_t;
+
+typedef struct {
+    huring_t *ring;
+    aio_slot_t slots[AIO_QUEUE_DEPTH];
+    size_t depth; // slots in use
+    uint8_t *buffers;
+    bool fixed; // buffers are registered
+    int in;
+    int out;
+    const char *input_file;
+    const char *output_file;
+} aio_t;
+
+// User data of a request is its slot index times two plus one for writes.
+static void submit_request(aio_t *aio, size_t slot, bool write)
+{
+    aio_slot_t *s = &aio->slots[slot];
+    aio_request_t *r = write ? &s->write : &s->read;
+    bool ok;
+
+    r->pending = true;
+    if (write)
+    {
+        ok = uring_prep_write(aio->ring, aio->out, r->data + r->done, r->size - r->done, r->offset + r->done, -1,
+                              2 * slot + 1);
+    }
+    else
+    {
+        ok = uring_prep_read(aio->ring, aio->in, r->data + r->done, r->size - r->done, r->offset + r->done,
+                             aio->fixed ? (int)slot : -1, 2 * slot);
+    }
+    UASSERT(ok);
+}
+
+// Wait for a completion, partial transfers are submitted again.
+static void complete_request(aio_t *aio)
+{
+    uint64_t user_data;
+    int res;
+
+    profile_start(HSTAGE_IO);
+    if (!uring_wait(aio->ring, &user_data, &res))
+    {
+        fprintf(stderr, "Error: io_uring failed: %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    profile_stop(HSTAGE_IO, res > 0 ? res : 0);
+
+    size_t slot = user_data / 2;
+    bool write = user_data % 2;
+    aio_request_t *r = write ? &aio->slots[slot].write : &aio->slots[slot].read;
+    if (res <= 0)
+    {
+        fprintf(stderr, "Error: failed to %s %s: %s.\n", write ? "write" : "read",
+                write ? aio->output_file : aio->input_file, res ? strerror(-res) : "unexpected end of file");
+        exit(EXIT_FAILURE);
+    }
+    r->done += res;
+    r->pending = false;
+    if (r->done < r->size)
+    {
+        submit_request(aio, slot, write);
+    }
+}
+
+static void wait_request(aio_t *aio, const aio_request_t *r)
+{
+    while (r->pending)
+    {
+        uring_submit(aio->ring);
+        complete_request(aio);
+    }
+}
+
+static void read_block(aio_t *aio, size_t slot, size_t offset, size_t size)
+{
+    aio_request_t *r = &aio->slots[slot].read;
+    r->offset = offset;
+    r->size = size;
+    r->done = 0;
+    submit_request(aio, slot, false);
+}
+
+static void write_block(aio_t *aio, size_t slot, umemchunk_t m, size_t offset)
+{
+    aio_request_t *r = &aio->slots[slot].write;
+    r->data = m.data;
+    r->offset = offset;
+    r->size = m.size;
+    r->done = 0;
+    if (m.size)
+    {
+        submit_request(aio, slot, true);
+    }
+}
+
+static bool aio_open(aio_t *aio, const char *input_file, const char *output_file, size_t buffer_size,
+                     const hcfg_t *cfg)
+{
+    memset(aio, 0, sizeof(*aio));
+    aio->depth = (cfg->queue_depth && cfg->queue_depth < AIO_QUEUE_DEPTH) ? cfg->queue_depth : AIO_QUEUE_DEPTH;
+    aio->ring = uring_create(2 * aio->depth);
+    if (!aio->ring)
+    {
+        return false;
+    }
+
+    aio->input_file = input_file;
+    aio->output_file = output_file;
+    aio->in = open(input_file, O_RDONLY);
+    if (aio->in < 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s.\n", input_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    aio->out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (aio->out < 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s.\n", output_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct iovec iov[AIO_QUEUE_DEPTH];
+    buffer_size = buffer_size ? buffer_size : 1;
+    aio->buffers = umalloc(aio->depth * buffer_size);
+    for (size_t i = 0; i < aio->depth; i++)
+    {
+        iov[i].iov_base = aio->buffers + i * buffer_size;
+        iov[i].iov_len = buffer_size;
+        aio->slots[i].read.data = iov[i].iov_base;
+    }
+    aio->fixed = uring_register_buffers(aio->ring, iov, aio->depth);
+
+    return true;
+}
+
+static void aio_close(aio_t *aio)
+{
+    for (size_t i = 0; i < aio->depth; i++)
+    {
+        wait_request(aio, &aio->slots[i].write);
+        ubuffer_destroy(&aio->slots[i].output);
+    }
+    if (close(aio->out) != 0)
+    {
+        fprintf(stderr, "Error: failed to write %s: %s.\n", aio->output_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(aio->in);
+    ufree(aio->buffers);
+    uring_destroy(aio->ring);
+}
+
+static void write_all(aio_t *aio, const void *data, size_t size, size_t offset)
+{
+    while (size)
+    {
+        ssize_t n = pwrite(aio->out, data, size, offset);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Error: failed to write %s: %s.\n", aio->output_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        data = (const uint8_t *)data + n;
+        size -= n;
+        offset += n;
+    }
+}
+
+bool aio_encode(const char *input_file, const char *output_file, const hencoder_t *encoder,
+                huffman_archive_header_t *hdr, const hcfg_t *cfg)
+{
+    size_t max_size = 0, input_size = 0;
+    aio_t aio;
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        if (hdr->blocks[i].original_size > max_size)
+        {
+            max_size = hdr->blocks[i].original_size;
+        }
+        input_size += hdr->blocks[i].original_size;
+    }
+    if (!aio_open(&aio, input_file, output_file, max_size, cfg))
+    {
+        return false;
+    }
+    preallocate_file(output_file, predict_archive_size(encoder, hdr));
+
+    uint64_t *points = get_header_sync_points(hdr);
+    size_t offset = get_data_offset(hdr);
+    size_t j = 0;
+    size_t t = 0;
+
+    if (cfg->verbose)
+    {
+        t = hdr->blocks_count / 58;
+        printf("Encoding file (io_uring, %zu blocks in flight): ", aio.depth);
+    }
+
+    for (size_t i = 0; i < hdr->blocks_count && i < aio.depth; i++)
+    {
+        UASSERT(hdr->blocks[i].original_offset + hdr->blocks[i].original_size <= input_size);
+        read_block(&aio, i, hdr->blocks[i].original_offset, hdr->blocks[i].original_size);
+    }
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        size_t slot = i % aio.depth;
+        aio_slot_t *s = &aio.slots[slot];
+        block_descriptor_t *bds = &hdr->blocks[i];
+
+        // Output buffer is free once the write of the previous block of
+        // the slot is done.
+        wait_request(&aio, &s->read);
+        wait_request(&aio, &s->write);
+
+        umemchunk_t input = {.data = s->read.data, .size = bds->original_size};
+        profile_start(HSTAGE_ENCODE);
+        umemchunk_t output = encode_block(encoder, input, &s->output);
+        if (hdr->sync_interval)
+        {
+            build_sync_points(encoder->htable, input, hdr->sync_interval, points);
+            points += get_sync_points_count(input.size, hdr->sync_interval);
+        }
+        bds->compressed_size = output.size;
+        bds->checksum = crc32c(0, input.data, input.size);
+        profile_stop(HSTAGE_ENCODE, input.size);
+
+        write_block(&aio, slot, output, offset);
+        offset += output.size;
+        if (i + aio.depth < hdr->blocks_count)
+        {
+            const block_descriptor_t *next = &hdr->blocks[i + aio.depth];
+            UASSERT(next->original_offset + next->original_size <= input_size);
+            read_block(&aio, slot, next->original_offset, next->original_size);
+        }
+        uring_submit(aio.ring);
+
+        if (cfg->verbose && j++ > t)
+        {
+            j = 0;
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+    }
+
+    // Header goes last, see store_header().
+    for (size_t i = 0; i < aio.depth; i++)
+    {
+        wait_request(&aio, &aio.slots[i].write);
+    }
+    if (hdr->flags & HARCHIVE_INDEX_AT_END)
+    {
+        write_all(&aio, hdr->blocks, get_header_size(hdr) - sizeof(*hdr), offset);
+        write_all(&aio, hdr, sizeof(*hdr), 0);
+    }
+    else
+    {
+        write_all(&aio, hdr, get_header_size(hdr), 0);
+    }
+    aio_close(&aio);
+
+    return true;
+}
+
+bool aio_decode(const char *input_file, const char *output_file, const hdecoder_t *decoder,
+                const huffman_archive_header_t *hdr, const hcfg_t *cfg)
+{
+    size_t max_size = 0;
+    aio_t aio;
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        if (hdr->blocks[i].compressed_size > max_size)
+        {
+            max_size = hdr->blocks[i].compressed_size;
+        }
+    }
+    if (!aio_open(&aio, input_file, output_file, max_size, cfg))
+    {
+        return false;
+    }
+
+    size_t *offsets = get_block_offsets(hdr);
+    size_t original_offset = 0;
+    size_t j = 0;
+    size_t t = 0;
+
+    if (cfg->verbose)
+    {
+        t = hdr->blocks_count / 58;
+        printf("Decoding file (io_uring, %zu blocks in flight): ", aio.depth);
+    }
+
+    for (size_t i = 0; i < hdr->blocks_count && i < aio.depth; i++)
+    {
+        read_block(&aio, i, offsets[i], hdr->blocks[i].compressed_size);
+    }
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        size_t slot = i % aio.depth;
+        aio_slot_t *s = &aio.slots[slot];
+        const block_descriptor_t *bds = &hdr->blocks[i];
+
+        wait_request(&aio, &s->read);
+        wait_request(&aio, &s->write);
+
+        umemchunk_t input = {.data = s->read.data, .size = bds->compressed_size};
+        profile_start(HSTAGE_DECODE);
+        umemchunk_t output = decode_block(decoder, input, &s->output, bds->original_size);
+        profile_stop(HSTAGE_DECODE, output.size);
+        if (output.size != bds->original_size || crc32c(0, output.data, output.size) != bds->checksum)
+        {
+            fprintf(stderr, "Error: checksum mismatch in block %zu, archive is corrupted.\n", i);
+            exit(EXIT_FAILURE);
+        }
+
+        // Blocks are written where the stream of the blocks before them
+        // ends, the descriptor has to agree.
+        if (bds->original_offset != original_offset)
+        {
+            fprintf(stderr, "Error: block %zu has a wrong offset, archive is corrupted.\n", i);
+            exit(EXIT_FAILURE);
+        }
+        write_block(&aio, slot, output, original_offset);
+        original_offset += bds->original_size;
+        if (i + aio.depth < hdr->blocks_count)
+        {
+            read_block(&aio, slot, offsets[i + aio.depth], hdr->blocks[i + aio.depth].compressed_size);
+        }
+        uring_submit(aio.ring);
+
+        if (cfg->verbose && j++ > t)
+        {
+            j = 0;
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+    }
+
+    ufree(offsets);
+    aio_close(&aio);
+
+    return true;
+}
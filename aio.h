@@ -0,0 +1,26 @@
+#ifndef __AIO_H__
+#define __AIO_H__
+
+#include "huffman.h"
+
+// Blocks kept in flight by the io_uring engine (--io uring), fewer if
+// cfg->queue_depth says so. Every block slot has a registered input buffer
+// and an output buffer which are reused by blocks slot, slot + depth and
+// so on.
+#define AIO_QUEUE_DEPTH 16
+
+const char *get_io_engine_name(hio_engine_t engine);
+
+// Encode blocks of the header layout and write the archive, descriptors and
+// sync points are stored to the header. Reads of the next blocks and
+// writes of the encoded ones run while the current block is encoded.
+// Returns false if io_uring isn't available, nothing is written then.
+bool aio_encode(const char *input_file, const char *output_file, const hencoder_t *encoder,
+                huffman_archive_header_t *hdr, const hcfg_t *cfg);
+
+// Decode all the blocks, every block is written at its original offset as
+// soon as it is decoded. Returns false if io_uring isn't available.
+bool aio_decode(const char *input_file, const char *output_file, const hdecoder_t *decoder,
+                const huffman_archive_header_t *hdr, const hcfg_t *cfg);
+
+#endif
@@ -0,0 +1,1655 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <ugeneric.h>
+#include "adaptive.h"
+#include "aio.h"
+#include "archive.h"
+#include "bitio.h"
+#include "context.h"
+#include "crc32c.h"
+#include "daemon.h"
+#include "pool.h"
+#include "profile.h"
+#include "segment.h"
+#include "stream.h"
+#include "sync.h"
+#include "util.h"
+#include "wide.h"
+
+char *serialize_block(const void *block, size_t *output_size)
+{
+    const block_descriptor_t *bds = block;
+    const char *fmt = "{\"original_size\": %zu, \"compressed_size\": %zu, \"original_offset\": %zu, \"checksum\": %zu}";
+    return ustring_fmt_sized(fmt, output_size, bds->original_size, bds->compressed_size, bds->original_offset,
+                             bds->checksum);
+}
+
+size_t get_header_size(const huffman_archive_header_t *hdr)
+{
+    return sizeof(*hdr) + hdr->blocks_count * sizeof(block_descriptor_t) +
+           hdr->sync_points_count * sizeof(uint64_t) + hdr->tables_size;
+}
+
+// Blocks follow the header unless the index (block descriptors and tables)
+// is kept at the end of the archive, then they follow the fixed part.
+size_t get_data_offset(const huffman_archive_header_t *hdr)
+{
+    return (hdr->flags & HARCHIVE_INDEX_AT_END) ? sizeof(*hdr) : get_header_size(hdr);
+}
+
+uint8_t *get_header_tables(const huffman_archive_header_t *hdr)
+{
+    return (uint8_t *)(get_header_sync_points(hdr) + hdr->sync_points_count);
+}
+
+// Offsets of fixed size blocks of the input, blocks_count + 1 items, the
+// last one is the input size.
+size_t *split_input(size_t input_size, size_t *blocks_count, const hcfg_t *cfg)
+{
+    *blocks_count = get_blocks_count(input_size, cfg);
+    size_t *offsets = umalloc((*blocks_count + 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < *blocks_count; i++)
+    {
+        offsets[i] = i * cfg->block_size;
+    }
+    offsets[*blocks_count] = input_size;
+
+    return offsets;
+}
+
+// Allocate archive header together with the array of block descriptors and
+// room for sync points and codec tables. Original offset and size of every
+// block are set from offsets (see split_input()).
+huffman_archive_header_t *allocate_header(const size_t *offsets, size_t blocks_count, const hstat_t *stat,
+                                          size_t sync_interval, size_t tables_size)
+{
+    size_t sync_points_count = 0;
+    for (size_t i = 0; i < blocks_count; i++)
+    {
+        sync_points_count += get_sync_points_count(offsets[i + 1] - offsets[i], sync_interval);
+    }
+
+    huffman_archive_header_t *hdr = ucalloc(1, sizeof(*hdr) + blocks_count * sizeof(block_descriptor_t) +
+                                               sync_points_count * sizeof(uint64_t) + tables_size);
+    memcpy(hdr->signature, HUFFMAN_ARCHIVE_SIGNATURE, sizeof(hdr->signature));
+    hdr->version = HUFFMAN_ARCHIVE_VERSION;
+    hdr->codec = HCODEC_STATIC;
+    hdr->blocks_count = blocks_count;
+    hdr->tables_size = tables_size;
+    hdr->sync_interval = sync_interval;
+    hdr->sync_points_count = sync_points_count;
+    memcpy(&hdr->stat, stat, sizeof(*stat));
+    for (size_t i = 0; i < blocks_count; i++)
+    {
+        hdr->blocks[i].original_offset = offsets[i];
+        hdr->blocks[i].original_size = offsets[i + 1] - offsets[i];
+    }
+    return hdr;
+}
+
+// Build tables of the codec picked by config from stat (get_stat_count()
+// histograms) and allocate archive header keeping them, blocks of the
+// archive are laid out by offsets.
+hencoder_t *build_archive_encoder(const hstat_t *stats, const size_t *offsets, size_t blocks_count,
+                                  huffman_archive_header_t **hdr, const hcfg_t *cfg)
+{
+    size_t stats_count = get_stat_count(blocks_count, cfg);
+    hcodec_t codec = HCODEC_STATIC;
+    hencoder_t *encoder;
+    ubuffer_t tables = {0};
+    hstat_t stat = {0}; // byte stat kept in the header
+
+    if (cfg->wide)
+    {
+        for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+        {
+            uint32_t frequency = stats[i >> 8].frequencies[i & 0xff];
+            stat.frequencies[i & 0xff] += frequency;
+            stat.frequencies[i >> 8] += frequency;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < stats_count; i++)
+        {
+            merge_stat(&stat, &stats[i]);
+        }
+    }
+
+    if (cfg->order1)
+    {
+        hcontext_model_t *model = build_context_model(stats, cfg);
+        if (cfg->dump_table)
+        {
+            dump_context_model(model);
+        }
+        codec = HCODEC_ORDER1;
+        pack_context_model(model, &tables);
+        encoder = build_context_encoder(model, cfg);
+        destroy_context_model(model);
+    }
+    else if (cfg->wide)
+    {
+        hwide_table_t *table = build_wide_table(stats, cfg);
+        if (cfg->dump_table)
+        {
+            dump_wide_table(table);
+        }
+        codec = HCODEC_WIDE;
+        pack_wide_table(table, &tables);
+        encoder = build_wide_encoder(table, cfg);
+        destroy_wide_table(table);
+    }
+    else if (cfg->adaptive)
+    {
+        hadaptive_model_t *model = build_adaptive_model(stats, blocks_count, cfg);
+        if (cfg->dump_table)
+        {
+            dump_adaptive_model(model);
+        }
+        codec = HCODEC_ADAPTIVE;
+        pack_adaptive_model(model, &tables);
+        encoder = build_adaptive_encoder(model, cfg);
+        destroy_adaptive_model(model);
+    }
+    else
+    {
+        hnode_t *root = build_tree(cfg, stats);
+        htable_t *table = build_codes(root, cfg);
+        destroy_tree(root);
+        if (cfg->dump_table)
+        {
+            dump_table(table, stats);
+        }
+
+        // Blocks of random or already compressed input are stored when
+        // coding them can't save anything, this is known from the table.
+        size_t min_size, max_size;
+        predict_encoded_size(table, stats, blocks_count, &min_size, &max_size);
+        if (min_size >= offsets[blocks_count])
+        {
+            codec = HCODEC_STORE;
+            encoder = uzalloc(sizeof(*encoder));
+            encoder->htable = table;
+            encoder->cfg = cfg;
+            encoder->store = true;
+        }
+        else
+        {
+            encoder = build_encoder(table, cfg);
+        }
+        if (cfg->verbose)
+        {
+            printf("Predicted size of blocks %zu to %zu bytes, %.2f%% of the input%s.\n", min_size, max_size,
+                   100.0 * min_size / offsets[blocks_count], encoder->store ? ", storing them as is" : "");
+        }
+    }
+
+    // Stored blocks have no codes to sync to.
+    *hdr = allocate_header(offsets, blocks_count, &stat, codec == HCODEC_STORE ? 0 : cfg->sync_interval,
+                           tables.data_size);
+    (*hdr)->codec = codec;
+    if (cfg->append)
+    {
+        (*hdr)->flags |= HARCHIVE_INDEX_AT_END;
+    }
+    if (tables.data_size)
+    {
+        memcpy(get_header_tables(*hdr), tables.data, tables.data_size);
+        if (cfg->verbose)
+        {
+            printf("Code tables take %zu bytes.\n", tables.data_size);
+        }
+    }
+    ubuffer_destroy(&tables);
+
+    return encoder;
+}
+
+// Archive size known before encoding for the reservation of the disk space,
+// exact for the stored blocks and for a single static codec block, an upper
+// bound for more of them (see predict_encoded_size()), 0 if other codecs.
+size_t predict_archive_size(const hencoder_t *encoder, const huffman_archive_header_t *hdr)
+{
+    size_t min_size, max_size;
+
+    if (hdr->codec == HCODEC_STORE)
+    {
+        max_size = 0;
+        for (size_t i = 0; i < hdr->blocks_count; i++)
+        {
+            max_size += hdr->blocks[i].original_size;
+        }
+    }
+    else if (hdr->codec == HCODEC_STATIC)
+    {
+        predict_encoded_size(encoder->htable, &hdr->stat, hdr->blocks_count, &min_size, &max_size);
+    }
+    else
+    {
+        return 0;
+    }
+
+    return get_header_size(hdr) + max_size;
+}
+
+void destroy_archive_encoder(hencoder_t *encoder)
+{
+    if (encoder)
+    {
+        // Code table of the static codec is owned by the archive encoder.
+        ufree((htable_t *)encoder->htable);
+        destroy_encoder(encoder);
+    }
+}
+
+// Build decoder for the codec of the archive, returns NULL when the codec
+// tables are corrupted. Reader (if any) is expected to be positioned at the
+// first block, it is used for --calibrate.
+hdecoder_t *build_archive_decoder(const huffman_archive_header_t *hdr, ufile_reader_t *fr, const hcfg_t *cfg)
+{
+    hdecoder_t *decoder;
+
+    // Stream archives have no blocks, see stream_extract().
+    if (hdr->codec == HCODEC_STREAM)
+    {
+        return NULL;
+    }
+
+    if (hdr->codec == HCODEC_STORE)
+    {
+        if (cfg->dump_table)
+        {
+            puts("Blocks are stored as is, there are no code tables.");
+        }
+        decoder = uzalloc(sizeof(*decoder));
+        decoder->cfg = cfg;
+        decoder->store = true;
+        if (cfg->verbose)
+        {
+            puts("Using store decoder, blocks are copied as is.");
+        }
+        return decoder;
+    }
+
+    if (hdr->codec == HCODEC_ORDER1)
+    {
+        profile_start(HSTAGE_TREE);
+        hcontext_model_t *model = unpack_context_model(get_header_tables(hdr), hdr->tables_size);
+        profile_stop(HSTAGE_TREE, 0);
+        if (!model)
+        {
+            return NULL;
+        }
+        if (cfg->dump_table)
+        {
+            dump_context_model(model);
+        }
+        profile_start(HSTAGE_DECODER);
+        decoder = build_context_decoder(model, cfg);
+        profile_stop(HSTAGE_DECODER, 0);
+        destroy_context_model(model);
+        return decoder;
+    }
+
+    if (hdr->codec == HCODEC_ADAPTIVE)
+    {
+        profile_start(HSTAGE_TREE);
+        hadaptive_model_t *model = unpack_adaptive_model(get_header_tables(hdr), hdr->tables_size);
+        profile_stop(HSTAGE_TREE, 0);
+        if (!model)
+        {
+            return NULL;
+        }
+        if (cfg->dump_table)
+        {
+            dump_adaptive_model(model);
+        }
+        profile_start(HSTAGE_DECODER);
+        decoder = build_adaptive_decoder(model, cfg);
+        profile_stop(HSTAGE_DECODER, 0);
+        destroy_adaptive_model(model);
+        return decoder;
+    }
+
+    if (hdr->codec == HCODEC_WIDE)
+    {
+        profile_start(HSTAGE_TREE);
+        hwide_table_t *table = unpack_wide_table(get_header_tables(hdr), hdr->tables_size);
+        profile_stop(HSTAGE_TREE, 0);
+        if (!table)
+        {
+            return NULL;
+        }
+        if (cfg->dump_table)
+        {
+            dump_wide_table(table);
+        }
+        profile_start(HSTAGE_DECODER);
+        decoder = build_wide_decoder(table, cfg);
+        profile_stop(HSTAGE_DECODER, 0);
+        destroy_wide_table(table);
+        return decoder;
+    }
+
+    profile_start(HSTAGE_TREE);
+    hnode_t *root = build_tree(cfg, &hdr->stat);
+    profile_stop(HSTAGE_TREE, 0);
+    if (cfg->dump_table)
+    {
+        htable_t *table = build_codes(root, cfg);
+        dump_table(table, &hdr->stat);
+        ufree(table);
+    }
+
+    profile_start(HSTAGE_DECODER);
+    if (cfg->calibrate && fr && hdr->blocks_count)
+    {
+        size_t position = G_AS_SIZE(ufile_reader_get_position(fr));
+        umemchunk_t input = G_AS_MEMCHUNK(ufile_reader_read(fr, hdr->blocks[0].compressed_size, NULL));
+        decoder = calibrate_decoder(root, input, hdr->blocks[0].original_size, cfg);
+        ufile_reader_set_position(fr, position);
+    }
+    else
+    {
+        decoder = build_decoder(root, cfg);
+    }
+    profile_stop(HSTAGE_DECODER, 0);
+
+    return decoder;
+}
+
+void destroy_archive_decoder(hdecoder_t *decoder)
+{
+    if (decoder)
+    {
+        // Tree of the static codec is owned by the archive decoder.
+        hnode_t *root = (hnode_t *)decoder->root;
+        destroy_decoder(decoder);
+        if (root)
+        {
+            destroy_tree(root);
+        }
+    }
+}
+
+// Position of each compressed block in the archive, blocks are stored back
+// to back.
+size_t *get_block_offsets(const huffman_archive_header_t *hdr)
+{
+    size_t *offsets = ucalloc(hdr->blocks_count + 1, sizeof(size_t));
+    size_t offset = get_data_offset(hdr);
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        offsets[i] = offset;
+        offset += hdr->blocks[i].compressed_size;
+    }
+    offsets[hdr->blocks_count] = offset;
+
+    return offsets;
+}
+
+// Fixed part of the header, NULL if it doesn't belong to a valid archive.
+static huffman_archive_header_t *load_fixed_header(ufile_reader_t *fr)
+{
+    huffman_archive_header_t *hdr = umalloc(sizeof(*hdr));
+
+    ufile_reader_set_position(fr, 0);
+    umemchunk_t m = G_AS_MEMCHUNK(ufile_reader_read(fr, sizeof(*hdr), hdr));
+    if (m.size != sizeof(*hdr) || memcmp(hdr->signature, HUFFMAN_ARCHIVE_SIGNATURE, sizeof(hdr->signature)) != 0 ||
+        hdr->version != HUFFMAN_ARCHIVE_VERSION || hdr->codec >= HCODEC_COUNT)
+    {
+        ufree(hdr);
+        return NULL;
+    }
+
+    return hdr;
+}
+
+// Position of the block descriptors in the archive of file_size bytes.
+static size_t get_index_offset(const huffman_archive_header_t *hdr, size_t file_size)
+{
+    if (hdr->flags & HARCHIVE_INDEX_AT_END)
+    {
+        // Index takes the tail of the archive, so appending blocks needs no
+        // room at the start.
+        return file_size - (get_header_size(hdr) - sizeof(*hdr));
+    }
+
+    return sizeof(*hdr);
+}
+
+// Load header together with the index, reader is left at the first block.
+huffman_archive_header_t *load_header(ufile_reader_t *fr)
+{
+    umemchunk_t m;
+    huffman_archive_header_t *hdr = load_fixed_header(fr);
+
+    if (!hdr)
+    {
+        return NULL;
+    }
+
+    // Index and tables sizes come from the file, a corrupted one must not
+    // size the allocation.
+    size_t full_header_size = get_header_size(hdr);
+    size_t file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (file_size < full_header_size)
+    {
+        ufree(hdr);
+        return NULL;
+    }
+
+    hdr = urealloc(hdr, full_header_size);
+    if (hdr->flags & HARCHIVE_INDEX_AT_END)
+    {
+        size_t index_size = full_header_size - sizeof(*hdr);
+        ufile_reader_set_position(fr, get_index_offset(hdr, file_size));
+        if (G_AS_MEMCHUNK(ufile_reader_read(fr, index_size, hdr->blocks)).size != index_size)
+        {
+            ufree(hdr);
+            return NULL;
+        }
+        ufile_reader_set_position(fr, sizeof(*hdr));
+    }
+    else
+    {
+        ufile_reader_set_position(fr, 0);
+        m = G_AS_MEMCHUNK(ufile_reader_read(fr, full_header_size, hdr));
+        if (m.size != full_header_size)
+        {
+            ufree(hdr);
+            return NULL;
+        }
+    }
+
+    // Sync points of a block are located by the counts of the blocks
+    // before it, so the total has to match them. Blocks are written at
+    // their original offsets, which have to follow each other.
+    size_t sync_points_count = 0;
+    uint64_t original_offset = 0;
+    bool contiguous = true;
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        sync_points_count += get_sync_points_count(hdr->blocks[i].original_size, hdr->sync_interval);
+        contiguous = contiguous && hdr->blocks[i].original_offset == original_offset;
+        original_offset += hdr->blocks[i].original_size;
+    }
+    if (sync_points_count != hdr->sync_points_count || !contiguous)
+    {
+        ufree(hdr);
+        return NULL;
+    }
+
+    return hdr;
+}
+
+// Writer is expected to be positioned right after the last block.
+void store_header(ufile_writer_t *fw, const huffman_archive_header_t *hdr)
+{
+    umemchunk_t m = {.data = (void *)hdr, .size = get_header_size(hdr)};
+
+    if (hdr->flags & HARCHIVE_INDEX_AT_END)
+    {
+        umemchunk_t index = {.data = (void *)hdr->blocks, .size = m.size - sizeof(*hdr)};
+        ufile_writer_write(fw, index);
+        m.size = sizeof(*hdr);
+    }
+    ufile_writer_set_position(fw, 0);
+    ufile_writer_write(fw, m);
+}
+
+static void print_blocks_map(const huffman_archive_header_t *hdr)
+{
+    printf("Blocks map: [");
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        char *str = serialize_block(&hdr->blocks[i], NULL);
+        printf("%s", str);
+        ufree(str);
+        if (i < hdr->blocks_count - 1)
+        {
+            printf(", ");
+        }
+    }
+    printf("]\n");
+}
+
+void compress(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    size_t input_size;
+    size_t blocks_count;
+    size_t *offsets;
+    hstat_t *stat;
+    ufile_reader_t *fr;
+    ufile_writer_t *fw;
+
+    // Gather statistics.
+    fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
+    input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (input_size == 0)
+    {
+        fprintf(stderr, "Error: input file is empty.\n");
+        exit(EXIT_FAILURE);
+    }
+    profile_start(HSTAGE_STAT);
+    if (cfg->segment)
+    {
+        stat = build_segment_stat(fr, &offsets, &blocks_count, cfg);
+    }
+    else
+    {
+        stat = build_stat(fr, cfg);
+        offsets = split_input(input_size, &blocks_count, cfg);
+    }
+    profile_stop(HSTAGE_STAT, input_size);
+
+    // Build codes and allocate archive header.
+    huffman_archive_header_t *hdr;
+    profile_start(HSTAGE_TREE);
+    hencoder_t *encoder = build_archive_encoder(stat, offsets, blocks_count, &hdr, cfg);
+    profile_stop(HSTAGE_TREE, 0);
+
+    // Encode and write archive header.
+    if (cfg->io_engine != HIO_URING || !aio_encode(input_file, output_file, encoder, hdr, cfg))
+    {
+        if (cfg->io_engine == HIO_URING && cfg->verbose)
+        {
+            printf("io_uring is not available, using ufile I/O.\n");
+        }
+        fw = G_AS_PTR(ufile_writer_create(output_file));
+        preallocate_file(output_file, predict_archive_size(encoder, hdr));
+        ufile_writer_set_position(fw, get_data_offset(hdr));
+        ufile_reader_set_position(fr, 0);
+        encode(fr, fw, encoder, hdr, cfg);
+        store_header(fw, hdr);
+        ufile_writer_destroy(fw);
+    }
+
+    if (cfg->dump_blocks_map)
+    {
+        print_blocks_map(hdr);
+    }
+
+    // Cleanup.
+    ufile_reader_destroy(fr);
+    ufree(hdr);
+    ufree(stat);
+    ufree(offsets);
+    destroy_archive_encoder(encoder);
+}
+
+// Temporary archive of append() is removed on failure, the old one is left
+// as it was.
+static void write_archive(FILE *f, const char *tmp_file, size_t offset, const void *data, size_t size)
+{
+    if (fseeko(f, offset, SEEK_SET) != 0 || fwrite(data, 1, size, f) != size)
+    {
+        fprintf(stderr, "Error: failed to write %s: %s.\n", tmp_file, strerror(errno));
+        unlink(tmp_file);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Compress the part of the input past the archived data and add it to the
+// archive as new blocks. Blocks already stored are not decoded, they are
+// copied to a new archive next to the old one by the kernel. New blocks
+// take the place of the old index and the new index follows them. The new
+// archive replaces the old one by rename once it is on disk, so an
+// interrupted append leaves the old archive intact. New blocks use the
+// existing tables, a block gets its own table when the old ones code it
+// worse than the own table plus its packed size (see
+// extend_adaptive_model()). Archive is created if it doesn't exist.
+void append(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    if (access(output_file, F_OK) != 0)
+    {
+        compress(input_file, output_file, cfg);
+        return;
+    }
+
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(output_file, cfg->block_size));
+    huffman_archive_header_t *hdr = G_AS_SIZE(ufile_reader_get_file_size(fr)) ? load_header(fr) : NULL;
+    ufile_reader_destroy(fr);
+    if (!hdr)
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", output_file);
+        exit(EXIT_FAILURE);
+    }
+    if (!(hdr->flags & HARCHIVE_INDEX_AT_END) || hdr->codec != HCODEC_ADAPTIVE)
+    {
+        fprintf(stderr, "Error: %s was not created with --append.\n", output_file);
+        exit(EXIT_FAILURE);
+    }
+    hadaptive_model_t *model = unpack_adaptive_model(get_header_tables(hdr), hdr->tables_size);
+    if (!model)
+    {
+        fprintf(stderr, "Error: %s has corrupted code tables.\n", output_file);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t old_count = hdr->blocks_count;
+    size_t *old_offsets = get_block_offsets(hdr);
+    size_t start = 0;
+    if (old_count)
+    {
+        start = hdr->blocks[old_count - 1].original_offset + hdr->blocks[old_count - 1].original_size;
+    }
+
+    fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
+    size_t input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (input_size < start)
+    {
+        fprintf(stderr, "Error: %s is shorter than the data in %s (%zu < %zu bytes).\n", input_file,
+                output_file, input_size, start);
+        exit(EXIT_FAILURE);
+    }
+    if (input_size == start)
+    {
+        if (cfg->verbose)
+        {
+            printf("Nothing to append, %s has all %zu bytes.\n", output_file, start);
+        }
+        ufile_reader_destroy(fr);
+        destroy_adaptive_model(model);
+        ufree(old_offsets);
+        ufree(hdr);
+        return;
+    }
+
+    // Only the last archived block is checked, input is expected to grow
+    // and not to change.
+    if (old_count)
+    {
+        const block_descriptor_t *bds = &hdr->blocks[old_count - 1];
+        ufile_reader_set_position(fr, bds->original_offset);
+        umemchunk_t m = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->original_size, NULL));
+        if (m.size != bds->original_size || crc32c(0, m.data, m.size) != bds->checksum)
+        {
+            fprintf(stderr, "Error: %s doesn't start with the data in %s.\n", input_file, output_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Layout of the whole input, old blocks keep their boundaries.
+    size_t new_count = get_blocks_count(input_size - start, cfg);
+    size_t blocks_count = old_count + new_count;
+    size_t *offsets = umalloc((blocks_count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < old_count; i++)
+    {
+        offsets[i] = hdr->blocks[i].original_offset;
+    }
+    for (size_t i = 0; i < new_count; i++)
+    {
+        offsets[old_count + i] = start + i * cfg->block_size;
+    }
+    offsets[blocks_count] = input_size;
+
+    // Gather statistics of the new blocks only.
+    hstat_t *stats = ucalloc(new_count, sizeof(hstat_t));
+    hstat_t stat = hdr->stat;
+    ufile_reader_set_position(fr, start);
+    for (size_t i = 0; i < new_count; i++)
+    {
+        size_t size = offsets[old_count + i + 1] - offsets[old_count + i];
+        umemchunk_t m = G_AS_MEMCHUNK(ufile_reader_read(fr, size, NULL));
+        UASSERT(m.size == size);
+        update_stat(stats, i, m, cfg);
+    }
+    for (size_t i = 0; i < new_count; i++)
+    {
+        merge_stat(&stat, &stats[i]);
+    }
+
+    size_t old_tables = model->tables_count;
+    extend_adaptive_model(model, stats, new_count, cfg);
+    if (cfg->dump_table)
+    {
+        dump_adaptive_model(model);
+    }
+    ubuffer_t tables = {0};
+    pack_adaptive_model(model, &tables);
+    hencoder_t *encoder = build_adaptive_encoder(model, cfg);
+
+    huffman_archive_header_t *new_hdr = allocate_header(offsets, blocks_count, &stat, 0, tables.data_size);
+    new_hdr->codec = HCODEC_ADAPTIVE;
+    new_hdr->flags = hdr->flags;
+    memcpy(new_hdr->blocks, hdr->blocks, old_count * sizeof(block_descriptor_t));
+    memcpy(get_header_tables(new_hdr), tables.data, tables.data_size);
+
+    if (cfg->verbose)
+    {
+        printf("Appending %zu bytes to %s as %zu blocks, %zu new tables.\n", input_size - start, output_file,
+               new_count, model->tables_count - old_tables);
+    }
+
+    // Stored blocks go to the new archive as they are, new blocks are
+    // encoded past them.
+    char *tmp_file = ustring_fmt("%s.XXXXXX", output_file);
+    int fd = mkstemp(tmp_file);
+    int old_fd = open(output_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || old_fd < 0 || fstat(old_fd, &st) != 0 || fchmod(fd, st.st_mode & 07777) != 0 ||
+        !copy_file_data(old_fd, fd, old_offsets[old_count]))
+    {
+        fprintf(stderr, "Error: failed to copy %s: %s.\n", output_file, strerror(errno));
+        if (fd >= 0)
+        {
+            unlink(tmp_file);
+        }
+        exit(EXIT_FAILURE);
+    }
+    close(old_fd);
+    FILE *f = fdopen(fd, "r+b");
+    if (!f)
+    {
+        fprintf(stderr, "Error: failed to open %s: %s.\n", tmp_file, strerror(errno));
+        unlink(tmp_file);
+        exit(EXIT_FAILURE);
+    }
+    size_t offset = old_offsets[old_count];
+    ubuffer_t buffer = {0};
+    ufile_reader_set_position(fr, start);
+    for (size_t i = old_count; i < blocks_count; i++)
+    {
+        block_descriptor_t *bds = &new_hdr->blocks[i];
+        umemchunk_t input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->original_size, NULL));
+        UASSERT(input.size == bds->original_size);
+        umemchunk_t output = encode_block(encoder, input, &buffer);
+        write_archive(f, tmp_file, offset, output.data, output.size);
+        bds->compressed_size = output.size;
+        bds->checksum = crc32c(0, input.data, input.size);
+        offset += output.size;
+    }
+
+    write_archive(f, tmp_file, offset, new_hdr->blocks, get_header_size(new_hdr) - sizeof(*new_hdr));
+    write_archive(f, tmp_file, 0, new_hdr, sizeof(*new_hdr));
+    if (fflush(f) != 0 || fsync(fd) != 0 || fclose(f) != 0 || !replace_file(tmp_file, output_file))
+    {
+        fprintf(stderr, "Error: failed to write %s: %s.\n", output_file, strerror(errno));
+        unlink(tmp_file);
+        exit(EXIT_FAILURE);
+    }
+    ufree(tmp_file);
+
+    // Cleanup.
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&tables);
+    ufile_reader_destroy(fr);
+    destroy_archive_encoder(encoder);
+    destroy_adaptive_model(model);
+    ufree(stats);
+    ufree(offsets);
+    ufree(old_offsets);
+    ufree(new_hdr);
+    ufree(hdr);
+}
+
+// Stats of the blocks which have to be encoded again.
+typedef struct {
+    size_t *blocks;
+    hstat_t *stats;
+    size_t count;
+    size_t capacity;
+} changed_blocks_t;
+
+static void add_changed_block(changed_blocks_t *c, size_t block, umemchunk_t m)
+{
+    if (c->count == c->capacity)
+    {
+        c->capacity = c->capacity ? 2 * c->capacity : 64;
+        c->blocks = urealloc(c->blocks, c->capacity * sizeof(size_t));
+        c->stats = urealloc(c->stats, c->capacity * sizeof(hstat_t));
+    }
+    hstat_t *stat = &c->stats[c->count];
+    memset(stat, 0, sizeof(*stat));
+    for (size_t i = 0; i < m.size; i++)
+    {
+        stat->frequencies[((uint8_t *)m.data)[i]]++;
+    }
+    c->blocks[c->count++] = block;
+}
+
+// Build encoder for the changed blocks from the tables of the old archive,
+// returns NULL if the tables can't code them. Adaptive archives get new
+// tables where they pay off, packed tables are put to the buffer.
+static hencoder_t *build_update_encoder(const huffman_archive_header_t *hdr, const changed_blocks_t *changed,
+                                        ubuffer_t *tables, const hcfg_t *cfg)
+{
+    hencoder_t *encoder = NULL;
+    size_t bits;
+
+    if (hdr->codec == HCODEC_STATIC)
+    {
+        // Decoder builds the tree from the header stat, so does the encoder.
+        hnode_t *root = build_tree(cfg, &hdr->stat);
+        htable_t *table = build_codes(root, cfg);
+        destroy_tree(root);
+        for (size_t i = 0; i < changed->count; i++)
+        {
+            if (get_coded_bits(table, &changed->stats[i]) == SIZE_MAX)
+            {
+                ufree(table);
+                return NULL;
+            }
+        }
+        return build_encoder(table, cfg);
+    }
+
+    if (hdr->codec == HCODEC_ADAPTIVE)
+    {
+        hadaptive_model_t *model = unpack_adaptive_model(get_header_tables(hdr), hdr->tables_size);
+        if (!model)
+        {
+            return NULL;
+        }
+        extend_adaptive_model(model, changed->stats, changed->count, cfg);
+        for (size_t i = 0; i < changed->count; i++)
+        {
+            bits = SIZE_MAX;
+            for (size_t j = 0; j < model->tables_count && bits == SIZE_MAX; j++)
+            {
+                bits = get_coded_bits(model->tables[j], &changed->stats[i]);
+            }
+            if (bits == SIZE_MAX)
+            {
+                destroy_adaptive_model(model);
+                return NULL;
+            }
+        }
+        if (cfg->dump_table)
+        {
+            dump_adaptive_model(model);
+        }
+        pack_adaptive_model(model, tables);
+        encoder = build_adaptive_encoder(model, cfg);
+        destroy_adaptive_model(model);
+    }
+
+    return encoder;
+}
+
+// Compress the input reusing blocks of the archive cfg->update_file made
+// from its previous version: a block whose size and CRC-32C match the old
+// descriptor is copied as is, the rest are encoded with the old tables.
+// Block boundaries of the old archive are kept, data past them is split
+// into new blocks. When the old tables can't code the changed blocks (or
+// the codec has no per-block choice of tables) everything is compressed
+// again.
+void update(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    ufile_reader_t *fa = G_AS_PTR(ufile_reader_create(cfg->update_file, cfg->block_size));
+    huffman_archive_header_t *hdr = G_AS_SIZE(ufile_reader_get_file_size(fa)) ? load_header(fa) : NULL;
+    if (!hdr)
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", cfg->update_file);
+        exit(EXIT_FAILURE);
+    }
+
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
+    size_t input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (input_size == 0)
+    {
+        fprintf(stderr, "Error: input file is empty.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Old blocks starting inside of the input, the last one may be cut.
+    size_t old_count = 0;
+    size_t old_end = 0;
+    while (old_count < hdr->blocks_count && hdr->blocks[old_count].original_offset < input_size)
+    {
+        old_end = hdr->blocks[old_count].original_offset + hdr->blocks[old_count].original_size;
+        old_count++;
+    }
+    if (old_end > input_size)
+    {
+        old_end = input_size;
+    }
+    size_t blocks_count = old_count + get_blocks_count(input_size - old_end, cfg);
+    size_t *offsets = umalloc((blocks_count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < old_count; i++)
+    {
+        offsets[i] = hdr->blocks[i].original_offset;
+    }
+    for (size_t i = old_count; i < blocks_count; i++)
+    {
+        offsets[i] = old_end + (i - old_count) * cfg->block_size;
+    }
+    offsets[blocks_count] = input_size;
+
+    // Find changed blocks.
+    changed_blocks_t changed = {0};
+    bool *reused = ucalloc(blocks_count, sizeof(bool));
+    size_t t = blocks_count / 58;
+    size_t k = 0;
+    if (cfg->verbose)
+    {
+        printf("Comparing blocks: ");
+    }
+    ufile_reader_set_position(fr, 0);
+    for (size_t i = 0; i < blocks_count; i++)
+    {
+        size_t size = offsets[i + 1] - offsets[i];
+        umemchunk_t m = G_AS_MEMCHUNK(ufile_reader_read(fr, size, NULL));
+        UASSERT(m.size == size);
+        if (i < old_count && size == hdr->blocks[i].original_size &&
+            crc32c(0, m.data, m.size) == hdr->blocks[i].checksum)
+        {
+            reused[i] = true;
+        }
+        else
+        {
+            add_changed_block(&changed, i, m);
+        }
+        if (cfg->verbose && k++ > t)
+        {
+            k = 0;
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+        printf("%zu of %zu blocks changed.\n", changed.count, blocks_count);
+    }
+
+    ubuffer_t tables = {0};
+    hencoder_t *encoder = build_update_encoder(hdr, &changed, &tables, cfg);
+    if (!encoder)
+    {
+        if (cfg->verbose)
+        {
+            printf("Code tables of %s don't fit the changes, compressing from scratch.\n", cfg->update_file);
+        }
+        hcfg_t full_cfg = *cfg;
+        full_cfg.adaptive = hdr->codec == HCODEC_ADAPTIVE;
+        full_cfg.order1 = hdr->codec == HCODEC_ORDER1;
+        full_cfg.wide = hdr->codec == HCODEC_WIDE;
+        full_cfg.append = hdr->flags & HARCHIVE_INDEX_AT_END;
+        full_cfg.sync_interval = hdr->sync_interval;
+        ufile_reader_destroy(fr);
+        ufile_reader_destroy(fa);
+        ubuffer_destroy(&tables);
+        ufree(changed.blocks);
+        ufree(changed.stats);
+        ufree(reused);
+        ufree(offsets);
+        ufree(hdr);
+        compress(input_file, output_file, &full_cfg);
+        return;
+    }
+
+    if (!tables.data_size && hdr->tables_size)
+    {
+        ubuffer_append_data(&tables, get_header_tables(hdr), hdr->tables_size);
+    }
+    huffman_archive_header_t *new_hdr = allocate_header(offsets, blocks_count, &hdr->stat, hdr->sync_interval,
+                                                        tables.data_size);
+    new_hdr->codec = hdr->codec;
+    new_hdr->flags = hdr->flags;
+    memcpy(get_header_tables(new_hdr), tables.data, tables.data_size);
+
+    // Copy unchanged blocks and encode the rest.
+    size_t *old_offsets = get_block_offsets(hdr);
+    ufile_writer_t *fw = G_AS_PTR(ufile_writer_create(output_file));
+    ufile_writer_set_position(fw, get_data_offset(new_hdr));
+    ubuffer_t buffer = {0};
+    uint64_t *points = get_header_sync_points(new_hdr);
+    const uint64_t *old_points = get_header_sync_points(hdr);
+    for (size_t i = 0; i < blocks_count; i++)
+    {
+        block_descriptor_t *bds = &new_hdr->blocks[i];
+        size_t points_count = get_sync_points_count(bds->original_size, new_hdr->sync_interval);
+        umemchunk_t input, output;
+        if (reused[i])
+        {
+            *bds = hdr->blocks[i];
+            memcpy(points, old_points, points_count * sizeof(uint64_t));
+            ufile_reader_set_position(fa, old_offsets[i]);
+            output = G_AS_MEMCHUNK(ufile_reader_read(fa, bds->compressed_size, NULL));
+            if (output.size != bds->compressed_size)
+            {
+                fprintf(stderr, "Error: %s is truncated.\n", cfg->update_file);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+        {
+            ufile_reader_set_position(fr, offsets[i]);
+            input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->original_size, NULL));
+            UASSERT(input.size == bds->original_size);
+            output = encode_block(encoder, input, &buffer);
+            if (new_hdr->sync_interval)
+            {
+                build_sync_points(encoder->htable, input, new_hdr->sync_interval, points);
+            }
+            bds->compressed_size = output.size;
+            bds->checksum = crc32c(0, input.data, input.size);
+        }
+        ufile_writer_write(fw, output);
+        points += points_count;
+        if (i < old_count)
+        {
+            old_points += get_sync_points_count(hdr->blocks[i].original_size, hdr->sync_interval);
+        }
+    }
+    store_header(fw, new_hdr);
+
+    // Cleanup.
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&tables);
+    ufile_reader_destroy(fr);
+    ufile_reader_destroy(fa);
+    ufile_writer_destroy(fw);
+    destroy_archive_encoder(encoder);
+    ufree(changed.blocks);
+    ufree(changed.stats);
+    ufree(reused);
+    ufree(offsets);
+    ufree(old_offsets);
+    ufree(new_hdr);
+    ufree(hdr);
+}
+
+// Decode blocks one by one, each of them by several threads starting at
+// its sync points.
+static void decode_parallel(ufile_reader_t *fr, ufile_writer_t *fw, const hdecoder_t *decoder,
+                            const huffman_archive_header_t *hdr, size_t threads, const hcfg_t *cfg)
+{
+    hpool_t *pool = hpool_create(threads);
+    const uint64_t *points = get_header_sync_points(hdr);
+    ubuffer_t buffer = {0};
+    umemchunk_t input, output;
+    size_t j = 0;
+    size_t t = 0;
+
+    if (cfg->verbose)
+    {
+        t = hdr->blocks_count / 58;
+        printf("Decoding file (%zu threads per block): ", threads);
+    }
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        const block_descriptor_t *bds = &hdr->blocks[i];
+        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
+        output = decode_block_parallel(pool, threads, decoder, input, points, hdr->sync_interval,
+                                       bds->original_size, &buffer);
+        if (output.size != bds->original_size || crc32c(0, output.data, output.size) != bds->checksum)
+        {
+            fprintf(stderr, "Error: checksum mismatch in block %zu, archive is corrupted.\n", i);
+            exit(EXIT_FAILURE);
+        }
+        ufile_writer_write(fw, output);
+        points += get_sync_points_count(bds->original_size, hdr->sync_interval);
+
+        if (cfg->verbose && j++ > t)
+        {
+            j = 0;
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+    }
+
+    ubuffer_destroy(&buffer);
+    hpool_destroy(pool);
+}
+
+// Decode only the blocks overlapping the range, a block with sync points is
+// decoded from the last point before the range up to the first point past
+// it. Checksums can be verified for blocks decoded in full only.
+static void decode_range(ufile_reader_t *fr, ufile_writer_t *fw, const hdecoder_t *decoder,
+                         const huffman_archive_header_t *hdr, const hcfg_t *cfg)
+{
+    const uint64_t *points = get_header_sync_points(hdr);
+    size_t *offsets = get_block_offsets(hdr);
+    size_t original_size = 0, decoded_size = 0, written_size = 0;
+    ubuffer_t buffer = {0};
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        original_size += hdr->blocks[i].original_size;
+    }
+    size_t begin = cfg->range_offset;
+    if (begin >= original_size)
+    {
+        fprintf(stderr, "Error: range starts past the end of the archived data (%zu bytes).\n", original_size);
+        exit(EXIT_FAILURE);
+    }
+    size_t end = cfg->range_size > original_size - begin ? original_size : begin + cfg->range_size;
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        const block_descriptor_t *bds = &hdr->blocks[i];
+        size_t points_count = get_sync_points_count(bds->original_size, hdr->sync_interval);
+        size_t block_begin = bds->original_offset;
+        size_t block_end = block_begin + bds->original_size;
+
+        if (block_end > begin && block_begin < end)
+        {
+            size_t from = (begin > block_begin ? begin : block_begin) - block_begin;
+            size_t to = (end < block_end ? end : block_end) - block_begin;
+            size_t first = 0, count = points_count + 1;
+            umemchunk_t input, output = {.data = NULL, .size = SIZE_MAX};
+
+            profile_start(HSTAGE_IO);
+            ufile_reader_set_position(fr, offsets[i]);
+            input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
+            profile_stop(HSTAGE_IO, input.size);
+            if (points_count)
+            {
+                first = from / hdr->sync_interval;
+                count = (to - 1) / hdr->sync_interval + 1 - first;
+            }
+            size_t skip = first * hdr->sync_interval;
+            size_t expected = bds->original_size - skip;
+            if (first + count <= points_count)
+            {
+                expected = count * hdr->sync_interval;
+            }
+            profile_start(HSTAGE_DECODE);
+            if (input.size == bds->compressed_size && points_count)
+            {
+                output = decode_block_segments(decoder, input, points, hdr->sync_interval, bds->original_size,
+                                               first, count, &buffer);
+            }
+            else if (input.size == bds->compressed_size)
+            {
+                output = decode_block(decoder, input, &buffer, bds->original_size);
+            }
+            profile_stop(HSTAGE_DECODE, output.size == SIZE_MAX ? 0 : output.size);
+            if (output.size != expected ||
+                (expected == bds->original_size && crc32c(0, output.data, output.size) != bds->checksum))
+            {
+                fprintf(stderr, "Error: block %zu is corrupted.\n", i);
+                exit(EXIT_FAILURE);
+            }
+            umemchunk_t m = {.data = (uint8_t *)output.data + from - skip, .size = to - from};
+            profile_start(HSTAGE_IO);
+            ufile_writer_write(fw, m);
+            profile_stop(HSTAGE_IO, m.size);
+            decoded_size += output.size;
+            written_size += m.size;
+        }
+        points += points_count;
+    }
+
+    // Blocks cover the archived data, so the whole range has to be there.
+    if (written_size != end - begin)
+    {
+        fprintf(stderr, "Error: only %zu of %zu bytes of the range are in the archive, it is corrupted.\n",
+                written_size, end - begin);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->verbose)
+    {
+        printf("Decoded %zu bytes to extract %zu.\n", decoded_size, end - begin);
+    }
+
+    ubuffer_destroy(&buffer);
+    ufree(offsets);
+}
+
+// Decode blocks of the header, they go through io_uring or ufile, blocks
+// with sync points are decoded by several threads.
+static void decode_archive(ufile_reader_t *fr, const char *input_file, const char *output_file,
+                           const hdecoder_t *decoder, const huffman_archive_header_t *hdr, const hcfg_t *cfg)
+{
+    // Counters measure the calling thread only, so blocks are decoded by the
+    // main thread when profiling.
+    size_t threads = cfg->threads ? cfg->threads : get_cpu_count();
+    bool parallel = hdr->sync_interval && threads > 1 && !cfg->profile;
+    if (!cfg->range && !parallel && cfg->io_engine == HIO_URING)
+    {
+        if (aio_decode(input_file, output_file, decoder, hdr, cfg))
+        {
+            return;
+        }
+        if (cfg->verbose)
+        {
+            printf("io_uring is not available, using ufile I/O.\n");
+        }
+    }
+
+    ufile_writer_t *fw = G_AS_PTR(ufile_writer_create(output_file));
+    if (cfg->range)
+    {
+        decode_range(fr, fw, decoder, hdr, cfg);
+    }
+    else if (parallel)
+    {
+        decode_parallel(fr, fw, decoder, hdr, threads, cfg);
+    }
+    else
+    {
+        decode(fr, fw, decoder, hdr, cfg);
+    }
+    ufile_writer_destroy(fw);
+}
+
+// Read descriptors [first, first + count) of the index at index_offset.
+static bool read_descriptors(ufile_reader_t *fr, size_t index_offset, size_t first, size_t count,
+                             block_descriptor_t *bds)
+{
+    size_t size = count * sizeof(*bds);
+
+    ufile_reader_set_position(fr, index_offset + first * sizeof(*bds));
+
+    return G_AS_MEMCHUNK(ufile_reader_read(fr, size, bds)).size == size;
+}
+
+// Decode blocks one by one, their descriptors are read page_size at a time
+// into page, the index of the header is not loaded.
+static void decode_paged(ufile_reader_t *fr, ufile_writer_t *fw, const hdecoder_t *decoder,
+                         const huffman_archive_header_t *hdr, size_t index_offset, block_descriptor_t *page,
+                         size_t page_size, const hcfg_t *cfg)
+{
+    size_t offset = get_data_offset(hdr);
+    umemchunk_t input, output;
+    ubuffer_t buffer = {0};
+    size_t j = 0;
+    size_t t = 0;
+
+    if (cfg->verbose)
+    {
+        t = hdr->blocks_count / 58;
+        printf("Decoding file (index in pages of %zu blocks): ", page_size);
+    }
+
+    for (size_t first = 0; first < hdr->blocks_count; first += page_size)
+    {
+        size_t count = hdr->blocks_count - first < page_size ? hdr->blocks_count - first : page_size;
+        if (!read_descriptors(fr, index_offset, first, count, page))
+        {
+            fprintf(stderr, "Error: failed to read the index of the archive.\n");
+            exit(EXIT_FAILURE);
+        }
+        ufile_reader_set_position(fr, offset);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const block_descriptor_t *bds = &page[i];
+            profile_start(HSTAGE_IO);
+            input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
+            profile_stop(HSTAGE_IO, input.size);
+            profile_start(HSTAGE_DECODE);
+            output = decode_block(decoder, input, &buffer, bds->original_size);
+            profile_stop(HSTAGE_DECODE, output.size);
+            if (output.size != bds->original_size || crc32c(0, output.data, output.size) != bds->checksum)
+            {
+                fprintf(stderr, "Error: checksum mismatch in block %zu, archive is corrupted.\n", first + i);
+                exit(EXIT_FAILURE);
+            }
+            profile_start(HSTAGE_IO);
+            ufile_writer_write(fw, output);
+            profile_stop(HSTAGE_IO, output.size);
+            offset += bds->compressed_size;
+
+            if (cfg->verbose && j++ > t)
+            {
+                j = 0;
+                printf(".");
+                fflush(stdout);
+            }
+        }
+    }
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+    }
+
+    ubuffer_destroy(&buffer);
+}
+
+// Extraction under --max-memory. The budget has to hold what the process
+// already takes, the reader buffer, the fixed header with codec tables, a
+// page of the index and buffers of the largest block. The rest goes to decoding tables first (LUT gets
+// narrower and FSM is left out if they don't fit), then to the whole index
+// and then to more blocks in flight of --io uring or to decoding a block
+// by several threads. Index which doesn't fit is read in pages.
+static void extract_bounded(ufile_reader_t *fr, const char *input_file, const char *output_file,
+                            const huffman_archive_header_t *hdr, const hcfg_t *cfg)
+{
+    size_t file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (file_size < get_header_size(hdr))
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    size_t index_offset = get_index_offset(hdr, file_size);
+    size_t index_size = get_header_size(hdr) - sizeof(*hdr) - hdr->tables_size; // descriptors and sync points
+
+    // Largest block, the index is scanned a page at a time.
+    size_t page_size = BOUNDED_INDEX_PAGE;
+    block_descriptor_t *page = ucalloc(page_size, sizeof(*page));
+    size_t max_compressed = 0, max_original = 0;
+    for (size_t first = 0; first < hdr->blocks_count; first += page_size)
+    {
+        size_t count = hdr->blocks_count - first < page_size ? hdr->blocks_count - first : page_size;
+        if (!read_descriptors(fr, index_offset, first, count, page))
+        {
+            fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            max_compressed = page[i].compressed_size > max_compressed ? page[i].compressed_size : max_compressed;
+            max_original = page[i].original_size > max_original ? page[i].original_size : max_original;
+        }
+    }
+
+    // Decoders write up to 8 bytes past the block and read guard bytes past
+    // the bitstream.
+    size_t block_memory = max_compressed + max_original + 8 + HBLOCK_GUARD_BYTES;
+    size_t required = get_peak_rss() + cfg->block_size + sizeof(*hdr) + hdr->tables_size + page_size * sizeof(*page) + block_memory;
+    if (cfg->max_memory <= required)
+    {
+        fprintf(stderr, "Error: --max-memory is too small for %s, more than %zu bytes are needed.\n", input_file,
+                required);
+        exit(EXIT_FAILURE);
+    }
+
+    // Decoder is built from the codec tables only, so it can't be
+    // calibrated on the first block.
+    huffman_archive_header_t *tables = umalloc(sizeof(*tables) + hdr->tables_size);
+    *tables = *hdr;
+    tables->blocks_count = 0;
+    tables->sync_points_count = 0;
+    ufile_reader_set_position(fr, index_offset + index_size);
+    if (G_AS_MEMCHUNK(ufile_reader_read(fr, hdr->tables_size, get_header_tables(tables))).size != hdr->tables_size)
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    hcfg_t bounded = *cfg;
+    bounded.max_table_size = cfg->max_memory - required;
+    hdecoder_t *decoder = build_archive_decoder(tables, NULL, &bounded);
+    ufree(tables);
+    if (!decoder)
+    {
+        fprintf(stderr, "Error: %s has corrupted code tables.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    if (decoder->table_size > bounded.max_table_size)
+    {
+        fprintf(stderr, "Error: --max-memory is too small for %s, decoding tables take %zu bytes.\n",
+                input_file, decoder->table_size);
+        exit(EXIT_FAILURE);
+    }
+    size_t left = bounded.max_table_size - decoder->table_size + page_size * sizeof(*page);
+
+    if (index_size <= left)
+    {
+        ufree(page);
+        huffman_archive_header_t *full = load_header(fr);
+        if (!full)
+        {
+            fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+            exit(EXIT_FAILURE);
+        }
+        left -= index_size;
+        bounded.queue_depth = 1 + left / block_memory;
+        if (left < block_memory)
+        {
+            // Parallel decoding keeps copies of block segments.
+            bounded.threads = 1;
+        }
+        if (cfg->verbose)
+        {
+            printf("Memory budget: %zu bytes of decoding tables, %zu of the index, %zu per block in flight.\n",
+                   decoder->table_size, index_size, block_memory);
+        }
+        if (cfg->dump_blocks_map)
+        {
+            print_blocks_map(full);
+        }
+        decode_archive(fr, input_file, output_file, decoder, full, &bounded);
+        ufree(full);
+    }
+    else
+    {
+        if (cfg->range)
+        {
+            fprintf(stderr, "Error: --range needs the whole index of %s, it doesn't fit --max-memory.\n",
+                    input_file);
+            exit(EXIT_FAILURE);
+        }
+        page_size += (left - page_size * sizeof(*page)) / sizeof(*page);
+        page = urealloc(page, page_size * sizeof(*page));
+        if (cfg->verbose)
+        {
+            printf("Memory budget: %zu bytes of decoding tables, index is read in pages of %zu blocks.\n",
+                   decoder->table_size, page_size);
+        }
+        ufile_writer_t *fw = G_AS_PTR(ufile_writer_create(output_file));
+        decode_paged(fr, fw, decoder, hdr, index_offset, page, page_size, &bounded);
+        ufile_writer_destroy(fw);
+        ufree(page);
+    }
+
+    destroy_archive_decoder(decoder);
+    printf("Peak RSS %zu KiB, memory budget %zu KiB.\n", get_peak_rss() >> 10, cfg->max_memory >> 10);
+}
+
+void extract(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    size_t input_size;
+
+    // Load archive header.
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
+    input_size  = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (input_size == 0)
+    {
+        fprintf(stderr, "Error: input file is empty.\n");
+        exit(EXIT_FAILURE);
+    }
+    huffman_archive_header_t *hdr = load_fixed_header(fr);
+    if (!hdr)
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if (hdr->codec == HCODEC_STREAM)
+    {
+        if (cfg->range)
+        {
+            fprintf(stderr, "Error: --range can't be used with stream archives.\n");
+            exit(EXIT_FAILURE);
+        }
+        ufile_reader_destroy(fr);
+        ufree(hdr);
+        if (!stream_extract(input_file, output_file, cfg))
+        {
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    if (cfg->max_memory)
+    {
+        extract_bounded(fr, input_file, output_file, hdr, cfg);
+        ufile_reader_destroy(fr);
+        ufree(hdr);
+        return;
+    }
+
+    ufree(hdr);
+    hdr = load_header(fr);
+    if (!hdr)
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->dump_blocks_map)
+    {
+        print_blocks_map(hdr);
+    }
+
+    // Build Huffman tree(s), daemon workers reuse decoders of the same tables.
+    hdecoder_t *cached = cfg->decoder_cache ? get_cached_decoder(cfg->decoder_cache, hdr, fr, cfg) : NULL;
+    hdecoder_t *decoder = cached ? cached : build_archive_decoder(hdr, fr, cfg);
+    if (!decoder)
+    {
+        fprintf(stderr, "Error: %s has corrupted code tables.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+
+    // Decode.
+    decode_archive(fr, input_file, output_file, decoder, hdr, cfg);
+
+    // Cleanup.
+    ufile_reader_destroy(fr);
+    if (!cached)
+    {
+        destroy_archive_decoder(decoder);
+    }
+    ufree(hdr);
+}
+
+typedef struct {
+    const char *input_file;
+    const hcfg_t *cfg;
+    const huffman_archive_header_t *hdr;
+    const hdecoder_t *decoder;
+    const size_t *offsets;
+    size_t first_block;
+    size_t blocks_count;
+    bool *corrupted; // per block, each chunk sets only its own items
+} test_chunk_t;
+
+static void test_chunk(void *arg)
+{
+    test_chunk_t *chunk = arg;
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(chunk->input_file, chunk->cfg->block_size));
+    ubuffer_t buffer = {0};
+    umemchunk_t input, output;
+
+    ufile_reader_set_position(fr, chunk->offsets[chunk->first_block]);
+    for (size_t i = chunk->first_block; i < chunk->first_block + chunk->blocks_count; i++)
+    {
+        const block_descriptor_t *bds = &chunk->hdr->blocks[i];
+        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
+        if (input.size != bds->compressed_size)
+        {
+            output.size = SIZE_MAX;
+        }
+        else
+        {
+            output = decode_block(chunk->decoder, input, &buffer, bds->original_size);
+        }
+        if (output.size != bds->original_size || crc32c(0, output.data, output.size) != bds->checksum)
+        {
+            chunk->corrupted[i] = true;
+        }
+    }
+
+    ubuffer_destroy(&buffer);
+    ufile_reader_destroy(fr);
+}
+
+// Decode all the blocks in parallel and verify their checksums, decoded
+// data is thrown away.
+bool test_archive(const char *input_file, const hcfg_t *cfg)
+{
+    size_t threads = cfg->threads ? cfg->threads : get_cpu_count();
+    size_t chunks_count, original_size = 0, bad_count = 0;
+    double t;
+
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
+    size_t input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    huffman_archive_header_t *hdr = input_size ? load_header(fr) : NULL;
+    ufile_reader_destroy(fr);
+    if (!hdr)
+    {
+        fprintf(stderr, "Error: %s is not a valid archive.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    if (hdr->codec == HCODEC_STREAM)
+    {
+        ufree(hdr);
+        return stream_extract(input_file, NULL, cfg);
+    }
+
+    size_t *offsets = get_block_offsets(hdr);
+    size_t index_size = (hdr->flags & HARCHIVE_INDEX_AT_END) ? get_header_size(hdr) - sizeof(*hdr) : 0;
+    if (offsets[hdr->blocks_count] + index_size != input_size)
+    {
+        fprintf(stderr, "Error: %s size doesn't match its blocks map, archive is truncated or corrupted.\n",
+                input_file);
+        exit(EXIT_FAILURE);
+    }
+
+    t = get_time();
+    hdecoder_t *decoder = build_archive_decoder(hdr, NULL, cfg);
+    if (!decoder)
+    {
+        fprintf(stderr, "Error: %s has corrupted code tables.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    hpool_t *pool = hpool_create(threads);
+    bool *corrupted = ucalloc(hdr->blocks_count ? hdr->blocks_count : 1, sizeof(bool));
+
+    chunks_count = hdr->blocks_count / TEST_CHUNK_BLOCKS + (bool)(hdr->blocks_count % TEST_CHUNK_BLOCKS);
+    test_chunk_t *chunks = ucalloc(chunks_count ? chunks_count : 1, sizeof(test_chunk_t));
+    for (size_t i = 0; i < chunks_count; i++)
+    {
+        test_chunk_t *chunk = &chunks[i];
+        chunk->input_file = input_file;
+        chunk->cfg = cfg;
+        chunk->hdr = hdr;
+        chunk->decoder = decoder;
+        chunk->offsets = offsets;
+        chunk->first_block = i * TEST_CHUNK_BLOCKS;
+        chunk->blocks_count = hdr->blocks_count - chunk->first_block;
+        if (chunk->blocks_count > TEST_CHUNK_BLOCKS)
+        {
+            chunk->blocks_count = TEST_CHUNK_BLOCKS;
+        }
+        chunk->corrupted = corrupted;
+        hpool_submit(pool, test_chunk, chunk);
+    }
+    hpool_wait(pool);
+    t = get_time() - t;
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        original_size += hdr->blocks[i].original_size;
+        if (corrupted[i])
+        {
+            fprintf(stderr, "Block %zu is corrupted.\n", i);
+            bad_count++;
+        }
+    }
+
+    if (bad_count)
+    {
+        fprintf(stderr, "%s: %zu of %u blocks are corrupted.\n", input_file, bad_count, hdr->blocks_count);
+    }
+    else
+    {
+        printf("%s: OK, %u blocks, %zu bytes verified in %.3f s (%.1f MB/s, %zu threads).\n",
+               input_file, hdr->blocks_count, original_size, t, t > 0 ? original_size / t / 1e6 : 0.0, threads);
+    }
+
+    hpool_destroy(pool);
+    ufree(chunks);
+    ufree(corrupted);
+    destroy_archive_decoder(decoder);
+    ufree(offsets);
+    ufree(hdr);
+
+    return bad_count == 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include "huffman.h"
+
+// Number of blocks verified by one pool task in --test mode.
+#define TEST_CHUNK_BLOCKS 16
+
+// Block descriptors read at a time by --max-memory extraction, the least
+// part of the index kept in memory.
+#define BOUNDED_INDEX_PAGE 256
+
+size_t *split_input(size_t input_size, size_t *blocks_count, const hcfg_t *cfg);
+huffman_archive_header_t *allocate_header(const size_t *offsets, size_t blocks_count, const hstat_t *stat,
+                                          size_t sync_interval, size_t tables_size);
+huffman_archive_header_t *load_header(ufile_reader_t *fr);
+size_t get_header_size(const huffman_archive_header_t *hdr);
+size_t get_data_offset(const huffman_archive_header_t *hdr);
+uint8_t *get_header_tables(const huffman_archive_header_t *hdr);
+size_t *get_block_offsets(const huffman_archive_header_t *hdr);
+void store_header(ufile_writer_t *fw, const huffman_archive_header_t *hdr);
+char *serialize_block(const void *block, size_t *output_size);
+
+hencoder_t *build_archive_encoder(const hstat_t *stats, const size_t *offsets, size_t blocks_count,
+                                  huffman_archive_header_t **hdr, const hcfg_t *cfg);
+size_t predict_archive_size(const hencoder_t *encoder, const huffman_archive_header_t *hdr);
+void destroy_archive_encoder(hencoder_t *encoder);
+hdecoder_t *build_archive_decoder(const huffman_archive_header_t *hdr, ufile_reader_t *fr, const hcfg_t *cfg);
+void destroy_archive_decoder(hdecoder_t *decoder);
+
+void compress(const char *input_file, const char *output_file, const hcfg_t *cfg);
+void append(const char *input_file, const char *output_file, const hcfg_t *cfg);
+void update(const char *input_file, const char *output_file, const hcfg_t *cfg);
+void extract(const char *input_file, const char *output_file, const hcfg_t *cfg);
+bool test_archive(const char *input_file, const hcfg_t *cfg);
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdalign.h>
+#include <stdint.h>
+#include <string.h>
+#include <ugeneric.h>
+#include "arena.h"
+
+typedef struct _arena_chunk {
+    struct _arena_chunk *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) uint8_t data[];
+} arena_chunk_t;
+
+struct _arena {
+    arena_chunk_t *chunks; // the one being filled goes first
+    size_t chunk_size; // size of the next chunk
+};
+
+harena_t *arena_create(size_t chunk_size)
+{
+    UASSERT_INPUT(chunk_size);
+
+    harena_t *arena = uzalloc(sizeof(*arena));
+    arena->chunk_size = chunk_size;
+
+    return arena;
+}
+
+void *arena_alloc(harena_t *arena, size_t size)
+{
+    UASSERT_INPUT(arena);
+
+    arena_chunk_t *chunk = arena->chunks;
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = umalloc(sizeof(*chunk) + chunk_size);
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->chunks = chunk;
+        if (arena->chunk_size < ARENA_MAX_CHUNK_SIZE)
+        {
+            arena->chunk_size *= 2;
+        }
+    }
+
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return p;
+}
+
+void arena_destroy(harena_t *arena)
+{
+    if (arena)
+    {
+        arena_chunk_t *chunk = arena->chunks;
+        while (chunk)
+        {
+            arena_chunk_t *next = chunk->next;
+            ufree(chunk);
+            chunk = next;
+        }
+        ufree(arena);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+typedef struct _arena harena_t;
+
+// Bump allocator for objects sharing a lifetime, such as nodes of a tree.
+// Objects are carved from chunks (each one twice as
+// big as the previous one, up to ARENA_MAX_CHUNK_SIZE) and are never freed
+// one by one, arena_destroy() releases all of them.
+#define ARENA_MAX_CHUNK_SIZE (1024 * 1024)
+
+harena_t *arena_create(size_t chunk_size);
+void *arena_alloc(harena_t *arena, size_t size);
+void arena_destroy(harena_t *arena);
+
+#endif
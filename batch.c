@@ -0,0 +1,591 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <ugeneric.h>
+
+#include "archive.h"
+#include "batch.h"
+#include "crc32c.h"
+#include "pool.h"
+#include "segment.h"
+#include "sync.h"
+#include "util.h"
+
+typedef struct _batch batch_t;
+typedef struct _batch_file batch_file_t;
+
+// Run of consecutive blocks of one file, unit of work for the pool.
+typedef struct {
+    batch_file_t *file;
+    size_t first_block;
+    size_t blocks_count;
+    ubuffer_t *buffers; // output of every block of the chunk
+    bool done;
+} batch_chunk_t;
+
+struct _batch_file {
+    batch_t *batch;
+    char *input_file;
+    char *output_file;
+    size_t input_size;
+    size_t output_size;
+
+    pthread_mutex_t lock;
+    size_t pending;  // chunks left to process in the current stage
+    size_t submitted; // chunks handed to the pool in the coding stage
+    size_t written;  // chunks already written to the output file
+
+    hstat_t *stats; // get_stat_count() histograms
+    hencoder_t *encoder;
+    hdecoder_t *decoder;
+    huffman_archive_header_t *hdr;
+    size_t *offsets; // position of each block in the archive (extraction only)
+    size_t *segments; // position of each block in the input (compression only)
+    size_t blocks_count;
+    ufile_writer_t *fw;
+    batch_chunk_t *chunks;
+    size_t chunks_count;
+};
+
+struct _batch {
+    hcfg_t cfg; // codec config, progress output is disabled
+    bool verbose;
+    hpool_t *pool;
+    size_t chunks_in_flight; // per file in the coding stage
+    pthread_mutex_t lock;
+    size_t files_count;
+    size_t skipped_count;
+    size_t original_bytes;
+    size_t compressed_bytes;
+};
+
+static int compare_strings(const void *s1, const void *s2)
+{
+    return strcmp(s1, s2);
+}
+
+static const char *get_basename(const char *path)
+{
+    const char *s = strrchr(path, '/');
+    return s ? s + 1 : path;
+}
+
+// Input is either a directory (all regular files in it are processed) or
+// a text file with one path per line.
+static uvector_t *gather_inputs(const char *input)
+{
+    struct stat st;
+    uvector_t *inputs = uvector_create();
+    uvector_set_void_destroyer(inputs, free);
+    uvector_set_void_comparator(inputs, compare_strings);
+
+    if (stat(input, &st) != 0)
+    {
+        fprintf(stderr, "Error: can't access %s: %s.\n", input, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(input);
+        struct dirent *e;
+        if (!dir)
+        {
+            fprintf(stderr, "Error: can't open directory %s: %s.\n", input, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        while ((e = readdir(dir)))
+        {
+            char *path = ustring_fmt("%s/%s", input, e->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            {
+                uvector_append(inputs, G_PTR(path));
+            }
+            else
+            {
+                ufree(path);
+            }
+        }
+        closedir(dir);
+        uvector_sort(inputs);
+    }
+    else
+    {
+        FILE *f = fopen(input, "r");
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t len;
+        if (!f)
+        {
+            fprintf(stderr, "Error: can't open list file %s: %s.\n", input, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        while ((len = getline(&line, &line_size, f)) != -1)
+        {
+            while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            {
+                line[--len] = 0;
+            }
+            if (len)
+            {
+                uvector_append(inputs, G_PTR(ustring_fmt("%s", line)));
+            }
+        }
+        free(line);
+        fclose(f);
+    }
+
+    return inputs;
+}
+
+static char *get_output_file(const char *input_file, const char *output_dir, bool extract_mode)
+{
+    const char *name = get_basename(input_file);
+    size_t name_len = strlen(name);
+    size_t suffix_len = strlen(BATCH_ARCHIVE_SUFFIX);
+
+    if (!extract_mode)
+    {
+        return ustring_fmt("%s/%s%s", output_dir, name, BATCH_ARCHIVE_SUFFIX);
+    }
+
+    if (name_len > suffix_len && strcmp(name + name_len - suffix_len, BATCH_ARCHIVE_SUFFIX) == 0)
+    {
+        return ustring_fmt("%s/%.*s", output_dir, (int)(name_len - suffix_len), name);
+    }
+
+    return ustring_fmt("%s/%s.out", output_dir, name);
+}
+
+static int compare_output_files(const void *f1, const void *f2)
+{
+    const batch_file_t *file1 = *(const batch_file_t **)f1;
+    const batch_file_t *file2 = *(const batch_file_t **)f2;
+    int r = strcmp(file1->output_file, file2->output_file);
+    if (r)
+    {
+        return r;
+    }
+    return (file1 > file2) - (file1 < file2);
+}
+
+// Inputs of the same name from different directories (or listed twice)
+// would overwrite the output of each other, only the first of them is
+// processed.
+static bool *find_duplicate_outputs(batch_file_t *files, size_t files_count)
+{
+    bool *duplicates = ucalloc(files_count ? files_count : 1, sizeof(bool));
+    batch_file_t **sorted = umalloc((files_count ? files_count : 1) * sizeof(batch_file_t *));
+
+    for (size_t i = 0; i < files_count; i++)
+    {
+        sorted[i] = &files[i];
+    }
+    qsort(sorted, files_count, sizeof(sorted[0]), compare_output_files);
+
+    const batch_file_t *first = NULL;
+    for (size_t i = 0; i < files_count; i++)
+    {
+        if (first && strcmp(first->output_file, sorted[i]->output_file) == 0)
+        {
+            duplicates[sorted[i] - files] = true;
+        }
+        else
+        {
+            first = sorted[i];
+        }
+    }
+    ufree(sorted);
+
+    return duplicates;
+}
+
+static void setup_chunks(batch_file_t *file, size_t blocks_count)
+{
+    file->chunks_count = blocks_count / BATCH_CHUNK_BLOCKS + (bool)(blocks_count % BATCH_CHUNK_BLOCKS);
+    file->chunks = ucalloc(file->chunks_count, sizeof(batch_chunk_t));
+    for (size_t i = 0; i < file->chunks_count; i++)
+    {
+        batch_chunk_t *chunk = &file->chunks[i];
+        chunk->file = file;
+        chunk->first_block = i * BATCH_CHUNK_BLOCKS;
+        chunk->blocks_count = blocks_count - chunk->first_block;
+        if (chunk->blocks_count > BATCH_CHUNK_BLOCKS)
+        {
+            chunk->blocks_count = BATCH_CHUNK_BLOCKS;
+        }
+    }
+    file->pending = file->chunks_count;
+}
+
+static void skip_file(batch_file_t *file, const char *reason)
+{
+    batch_t *b = file->batch;
+
+    fprintf(stderr, "Warning: skipping %s: %s.\n", file->input_file, reason);
+    pthread_mutex_lock(&b->lock);
+    b->skipped_count++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void finish_file(batch_file_t *file, size_t original_size, size_t compressed_size)
+{
+    batch_t *b = file->batch;
+
+    if (b->verbose)
+    {
+        printf("%s -> %s (%zu -> %zu bytes)\n", file->input_file, file->output_file,
+               file->input_size, file->output_size);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->files_count++;
+    b->original_bytes += original_size;
+    b->compressed_bytes += compressed_size;
+    pthread_mutex_unlock(&b->lock);
+
+    ufree(file->chunks);
+    file->chunks = NULL;
+}
+
+static void finish_compression(batch_file_t *file)
+{
+    store_header(file->fw, file->hdr);
+    file->output_size += get_header_size(file->hdr);
+    ufile_writer_destroy(file->fw);
+
+    finish_file(file, file->input_size, file->output_size);
+
+    ufree(file->hdr);
+    ufree(file->stats);
+    ufree(file->segments);
+    destroy_archive_encoder(file->encoder);
+}
+
+static void finish_extraction(batch_file_t *file)
+{
+    ufile_writer_destroy(file->fw);
+
+    finish_file(file, file->output_size, file->input_size);
+
+    destroy_archive_decoder(file->decoder);
+    ufree(file->offsets);
+    ufree(file->hdr);
+}
+
+static void submit_chunks(batch_file_t *file);
+
+// Write out all the finished chunks which follow the already written ones,
+// chunks may complete in any order but the output is written sequentially.
+static void flush_chunks(batch_chunk_t *chunk)
+{
+    batch_file_t *file = chunk->file;
+    bool finished;
+
+    pthread_mutex_lock(&file->lock);
+    chunk->done = true;
+    while (file->written < file->chunks_count && file->chunks[file->written].done)
+    {
+        batch_chunk_t *c = &file->chunks[file->written];
+        for (size_t i = 0; i < c->blocks_count; i++)
+        {
+            umemchunk_t m = {.data = c->buffers[i].data, .size = c->buffers[i].data_size};
+            ufile_writer_write(file->fw, m);
+            file->output_size += m.size;
+            ubuffer_destroy(&c->buffers[i]);
+        }
+        ufree(c->buffers);
+        c->buffers = NULL;
+        file->written++;
+    }
+    submit_chunks(file);
+    finished = (file->written == file->chunks_count);
+    pthread_mutex_unlock(&file->lock);
+
+    if (finished)
+    {
+        (file->decoder ? finish_extraction : finish_compression)(file);
+    }
+}
+
+static void encode_chunk(void *arg)
+{
+    batch_chunk_t *chunk = arg;
+    batch_file_t *file = chunk->file;
+    const hcfg_t *cfg = &file->batch->cfg;
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(file->input_file, cfg->block_size));
+    umemchunk_t input, output;
+
+    uint64_t *points = get_block_sync_points(file->hdr, chunk->first_block);
+
+    chunk->buffers = ucalloc(chunk->blocks_count, sizeof(ubuffer_t));
+    ufile_reader_set_position(fr, file->segments[chunk->first_block]);
+    for (size_t i = 0; i < chunk->blocks_count; i++)
+    {
+        block_descriptor_t *bds = &file->hdr->blocks[chunk->first_block + i];
+        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->original_size, NULL));
+        output = encode_block(file->encoder, input, &chunk->buffers[i]);
+        if (file->hdr->sync_interval)
+        {
+            build_sync_points(file->encoder->htable, input, file->hdr->sync_interval, points);
+            points += get_sync_points_count(input.size, file->hdr->sync_interval);
+        }
+        bds->compressed_size = output.size;
+        bds->checksum = crc32c(0, input.data, input.size);
+    }
+    ufile_reader_destroy(fr);
+
+    flush_chunks(chunk);
+}
+
+static void start_encoding(batch_file_t *file)
+{
+    batch_t *b = file->batch;
+
+    file->encoder = build_archive_encoder(file->stats, file->segments, file->blocks_count, &file->hdr, &b->cfg);
+    file->fw = G_AS_PTR(ufile_writer_create(file->output_file));
+    ufile_writer_set_position(file->fw, get_data_offset(file->hdr));
+
+    pthread_mutex_lock(&file->lock);
+    submit_chunks(file);
+    pthread_mutex_unlock(&file->lock);
+}
+
+static void stat_chunk(void *arg)
+{
+    batch_chunk_t *chunk = arg;
+    batch_file_t *file = chunk->file;
+    const hcfg_t *cfg = &file->batch->cfg;
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(file->input_file, cfg->block_size));
+    size_t stats_count = get_stat_count(file->blocks_count, cfg);
+    umemchunk_t m;
+    bool last;
+
+    // Per block histograms go straight to the file stat as chunks never
+    // share blocks, other ones are merged.
+    hstat_t *stats = cfg->adaptive ? file->stats : ucalloc(stats_count, sizeof(hstat_t));
+
+    ufile_reader_set_position(fr, file->segments[chunk->first_block]);
+    for (size_t i = 0; i < chunk->blocks_count; i++)
+    {
+        m = G_AS_MEMCHUNK(ufile_reader_read(fr, cfg->block_size, NULL));
+        update_stat(stats, chunk->first_block + i, m, cfg);
+    }
+    ufile_reader_destroy(fr);
+
+    pthread_mutex_lock(&file->lock);
+    if (stats != file->stats)
+    {
+        for (size_t i = 0; i < stats_count; i++)
+        {
+            merge_stat(&file->stats[i], &stats[i]);
+        }
+        ufree(stats);
+    }
+    last = (--file->pending == 0);
+    pthread_mutex_unlock(&file->lock);
+
+    if (last)
+    {
+        start_encoding(file);
+    }
+}
+
+static void start_compression(void *arg)
+{
+    batch_file_t *file = arg;
+    batch_t *b = file->batch;
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(file->input_file, b->cfg.block_size));
+
+    file->input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (file->input_size == 0)
+    {
+        ufile_reader_destroy(fr);
+        skip_file(file, "input file is empty");
+        return;
+    }
+
+    // Segmentation is sequential, blocks are encoded in parallel anyway.
+    if (b->cfg.segment)
+    {
+        file->stats = build_segment_stat(fr, &file->segments, &file->blocks_count, &b->cfg);
+        ufile_reader_destroy(fr);
+        setup_chunks(file, file->blocks_count);
+        start_encoding(file);
+        return;
+    }
+    ufile_reader_destroy(fr);
+
+    file->segments = split_input(file->input_size, &file->blocks_count, &b->cfg);
+    file->stats = ucalloc(get_stat_count(file->blocks_count, &b->cfg), sizeof(hstat_t));
+    setup_chunks(file, file->blocks_count);
+    for (size_t i = 0; i < file->chunks_count; i++)
+    {
+        hpool_submit(b->pool, stat_chunk, &file->chunks[i]);
+    }
+}
+
+static void decode_chunk(void *arg)
+{
+    batch_chunk_t *chunk = arg;
+    batch_file_t *file = chunk->file;
+    const hcfg_t *cfg = &file->batch->cfg;
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(file->input_file, cfg->block_size));
+    umemchunk_t input, output;
+
+    chunk->buffers = ucalloc(chunk->blocks_count, sizeof(ubuffer_t));
+    ufile_reader_set_position(fr, file->offsets[chunk->first_block]);
+    for (size_t i = 0; i < chunk->blocks_count; i++)
+    {
+        const block_descriptor_t *bds = &file->hdr->blocks[chunk->first_block + i];
+        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
+        output = decode_block(file->decoder, input, &chunk->buffers[i], bds->original_size);
+        if (output.size != bds->original_size || crc32c(0, output.data, output.size) != bds->checksum)
+        {
+            fprintf(stderr, "Error: checksum mismatch in %s block %zu, archive is corrupted.\n",
+                    file->input_file, chunk->first_block + i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    ufile_reader_destroy(fr);
+
+    flush_chunks(chunk);
+}
+
+static void start_extraction(void *arg)
+{
+    batch_file_t *file = arg;
+    batch_t *b = file->batch;
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(file->input_file, b->cfg.block_size));
+    huffman_archive_header_t *hdr;
+
+    file->input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    hdr = file->input_size ? load_header(fr) : NULL;
+    if (!hdr || !hdr->blocks_count)
+    {
+        ufile_reader_destroy(fr);
+        ufree(hdr);
+        skip_file(file, "not a valid archive");
+        return;
+    }
+
+    file->decoder = build_archive_decoder(hdr, fr, &b->cfg);
+    ufile_reader_destroy(fr);
+    if (!file->decoder)
+    {
+        ufree(hdr);
+        skip_file(file, "corrupted code tables");
+        return;
+    }
+
+    file->hdr = hdr;
+    setup_chunks(file, hdr->blocks_count);
+
+    file->offsets = get_block_offsets(hdr);
+
+    file->fw = G_AS_PTR(ufile_writer_create(file->output_file));
+    pthread_mutex_lock(&file->lock);
+    submit_chunks(file);
+    pthread_mutex_unlock(&file->lock);
+}
+
+// Chunks are coded in order and only a few of them per file are in
+// flight, so chunks finished ahead of the one to be written next take
+// bounded memory however large the file is. Called with the file lock
+// held.
+static void submit_chunks(batch_file_t *file)
+{
+    batch_t *b = file->batch;
+
+    while (file->submitted < file->chunks_count && file->submitted - file->written < b->chunks_in_flight)
+    {
+        hpool_submit(b->pool, file->decoder ? decode_chunk : encode_chunk, &file->chunks[file->submitted++]);
+    }
+}
+
+void batch(const char *input, const char *output_dir, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(input);
+    UASSERT_INPUT(output_dir);
+    UASSERT_INPUT(cfg);
+
+    batch_t b = {
+        .cfg = *cfg,
+        .verbose = cfg->verbose,
+    };
+    uvector_t *inputs = gather_inputs(input);
+    size_t files_count = uvector_get_size(inputs);
+    size_t threads = cfg->threads ? cfg->threads : get_cpu_count();
+    batch_file_t *files = ucalloc(files_count ? files_count : 1, sizeof(batch_file_t));
+    double t;
+
+    // Workers must not print progress or dump tables concurrently.
+    b.cfg.verbose = false;
+    b.cfg.dump_tree = false;
+    b.cfg.dump_table = false;
+    b.cfg.dump_lookup_table = false;
+
+    if (mkdir(output_dir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: can't create directory %s: %s.\n", output_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->verbose)
+    {
+        printf("Batch %s of %zu files using %zu threads.\n",
+               cfg->extract_mode ? "extraction" : "compression", files_count, threads);
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    b.pool = hpool_create(threads);
+    b.chunks_in_flight = threads * BATCH_CHUNKS_PER_THREAD;
+
+    t = get_time();
+    for (size_t i = 0; i < files_count; i++)
+    {
+        batch_file_t *file = &files[i];
+        file->batch = &b;
+        file->input_file = G_AS_PTR(uvector_get_at(inputs, i));
+        file->output_file = get_output_file(file->input_file, output_dir, cfg->extract_mode);
+        pthread_mutex_init(&file->lock, NULL);
+    }
+    bool *duplicates = find_duplicate_outputs(files, files_count);
+    for (size_t i = 0; i < files_count; i++)
+    {
+        if (duplicates[i])
+        {
+            char *reason = ustring_fmt("another input is also written to %s", files[i].output_file);
+            skip_file(&files[i], reason);
+            ufree(reason);
+        }
+        else
+        {
+            hpool_submit(b.pool, cfg->extract_mode ? start_extraction : start_compression, &files[i]);
+        }
+    }
+    ufree(duplicates);
+    hpool_wait(b.pool);
+    t = get_time() - t;
+
+    printf("Processed %zu files (%zu skipped): %zu bytes original, %zu bytes compressed, ratio %.3f.\n",
+           b.files_count, b.skipped_count, b.original_bytes, b.compressed_bytes,
+           b.original_bytes ? (double)b.compressed_bytes / b.original_bytes : 0.0);
+    printf("Time %.3f s, throughput %.1f MB/s (original data).\n",
+           t, t > 0 ? b.original_bytes / t / 1e6 : 0.0);
+    if (cfg->verbose)
+    {
+        printf("Tasks stolen between workers: %zu.\n", hpool_get_steals(b.pool));
+    }
+
+    hpool_destroy(b.pool);
+    pthread_mutex_destroy(&b.lock);
+    for (size_t i = 0; i < files_count; i++)
+    {
+        pthread_mutex_destroy(&files[i].lock);
+        ufree(files[i].output_file);
+    }
+    ufree(files);
+    uvector_destroy(inputs);
+}
@@ -0,0 +1,19 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "huffman.h"
+
+// Number of blocks processed by one pool task, large files are split into
+// such chunks so that a single big file keeps all the workers busy.
+#define BATCH_CHUNK_BLOCKS 32
+
+// Chunks of a file coded at once per worker thread. Finished chunks are
+// kept in memory until the chunks before them are written.
+#define BATCH_CHUNKS_PER_THREAD 2
+
+// Archive name suffix used in batch mode.
+#define BATCH_ARCHIVE_SUFFIX ".huf"
+
+void batch(const char *input, const char *output_dir, const hcfg_t *cfg);
+
+#endif
@@ -0,0 +1,299 @@
+#include <ugeneric.h>
+#include "bench.h"
+#include "frame.h"
+#include "util.h"
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t blocks_count;
+    size_t block_size;
+} bench_input_t;
+
+static bench_input_t load_input(const char *input_file, const hcfg_t *cfg)
+{
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
+    bench_input_t input = {0};
+    umemchunk_t m;
+
+    input.size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    if (input.size > BENCH_MAX_INPUT_SIZE)
+    {
+        input.size = BENCH_MAX_INPUT_SIZE;
+    }
+    input.data = umalloc(input.size);
+    m = G_AS_MEMCHUNK(ufile_reader_read(fr, input.size, input.data));
+    UASSERT(m.size == input.size);
+    ufile_reader_destroy(fr);
+
+    input.block_size = cfg->block_size;
+    input.blocks_count = input.size / input.block_size + (bool)(input.size % input.block_size);
+
+    return input;
+}
+
+static umemchunk_t get_block(const bench_input_t *input, size_t i)
+{
+    umemchunk_t m = {
+        .data = input->data + i * input->block_size,
+        .size = input->block_size,
+    };
+    if (i == input->blocks_count - 1)
+    {
+        m.size = input->size - i * input->block_size;
+    }
+    return m;
+}
+
+// Encode the whole input with the encoder, compressed blocks are stored
+// back to back into the output.
+static void encode_input(const hencoder_t *encoder, const bench_input_t *input,
+                         ubuffer_t *buffer, ubuffer_t *output)
+{
+    ubuffer_reset(output);
+    for (size_t i = 0; i < input->blocks_count; i++)
+    {
+        umemchunk_t m = encode_block(encoder, get_block(input, i), buffer);
+        ubuffer_append_data(output, m.data, m.size);
+    }
+}
+
+static void bench_encoders(const bench_input_t *input, const htable_t *table, const hcfg_t *cfg)
+{
+    ubuffer_t buffer = {0};
+    ubuffer_t reference = {0};
+    ubuffer_t output = {0};
+    hcfg_t ecfg = *cfg;
+    double scalar_speed = 0;
+
+    ecfg.encoder = HENCODER_SCALAR;
+    hencoder_t *encoder = build_encoder(table, &ecfg);
+    encode_input(encoder, input, &buffer, &reference);
+    destroy_encoder(encoder);
+
+    printf("%-12s %10s %9s  %s\n", "Encoder", "MB/s", "Speedup", "Output");
+    for (hencoder_type_t type = HENCODER_SCALAR; type < HENCODER_COUNT; type++)
+    {
+        size_t runs = 0;
+        double t, speed;
+
+        if (!encoder_is_supported(type, table))
+        {
+            printf("%-12s %10s %9s  %s\n", get_encoder_name(type), "-", "-", "not supported");
+            continue;
+        }
+
+        ecfg.encoder = type;
+        encoder = build_encoder(table, &ecfg);
+        t = get_time();
+        do
+        {
+            encode_input(encoder, input, &buffer, &output);
+            runs++;
+        } while (get_time() - t < BENCH_MIN_SECONDS);
+        t = get_time() - t;
+        destroy_encoder(encoder);
+
+        speed = input->size * runs / t / 1e6;
+        if (type == HENCODER_SCALAR)
+        {
+            scalar_speed = speed;
+        }
+
+        bool same = (output.data_size == reference.data_size) &&
+                    (memcmp(output.data, reference.data, output.data_size) == 0);
+        printf("%-12s %10.1f %8.2fx  %s\n", get_encoder_name(type), speed, speed / scalar_speed,
+               same ? "identical" : "MISMATCH");
+    }
+
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&reference);
+    ubuffer_destroy(&output);
+}
+
+static void bench_decoders(const bench_input_t *input, const hnode_t *root, const htable_t *table,
+                           const hcfg_t *cfg)
+{
+    ubuffer_t buffer = {0};
+    ubuffer_t encoded = {0};
+    ubuffer_t output = {0};
+    size_t *offsets = umalloc((input->blocks_count + 1) * sizeof(size_t));
+    hcfg_t dcfg = *cfg;
+    double tree_speed = 0;
+
+    hencoder_t *encoder = build_encoder(table, cfg);
+    offsets[0] = 0;
+    for (size_t i = 0; i < input->blocks_count; i++)
+    {
+        umemchunk_t m = encode_block(encoder, get_block(input, i), &buffer);
+        ubuffer_append_data(&encoded, m.data, m.size);
+        offsets[i + 1] = encoded.data_size;
+    }
+    destroy_encoder(encoder);
+
+    printf("%-12s %10s %9s %12s  %s\n", "Decoder", "MB/s", "Speedup", "Table bytes", "Output");
+    for (hdecoder_type_t type = HDECODER_TREE; type < HDECODER_COUNT; type++)
+    {
+        size_t runs = 0;
+        bool same = true;
+        double t, speed;
+
+        if (!decoder_is_supported(type, root, cfg))
+        {
+            printf("%-12s %10s %9s %12s  %s\n", get_decoder_name(type), "-", "-", "-", "not supported");
+            continue;
+        }
+
+        dcfg.decoder = type;
+        hdecoder_t *decoder = build_decoder(root, &dcfg);
+        t = get_time();
+        do
+        {
+            for (size_t i = 0; i < input->blocks_count; i++)
+            {
+                umemchunk_t block = get_block(input, i);
+                umemchunk_t in = {
+                    .data = (uint8_t *)encoded.data + offsets[i],
+                    .size = offsets[i + 1] - offsets[i],
+                };
+                umemchunk_t m = decode_block(decoder, in, &output, block.size);
+                if (runs == 0)
+                {
+                    same = same && (m.size == block.size) && (memcmp(m.data, block.data, m.size) == 0);
+                }
+            }
+            runs++;
+        } while (get_time() - t < BENCH_MIN_SECONDS);
+        t = get_time() - t;
+
+        speed = input->size * runs / t / 1e6;
+        if (type == HDECODER_TREE)
+        {
+            tree_speed = speed;
+        }
+        printf("%-12s %10.1f %8.2fx %12zu  %s\n", get_decoder_name(type), speed, speed / tree_speed,
+               decoder->table_size, same ? "identical" : "MISMATCH");
+        destroy_decoder(decoder);
+    }
+
+    ufree(offsets);
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&encoded);
+    ubuffer_destroy(&output);
+}
+
+// Every message is compressed into a frame and decompressed back, one frame
+// codec has a shared table built from the whole input, the other one packs
+// a table into every frame which pays off.
+static void bench_frames(const bench_input_t *input, const hstat_t *stat, const hcfg_t *cfg)
+{
+    ubuffer_t frame = {0};
+    ubuffer_t frames = {0};
+    ubuffer_t buffer = {0};
+    size_t *offsets = umalloc((input->blocks_count + 1) * sizeof(size_t));
+    const char *names[] = {"shared", "packed"};
+
+    printf("%-12s %8s %14s %10s %14s %10s  %s\n", "Frames", "Ratio", "Compress/s", "ns/msg",
+           "Decompress/s", "ns/msg", "Output");
+    for (size_t k = 0; k < 2; k++)
+    {
+        hframe_codec_t *codec = build_frame_codec(stat, k == 0, cfg);
+        size_t runs = 0;
+        bool same = true;
+        double tc, td;
+
+        // Frames of the last run are kept for decompression.
+        tc = get_time();
+        do
+        {
+            ubuffer_reset(&frames);
+            offsets[0] = 0;
+            for (size_t i = 0; i < input->blocks_count; i++)
+            {
+                umemchunk_t m = frame_compress(codec, get_block(input, i), &frame);
+                ubuffer_append_data(&frames, m.data, m.size);
+                offsets[i + 1] = frames.data_size;
+            }
+            runs++;
+        } while (get_time() - tc < BENCH_MIN_SECONDS);
+        tc = (get_time() - tc) / (runs * input->blocks_count);
+
+        runs = 0;
+        td = get_time();
+        do
+        {
+            for (size_t i = 0; i < input->blocks_count; i++)
+            {
+                umemchunk_t block = get_block(input, i);
+                umemchunk_t in = {
+                    .data = (uint8_t *)frames.data + offsets[i],
+                    .size = offsets[i + 1] - offsets[i],
+                };
+                umemchunk_t m;
+                bool ok = frame_decompress(codec, in, &buffer, &m);
+                if (runs == 0)
+                {
+                    same = same && ok && (m.size == block.size) && (memcmp(m.data, block.data, m.size) == 0);
+                }
+            }
+            runs++;
+        } while (get_time() - td < BENCH_MIN_SECONDS);
+        td = (get_time() - td) / (runs * input->blocks_count);
+
+        printf("%-12s %8.3f %14.0f %10.1f %14.0f %10.1f  %s\n", names[k],
+               (double)frames.data_size / input->size, 1 / tc, tc * 1e9, 1 / td, td * 1e9,
+               same ? "identical" : "MISMATCH");
+        destroy_frame_codec(codec);
+    }
+
+    ufree(offsets);
+    ubuffer_destroy(&frame);
+    ubuffer_destroy(&frames);
+    ubuffer_destroy(&buffer);
+}
+
+void bench(const char *input_file, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(input_file);
+    UASSERT_INPUT(cfg);
+
+    hcfg_t qcfg = *cfg;
+    qcfg.verbose = false;
+    qcfg.dump_tree = false;
+
+    bench_input_t input = load_input(input_file, cfg);
+    if (input.size == 0)
+    {
+        fprintf(stderr, "Error: input file is empty.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    hstat_t stat = {0};
+    for (size_t i = 0; i < input.size; i++)
+    {
+        stat.frequencies[input.data[i]]++;
+    }
+
+    // Input is split into messages of the given size.
+    if (cfg->message_size)
+    {
+        input.block_size = cfg->message_size;
+        input.blocks_count = input.size / input.block_size + (bool)(input.size % input.block_size);
+        printf("Benchmarking %s: %zu bytes in %zu messages.\n", input_file, input.size, input.blocks_count);
+        bench_frames(&input, &stat, &qcfg);
+        ufree(input.data);
+        return;
+    }
+
+    hnode_t *root = build_tree(&qcfg, &stat);
+    htable_t *table = build_codes(root, &qcfg);
+
+    printf("Benchmarking %s: %zu bytes in %zu blocks, max code length %u.\n",
+           input_file, input.size, input.blocks_count, table->max_code_len);
+    bench_encoders(&input, table, &qcfg);
+    bench_decoders(&input, root, table, &qcfg);
+
+    ufree(table);
+    destroy_tree(root);
+    ufree(input.data);
+}
@@ -0,0 +1,14 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "huffman.h"
+
+// Minimal time spent measuring every engine.
+#define BENCH_MIN_SECONDS 0.5
+
+// Only that much of the input file is loaded for benchmarking.
+#define BENCH_MAX_INPUT_SIZE (256 * 1024 * 1024)
+
+void bench(const char *input_file, const hcfg_t *cfg);
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef __BITIO_H__
+#define __BITIO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ugeneric.h>
+
+// Guard bytes appended to every encoded block, decoders reading several
+// bytes at once are allowed to touch them.
+#define HBLOCK_GUARD_BYTES 4
+
+// Bit writer collecting up to 63 pending bits in a register and storing
+// them 8 bytes at a time, the output must have 8 spare bytes at the end.
+typedef struct {
+    uint8_t *out;
+    uint64_t bits;
+    unsigned int bits_len;
+} bit_writer_t;
+
+static inline void bit_writer_init(bit_writer_t *bw, ubuffer_t *buffer, size_t input_size, size_t max_code_len)
+{
+    // Worst case size plus spare room for 8-byte stores and guard bytes.
+    ubuffer_reserve_capacity(buffer, (input_size * max_code_len) / 8 + 16 + HBLOCK_GUARD_BYTES);
+    bw->out = buffer->data;
+    bw->bits = 0;
+    bw->bits_len = 0;
+}
+
+static inline void put_bits(bit_writer_t *bw, uint64_t code, unsigned int len)
+{
+    unsigned int total = bw->bits_len + len;
+
+    bw->bits |= code << bw->bits_len;
+    if (total < 64)
+    {
+        bw->bits_len = total;
+        return;
+    }
+
+    memcpy(bw->out, &bw->bits, sizeof(bw->bits));
+    bw->out += sizeof(bw->bits);
+    bw->bits = bw->bits_len ? code >> (64 - bw->bits_len) : 0;
+    bw->bits_len = total - 64;
+}
+
+// Flush pending bits and append guard bytes, output is laid out exactly as
+// the one of the scalar encoder: at least one byte of bitstream followed by
+// zero guard bytes.
+static inline umemchunk_t bit_writer_finish(bit_writer_t *bw, ubuffer_t *buffer)
+{
+    while (bw->bits_len)
+    {
+        *bw->out++ = (uint8_t)bw->bits;
+        bw->bits >>= 8;
+        bw->bits_len = (bw->bits_len > 8) ? bw->bits_len - 8 : 0;
+    }
+
+    buffer->data_size = bw->out - (uint8_t *)buffer->data;
+    if (buffer->data_size == 0)
+    {
+        ((uint8_t *)buffer->data)[buffer->data_size++] = 0;
+    }
+    memset((uint8_t *)buffer->data + buffer->data_size, 0, HBLOCK_GUARD_BYTES);
+    buffer->data_size += HBLOCK_GUARD_BYTES;
+
+    umemchunk_t output = {
+        .data = buffer->data,
+        .size = buffer->data_size,
+    };
+
+    return output;
+}
+
+// Bit reader keeping 56 to 63 bits in a register after refill, bits are
+// consumed from the LSB side. Refill loads 8 bytes at a time while they are
+// available and never reads past the end of the input.
+typedef struct {
+    const uint8_t *in;
+    const uint8_t *end;
+    uint64_t bits;
+    unsigned int avail;
+} bit_reader_t;
+
+static inline void bit_reader_init(bit_reader_t *br, const void *data, size_t size)
+{
+    br->in = data;
+    br->end = br->in + size;
+    br->bits = 0;
+    br->avail = 0;
+}
+
+static inline void bit_reader_refill(bit_reader_t *br)
+{
+    if (br->end - br->in >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, br->in, sizeof(w));
+        br->bits |= w << br->avail;
+        br->in += (63 - br->avail) >> 3;
+        br->avail |= 56;
+        return;
+    }
+
+    while (br->avail <= 56 && br->in < br->end)
+    {
+        br->bits |= (uint64_t)*br->in++ << br->avail;
+        br->avail += 8;
+    }
+}
+
+static inline uint64_t bit_reader_peek(const bit_reader_t *br, unsigned int nbits)
+{
+    return br->bits & ((1LLU << nbits) - 1);
+}
+
+static inline void bit_reader_skip(bit_reader_t *br, unsigned int nbits)
+{
+    br->bits >>= nbits;
+    br->avail -= nbits;
+}
+
+// Unsigned integers are stored as varints, 7 bits per byte, LSB first.
+static inline void append_varint(ubuffer_t *output, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        ubuffer_append_byte(output, (value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    ubuffer_append_byte(output, value);
+}
+
+static inline bool read_varint(const uint8_t **p, const uint8_t *end, uint32_t *value)
+{
+    *value = 0;
+    for (unsigned int shift = 0; shift < 32; shift += 7)
+    {
+        if (*p == end)
+        {
+            return false;
+        }
+        uint8_t byte = *(*p)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
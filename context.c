@@ -0,0 +1,399 @@
+#include <ugeneric.h>
+#include "bitio.h"
+#include "context.h"
+
+// Decoding tables of one code table: codes up to nbits long are resolved by
+// a single lookup, longer ones by walking the tree.
+typedef struct {
+    hnode_t *root;
+    uint16_t *peek; // symbol | code length << 8, 0 length for long codes
+    uint8_t nbits;
+} hcontext_table_t;
+
+struct _context_decoder {
+    hcontext_table_t *tables;
+    size_t tables_count;
+    const hcontext_table_t *by_context[CONTEXTS_COUNT];
+};
+
+void update_context_stat(hstat_t *stats, umemchunk_t m)
+{
+    const uint8_t *data = m.data;
+    uint8_t context = 0;
+
+    for (size_t j = 0; j < m.size; j++)
+    {
+        stats[context].frequencies[data[j]]++;
+        context = data[j];
+    }
+}
+
+static size_t get_stat_total(const hstat_t *stat)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        total += stat->frequencies[i];
+    }
+    return total;
+}
+
+
+// Add table to the model unless an identical one is there already, returns
+// index of the table in the model. Model takes ownership of the table.
+static uint8_t add_table(hcontext_model_t *model, htable_t *table)
+{
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        if (have_same_code_lengths(model->tables[i], table))
+        {
+            ufree(table);
+            return i;
+        }
+    }
+
+    UASSERT(model->tables_count < CONTEXTS_COUNT);
+    model->tables[model->tables_count] = table;
+    return model->tables_count++;
+}
+
+// One table per context, contexts which are too rare to pay for their own
+// table or whose own table costs more than it saves compared to the order-0
+// table are all coded with one table built from their joint stat.
+hcontext_model_t *build_context_model(const hstat_t *stats, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(stats);
+    UASSERT_INPUT(cfg);
+
+    htable_t *own[CONTEXTS_COUNT] = {0};
+    bool shared[CONTEXTS_COUNT] = {0};
+    hstat_t total_stat = {0};
+    hstat_t shared_stat = {0};
+    htable_t *total_table = NULL;
+    htable_t *shared_table = NULL;
+    int shared_index = -1;
+
+    for (size_t i = 0; i < CONTEXTS_COUNT; i++)
+    {
+        merge_stat(&total_stat, &stats[i]);
+    }
+    total_table = build_canonical_table(&total_stat, cfg);
+
+    for (size_t i = 0; i < CONTEXTS_COUNT; i++)
+    {
+        size_t total = get_stat_total(&stats[i]);
+        if (total >= CONTEXT_MIN_COUNT)
+        {
+            own[i] = build_canonical_table(&stats[i], cfg);
+            if (get_coded_bits(total_table, &stats[i]) > get_coded_bits(own[i], &stats[i]) + get_packed_bits(own[i]))
+            {
+                continue;
+            }
+            ufree(own[i]);
+            own[i] = NULL;
+        }
+        if (total)
+        {
+            shared[i] = true;
+            merge_stat(&shared_stat, &stats[i]);
+        }
+    }
+    ufree(total_table);
+
+    if (get_stat_total(&shared_stat))
+    {
+        shared_table = build_canonical_table(&shared_stat, cfg);
+    }
+
+    hcontext_model_t *model = uzalloc(sizeof(*model));
+    model->tables = ucalloc(CONTEXTS_COUNT, sizeof(htable_t *));
+    for (size_t i = 0; i < CONTEXTS_COUNT; i++)
+    {
+        if (own[i])
+        {
+            model->context_map[i] = add_table(model, own[i]);
+        }
+        else if (shared[i])
+        {
+            if (shared_index < 0)
+            {
+                shared_index = add_table(model, shared_table);
+            }
+            model->context_map[i] = shared_index;
+        }
+        // Contexts which never occur use table 0.
+    }
+
+    if (cfg->verbose)
+    {
+        printf("Order-1 model: %zu tables.\n", model->tables_count);
+    }
+
+    return model;
+}
+
+// Packed model: number of tables minus one, table index of every context,
+// then packed code lengths of every table.
+void pack_context_model(const hcontext_model_t *model, ubuffer_t *output)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(output);
+
+    ubuffer_append_byte(output, model->tables_count - 1);
+    ubuffer_append_data(output, model->context_map, sizeof(model->context_map));
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        pack_code_lengths(model->tables[i], output);
+    }
+}
+
+// Returns NULL if data is not a valid packed model.
+hcontext_model_t *unpack_context_model(const uint8_t *data, size_t size)
+{
+    UASSERT_INPUT(data);
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    hcontext_model_t *model;
+
+    if (size < 1 + CONTEXTS_COUNT)
+    {
+        return NULL;
+    }
+
+    model = uzalloc(sizeof(*model));
+    model->tables_count = *p++ + 1;
+    model->tables = ucalloc(model->tables_count, sizeof(htable_t *));
+    memcpy(model->context_map, p, sizeof(model->context_map));
+    p += sizeof(model->context_map);
+
+    for (size_t i = 0; i < CONTEXTS_COUNT; i++)
+    {
+        if (model->context_map[i] >= model->tables_count)
+        {
+            destroy_context_model(model);
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        model->tables[i] = umalloc(sizeof(htable_t));
+        size_t used = unpack_code_lengths(p, end - p, model->tables[i]);
+        if (!used)
+        {
+            destroy_context_model(model);
+            return NULL;
+        }
+        p += used;
+    }
+
+    return model;
+}
+
+void dump_context_model(const hcontext_model_t *model)
+{
+    UASSERT_INPUT(model);
+
+    printf("Order-1 model, %zu tables:\n", model->tables_count);
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        size_t contexts = 0;
+        for (size_t j = 0; j < CONTEXTS_COUNT; j++)
+        {
+            contexts += (model->context_map[j] == i);
+        }
+        printf("  table %zu: %zu contexts, %u symbols, max code length %u\n", i, contexts,
+               model->tables[i]->symbols_count, model->tables[i]->max_code_len);
+    }
+}
+
+void destroy_context_model(hcontext_model_t *model)
+{
+    if (model)
+    {
+        for (size_t i = 0; i < model->tables_count; i++)
+        {
+            ufree(model->tables[i]);
+        }
+        ufree(model->tables);
+        ufree(model);
+    }
+}
+
+// Codes of all (context, byte) pairs in one table, so encoding a byte takes
+// a single lookup whatever table its context uses.
+hencoder_t *build_context_encoder(const hcontext_model_t *model, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(cfg);
+
+    hencoder_t *encoder = uzalloc(sizeof(*encoder));
+    encoder->cfg = cfg;
+    encoder->type = HENCODER_SCALAR;
+    encoder->context_codes = umalloc(CONTEXTS_COUNT * HCODES_TABLE_SIZE * sizeof(uint64_t));
+
+    for (size_t i = 0; i < CONTEXTS_COUNT; i++)
+    {
+        const htable_t *table = model->tables[model->context_map[i]];
+        for (size_t j = 0; j < HCODES_TABLE_SIZE; j++)
+        {
+            const hcode_t *hcode = &table->hcodes[j];
+            encoder->context_codes[(i << 8) | j] = PAIR_CODE(hcode->code, hcode->len);
+        }
+        if (table->max_code_len > encoder->max_code_len)
+        {
+            encoder->max_code_len = table->max_code_len;
+        }
+    }
+    UASSERT(encoder->max_code_len <= PAIR_LEN_SHIFT);
+
+    return encoder;
+}
+
+umemchunk_t encode_block_context(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer)
+{
+    const uint8_t *in = input.data;
+    const uint8_t *end = in + input.size;
+    const uint64_t *codes = encoder->context_codes;
+    const uint64_t code_mask = (1LLU << PAIR_LEN_SHIFT) - 1;
+    size_t context = 0;
+    bit_writer_t bw;
+    uint64_t code;
+
+    bit_writer_init(&bw, buffer, input.size, encoder->max_code_len);
+    while (in < end)
+    {
+        code = codes[(context << 8) | *in];
+        put_bits(&bw, code & code_mask, code >> PAIR_LEN_SHIFT);
+        context = *in++;
+    }
+
+    return bit_writer_finish(&bw, buffer);
+}
+
+static void build_context_table_decoder(hcontext_table_t *t, const htable_t *table)
+{
+    t->root = build_tree_from_codes(table);
+    t->nbits = table->max_code_len < CONTEXT_PEEK_NBITS ? table->max_code_len : CONTEXT_PEEK_NBITS;
+    t->peek = ucalloc(1 << t->nbits, sizeof(uint16_t));
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        const hcode_t *hcode = &table->hcodes[i];
+        if (!hcode->present || !hcode->len || hcode->len > t->nbits)
+        {
+            continue;
+        }
+        // Every index starting with the code maps to the symbol.
+        for (size_t j = 0; j < (1U << (t->nbits - hcode->len)); j++)
+        {
+            t->peek[hcode->code | (j << hcode->len)] = i | (hcode->len << 8);
+        }
+    }
+}
+
+hdecoder_t *build_context_decoder(const hcontext_model_t *model, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(model);
+    UASSERT_INPUT(cfg);
+
+    hdecoder_t *decoder = uzalloc(sizeof(*decoder));
+    hcontext_decoder_t *context = uzalloc(sizeof(*context));
+    decoder->cfg = cfg;
+    decoder->type = HDECODER_TREE;
+    decoder->context = context;
+
+    // Identical tables are stored once in the model, so contexts sharing a
+    // table share its decoding tables as well.
+    context->tables_count = model->tables_count;
+    context->tables = ucalloc(model->tables_count, sizeof(hcontext_table_t));
+    for (size_t i = 0; i < model->tables_count; i++)
+    {
+        build_context_table_decoder(&context->tables[i], model->tables[i]);
+        decoder->table_size += (1 << context->tables[i].nbits) * sizeof(uint16_t);
+    }
+    for (size_t i = 0; i < CONTEXTS_COUNT; i++)
+    {
+        context->by_context[i] = &context->tables[model->context_map[i]];
+    }
+
+    if (cfg->verbose)
+    {
+        printf("Using order-1 decoder, %zu tables, %zu bytes of lookup tables.\n",
+               context->tables_count, decoder->table_size);
+    }
+
+    return decoder;
+}
+
+void destroy_context_decoder(hcontext_decoder_t *context)
+{
+    if (context)
+    {
+        for (size_t i = 0; i < context->tables_count; i++)
+        {
+            destroy_tree(context->tables[i].root);
+            ufree(context->tables[i].peek);
+        }
+        ufree(context->tables);
+        ufree(context);
+    }
+}
+
+// Decoding stops at the end of the input, so corrupted data yields shorter
+// output.
+umemchunk_t decode_block_context(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer,
+                                 size_t original_size)
+{
+    const hcontext_decoder_t *context = decoder->context;
+    const hcontext_table_t *table = context->by_context[0];
+    uint8_t *out = buffer->data;
+    uint8_t *out_end = out + original_size;
+    bit_reader_t br;
+
+    bit_reader_init(&br, input.data, input.size);
+    while (out < out_end)
+    {
+        uint16_t item;
+        unsigned int len;
+        uint8_t symbol;
+
+        bit_reader_refill(&br);
+        item = table->peek[bit_reader_peek(&br, table->nbits)];
+        len = item >> 8;
+        if (len && len <= br.avail)
+        {
+            symbol = (uint8_t)item;
+            bit_reader_skip(&br, len);
+        }
+        else
+        {
+            const hnode_t *node = table->root;
+            while (!node->is_leaf)
+            {
+                if (!br.avail)
+                {
+                    bit_reader_refill(&br);
+                    if (!br.avail)
+                    {
+                        goto out;
+                    }
+                }
+                node = bit_reader_peek(&br, 1) ? node->right : node->left;
+                bit_reader_skip(&br, 1);
+            }
+            symbol = node->code;
+        }
+        *out++ = symbol;
+        table = context->by_context[symbol];
+    }
+
+out:;
+    umemchunk_t output = {
+        .data = buffer->data,
+        .size = out - (uint8_t *)buffer->data,
+    };
+
+    return output;
+}
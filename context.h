@@ -0,0 +1,41 @@
+#ifndef __CONTEXT_H__
+#define __CONTEXT_H__
+
+#include "huffman.h"
+
+// Order-1 codec: every byte is coded with a table picked by the previous
+// byte of the same block, the first byte of a block uses context 0.
+#define CONTEXTS_COUNT 256
+
+// Contexts seen less often than that share one table, their own tables
+// would cost more than they save.
+#define CONTEXT_MIN_COUNT 1024
+
+// Width of the first-level decoding table, codes longer than that are
+// decoded by walking the tree.
+#define CONTEXT_PEEK_NBITS 10
+
+// Code tables of all the contexts, identical tables are stored once.
+typedef struct {
+    uint8_t context_map[CONTEXTS_COUNT]; // context -> table index
+    size_t tables_count;
+    htable_t **tables;
+} hcontext_model_t;
+
+hcontext_model_t *build_context_model(const hstat_t *stats, const hcfg_t *cfg);
+void pack_context_model(const hcontext_model_t *model, ubuffer_t *output);
+hcontext_model_t *unpack_context_model(const uint8_t *data, size_t size);
+void dump_context_model(const hcontext_model_t *model);
+void destroy_context_model(hcontext_model_t *model);
+
+void update_context_stat(hstat_t *stats, umemchunk_t m);
+
+hencoder_t *build_context_encoder(const hcontext_model_t *model, const hcfg_t *cfg);
+umemchunk_t encode_block_context(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer);
+
+hdecoder_t *build_context_decoder(const hcontext_model_t *model, const hcfg_t *cfg);
+void destroy_context_decoder(hcontext_decoder_t *context);
+umemchunk_t decode_block_context(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer,
+                                 size_t original_size);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+// Reversed Castagnoli polynomial.
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t size)
+{
+    while (size--)
+    {
+        crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t size)
+{
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while (size >= sizeof(word))
+    {
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += sizeof(word);
+        size -= sizeof(word);
+    }
+    crc = crc64;
+    while (size--)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+
+    return crc;
+}
+
+static bool cpu_has_sse42(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+}
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *data, size_t size);
+
+static crc32c_fn pick_crc32c(void)
+{
+#if defined(__x86_64__)
+    if (cpu_has_sse42())
+    {
+        return crc32c_hw;
+    }
+#endif
+    init_crc_table();
+    return crc32c_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+    // Both candidates are equivalent so racing threads may initialize it
+    // concurrently.
+    static volatile crc32c_fn impl;
+    crc32c_fn fn = impl;
+
+    if (!fn)
+    {
+        fn = pick_crc32c();
+        impl = fn;
+    }
+
+    return ~fn(~crc, data, size);
+}
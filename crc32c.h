@@ -0,0 +1,10 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), uses SSE4.2 crc32 instruction when CPU has it.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif
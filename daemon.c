@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <ugeneric.h>
+#include "archive.h"
+#include "daemon.h"
+#include "pool.h"
+
+typedef struct {
+    hcfg_t cfg; // decoders keep a pointer to their config
+    uint8_t *key; // codec, decoder options and the tables
+    size_t key_size;
+    hdecoder_t *decoder;
+    uint64_t last_used;
+} cache_entry_t;
+
+struct _decoder_cache {
+    cache_entry_t entries[DAEMON_CACHE_SIZE];
+    uint64_t clock;
+};
+
+static uint8_t *build_cache_key(const huffman_archive_header_t *hdr, const hcfg_t *cfg, size_t *key_size)
+{
+    // Static codec tables are built from the stat of the header.
+    bool stat = hdr->codec == HCODEC_STATIC;
+    const void *tables = stat ? (const void *)&hdr->stat : get_header_tables(hdr);
+    size_t tables_size = stat ? sizeof(hdr->stat) : hdr->tables_size;
+    uint8_t *key = umalloc(3 + tables_size);
+
+    key[0] = hdr->codec;
+    key[1] = cfg->decoder;
+    key[2] = cfg->cache_nbits;
+    memcpy(key + 3, tables, tables_size);
+    *key_size = 3 + tables_size;
+
+    return key;
+}
+
+hdecoder_t *get_cached_decoder(hdecoder_cache_t *cache, const huffman_archive_header_t *hdr, ufile_reader_t *fr,
+                               const hcfg_t *cfg)
+{
+    UASSERT_INPUT(cache);
+    UASSERT_INPUT(hdr);
+    UASSERT_INPUT(cfg);
+
+    // Dumps and calibration are done while the decoder is built.
+    if (cfg->dump_table || cfg->dump_lookup_table || cfg->calibrate || cfg->max_table_size)
+    {
+        return NULL;
+    }
+
+    size_t key_size;
+    uint8_t *key = build_cache_key(hdr, cfg, &key_size);
+    cache_entry_t *victim = &cache->entries[0];
+    cache->clock++;
+    for (size_t i = 0; i < DAEMON_CACHE_SIZE; i++)
+    {
+        cache_entry_t *e = &cache->entries[i];
+        if (e->decoder && e->key_size == key_size && memcmp(e->key, key, key_size) == 0)
+        {
+            ufree(key);
+            e->last_used = cache->clock;
+            if (cfg->verbose)
+            {
+                printf("Using warm %s decoder, %zu bytes of decoding tables.\n", get_decoder_name(e->decoder->type),
+                       e->decoder->table_size);
+            }
+            return e->decoder;
+        }
+        if (e->last_used < victim->last_used)
+        {
+            victim = e;
+        }
+    }
+
+    hdecoder_t *decoder = build_archive_decoder(hdr, fr, cfg);
+    if (!decoder)
+    {
+        ufree(key);
+        return NULL;
+    }
+    destroy_archive_decoder(victim->decoder);
+    ufree(victim->key);
+    victim->cfg = *cfg;
+    victim->cfg.verbose = false;
+    victim->cfg.input_file = NULL;
+    victim->cfg.output_file = NULL;
+    victim->cfg.update_file = NULL;
+    victim->key = key;
+    victim->key_size = key_size;
+    victim->decoder = decoder;
+    victim->last_used = cache->clock;
+    decoder->cfg = &victim->cfg;
+
+    return decoder;
+}
+
+static void destroy_decoder_cache(hdecoder_cache_t *cache)
+{
+    for (size_t i = 0; i < DAEMON_CACHE_SIZE; i++)
+    {
+        destroy_archive_decoder(cache->entries[i].decoder);
+        ufree(cache->entries[i].key);
+    }
+    ufree(cache);
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        data = (uint8_t *)data + n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        data = (const uint8_t *)data + n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static int connect_socket(const char *socket_path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path %s is too long.\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+// Request: number of strings with the standard streams of the client
+// attached, then every string as its 32-bit length and bytes. The first
+// string is the working directory, the rest is the command line.
+static bool receive_request(int client, int fds[3], char ***strings, uint32_t *count)
+{
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {.iov_base = count, .iov_len = sizeof(*count)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    if (recvmsg(client, &msg, 0) != sizeof(*count))
+    {
+        return false;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    bool ok = *count >= 2 && *count <= DAEMON_MAX_ARGS;
+    *strings = ucalloc(*count + 1, sizeof(char *));
+    for (uint32_t i = 0; ok && i < *count; i++)
+    {
+        uint32_t len;
+        ok = read_all(client, &len, sizeof(len)) && len <= DAEMON_MAX_ARG_SIZE;
+        if (ok)
+        {
+            (*strings)[i] = umalloc(len + 1);
+            (*strings)[i][len] = 0;
+            ok = read_all(client, (*strings)[i], len);
+        }
+    }
+    if (!ok)
+    {
+        for (uint32_t i = 0; i < *count; i++)
+        {
+            ufree((*strings)[i]);
+        }
+        ufree(*strings);
+        for (size_t i = 0; i < 3; i++)
+        {
+            close(fds[i]);
+        }
+    }
+
+    return ok;
+}
+
+static int current_client = -1;
+
+// Status of a command ended by exit() goes to its client as well, messages
+// printed so far go first.
+static void report_exit(int status, void *arg)
+{
+    if (current_client >= 0)
+    {
+        int32_t s = status;
+        fflush(stdout);
+        fflush(stderr);
+        write_all(current_client, &s, sizeof(s));
+    }
+}
+
+static void serve_request(int client, hdecoder_cache_t *cache, hdaemon_run_fn run, const int saved[3])
+{
+    char **strings;
+    uint32_t count;
+    int fds[3];
+
+    if (!receive_request(client, fds, &strings, &count))
+    {
+        return;
+    }
+
+    int32_t status = EXIT_FAILURE;
+    if (chdir(strings[0]) != 0)
+    {
+        dprintf(fds[2], "Error: daemon can't change directory to %s: %s.\n", strings[0], strerror(errno));
+    }
+    else
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            dup2(fds[i], i);
+        }
+        current_client = client;
+        status = run(count - 1, strings + 1, cache);
+        current_client = -1;
+        fflush(stdout);
+        fflush(stderr);
+        clearerr(stdin);
+        for (int i = 0; i < 3; i++)
+        {
+            dup2(saved[i], i);
+        }
+    }
+    write_all(client, &status, sizeof(status));
+
+    for (int i = 0; i < 3; i++)
+    {
+        close(fds[i]);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ufree(strings[i]);
+    }
+    ufree(strings);
+}
+
+// Commands are run with the rights of the daemon, so only its own user
+// may send them.
+static bool is_daemon_user(int client)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    {
+        return false;
+    }
+    if (cred.uid != geteuid())
+    {
+        fprintf(stderr, "Warning: daemon refused a request of user %u.\n", (unsigned int)cred.uid);
+        return false;
+    }
+
+    return true;
+}
+
+static void serve_requests(int listen_fd, hdaemon_run_fn run)
+{
+    hdecoder_cache_t *cache = uzalloc(sizeof(*cache));
+    int saved[3];
+
+    // Workers are stopped by the master, a client gone away must not
+    // kill them.
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    on_exit(report_exit, NULL);
+    for (int i = 0; i < 3; i++)
+    {
+        saved[i] = dup(i);
+    }
+
+    while (true)
+    {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "Error: daemon failed to accept a client: %s.\n", strerror(errno));
+            break;
+        }
+        if (is_daemon_user(client))
+        {
+            serve_request(client, cache, run, saved);
+        }
+        close(client);
+    }
+
+    destroy_decoder_cache(cache);
+    exit(EXIT_FAILURE);
+}
+
+static pid_t start_worker(int listen_fd, hdaemon_run_fn run)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Error: daemon failed to start a worker: %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        serve_requests(listen_fd, run);
+    }
+
+    return pid;
+}
+
+static volatile sig_atomic_t stopping;
+
+static void stop_daemon(int sig)
+{
+    stopping = 1;
+}
+
+void daemon_run(const char *socket_path, const hcfg_t *cfg, hdaemon_run_fn run)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct sigaction sa = {.sa_handler = stop_daemon};
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path %s is too long.\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // Socket left by a daemon which is gone is replaced.
+    int fd = connect_socket(socket_path);
+    if (fd >= 0)
+    {
+        fprintf(stderr, "Error: another daemon listens on %s.\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    unlink(socket_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // Socket is private to the user of the daemon whatever the umask is,
+    // clients are checked by is_daemon_user() anyway.
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(socket_path, 0600) != 0 ||
+        listen(fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Error: can't listen on %s: %s.\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Waiting for workers is interrupted by the signals.
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    size_t workers_count = cfg->threads ? cfg->threads : get_cpu_count();
+    pid_t *workers = ucalloc(workers_count, sizeof(pid_t));
+    for (size_t i = 0; i < workers_count; i++)
+    {
+        workers[i] = start_worker(fd, run);
+    }
+    if (cfg->verbose)
+    {
+        printf("Listening on %s, %zu workers.\n", socket_path, workers_count);
+        fflush(stdout);
+    }
+
+    while (!stopping)
+    {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        for (size_t i = 0; i < workers_count && !stopping; i++)
+        {
+            if (workers[i] == pid)
+            {
+                workers[i] = start_worker(fd, run);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < workers_count; i++)
+    {
+        kill(workers[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+    close(fd);
+    unlink(socket_path);
+    ufree(workers);
+    if (cfg->verbose)
+    {
+        printf("Daemon on %s stopped.\n", socket_path);
+    }
+}
+
+static void append_string(ubuffer_t *request, const char *s)
+{
+    uint32_t len = strlen(s);
+
+    ubuffer_append_data(request, &len, sizeof(len));
+    ubuffer_append_data(request, s, len);
+}
+
+int daemon_request(const char *socket_path, int argc, char **argv)
+{
+    char cwd[PATH_MAX];
+    ubuffer_t request = {0};
+    uint32_t count = 1;
+
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        fprintf(stderr, "Error: can't get the working directory: %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    append_string(&request, cwd);
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--server") == 0)
+        {
+            i++;
+            continue;
+        }
+        append_string(&request, argv[i]);
+        count++;
+    }
+
+    int fd = connect_socket(socket_path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: can't connect to the daemon on %s: %s.\n", socket_path, strerror(errno));
+        ubuffer_destroy(&request);
+        return EXIT_FAILURE;
+    }
+
+    // Standard streams go with the first bytes of the request.
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status;
+    fflush(stdout);
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(count) || !write_all(fd, request.data, request.data_size) ||
+        !read_all(fd, &status, sizeof(status)))
+    {
+        fprintf(stderr, "Error: daemon on %s dropped the request.\n", socket_path);
+        status = EXIT_FAILURE;
+    }
+    close(fd);
+    ubuffer_destroy(&request);
+
+    return status;
+}
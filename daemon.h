@@ -0,0 +1,37 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include "huffman.h"
+
+// Daemon mode (--daemon SOCKET): commands of clients (--server SOCKET) are
+// run by a pool of worker processes accepting on a Unix domain socket. A
+// request carries the command line of the client, its working directory
+// and its standard streams (as file descriptors), so the worker reads and
+// writes the same files and prints to the same terminal as the client
+// would, the exit status goes back to the client. Workers are processes
+// rather than threads because errors end a run by exit(), the master
+// starts a new worker in place of the one which exited. Every worker keeps
+// decoders of DAEMON_CACHE_SIZE recently extracted tables warm.
+#define DAEMON_CACHE_SIZE 8
+
+// Limits of a request.
+#define DAEMON_MAX_ARGS 256
+#define DAEMON_MAX_ARG_SIZE 4096
+
+// Runs a command line, the cache is NULL unless it's run by a worker.
+typedef int (*hdaemon_run_fn)(int argc, char **argv, hdecoder_cache_t *cache);
+
+// Serve requests until SIGINT or SIGTERM, cfg->threads workers.
+void daemon_run(const char *socket_path, const hcfg_t *cfg, hdaemon_run_fn run);
+
+// Run the command line (without --server SOCKET) by the daemon, returns
+// its exit status.
+int daemon_request(const char *socket_path, int argc, char **argv);
+
+// Decoder of the archive tables owned by the cache, NULL if the request
+// needs a decoder of its own (table dumps, calibration) or the tables are
+// corrupted.
+hdecoder_t *get_cached_decoder(hdecoder_cache_t *cache, const huffman_archive_header_t *hdr, ufile_reader_t *fr,
+                               const hcfg_t *cfg);
+
+#endif
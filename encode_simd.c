@@ -0,0 +1,127 @@
+#include <ugeneric.h>
+#include "bitio.h"
+#include "encode_simd.h"
+
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+bool cpu_has_avx2_bmi2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+    {
+        return false;
+    }
+
+    // OS has to preserve YMM state across context switches.
+    __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0x6) != 0x6)
+    {
+        return false;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+
+    return (ebx & bit_AVX2) && (ebx & bit_BMI2);
+}
+
+// Encode 8 symbols per iteration: codes and lengths are gathered into
+// vector lanes, then neighbour codes are merged by shifting the right one
+// by the length of the left one (a prefix sum of lengths inside a group),
+// first pairs in 32-bit lanes when codes are short enough, then pairs (or
+// quads) in 64-bit lanes. Only the merged groups go through the scalar bit
+// writer. The bitstream is the same as the one produced by the scalar
+// encoder.
+__attribute__((target("avx2,bmi2")))
+umemchunk_t encode_block_avx2(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer)
+{
+    const uint8_t *in = input.data;
+    const uint8_t *end = in + input.size;
+    const int *codes = (const int *)encoder->codes;
+    const int *lens = (const int *)encoder->lens;
+    bool quads = (encoder->htable->max_code_len <= AVX2_QUAD_MAX_CODE_LENGTH);
+    uint64_t groups[4] __attribute__((aligned(32)));
+    uint64_t groups_len[4] __attribute__((aligned(32)));
+    bit_writer_t bw;
+
+    UASSERT(encoder->htable->max_code_len <= AVX2_MAX_CODE_LENGTH);
+    bit_writer_init(&bw, buffer, input.size, encoder->htable->max_code_len);
+
+    const __m256i lo32 = _mm256_set1_epi64x(0xffffffff);
+    while (end - in >= 8)
+    {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)in));
+        __m256i c = _mm256_i32gather_epi32(codes, idx, 4);
+        __m256i l = _mm256_i32gather_epi32(lens, idx, 4);
+        __m256i c64, l64;
+        in += 8;
+
+        if (quads)
+        {
+            // Codes fit 16 bits, merge pairs inside 32-bit lanes.
+            c = _mm256_sllv_epi32(c, _mm256_slli_epi64(l, 32));
+            c = _mm256_or_si256(c, _mm256_srli_epi64(c, 32));
+            l = _mm256_add_epi32(l, _mm256_srli_epi64(l, 32));
+            c64 = _mm256_and_si256(c, lo32);
+            l64 = _mm256_and_si256(l, lo32);
+
+            // Merge pairs into quads inside 64-bit lanes.
+            c64 = _mm256_sllv_epi64(c64, _mm256_slli_si256(l64, 8));
+            c64 = _mm256_or_si256(c64, _mm256_srli_si256(c64, 8));
+            l64 = _mm256_add_epi64(l64, _mm256_srli_si256(l64, 8));
+            _mm256_store_si256((__m256i *)groups, c64);
+            _mm256_store_si256((__m256i *)groups_len, l64);
+            put_bits(&bw, groups[0], groups_len[0]);
+            put_bits(&bw, groups[2], groups_len[2]);
+        }
+        else
+        {
+            for (int half = 0; half < 2; half++)
+            {
+                __m128i ch = half ? _mm256_extracti128_si256(c, 1) : _mm256_castsi256_si128(c);
+                __m128i lh = half ? _mm256_extracti128_si256(l, 1) : _mm256_castsi256_si128(l);
+                c64 = _mm256_cvtepu32_epi64(ch);
+                l64 = _mm256_cvtepu32_epi64(lh);
+                c64 = _mm256_sllv_epi64(c64, _mm256_slli_si256(l64, 8));
+                c64 = _mm256_or_si256(c64, _mm256_srli_si256(c64, 8));
+                l64 = _mm256_add_epi64(l64, _mm256_srli_si256(l64, 8));
+                _mm256_store_si256((__m256i *)groups, c64);
+                _mm256_store_si256((__m256i *)groups_len, l64);
+                put_bits(&bw, groups[0], groups_len[0]);
+                put_bits(&bw, groups[2], groups_len[2]);
+            }
+        }
+    }
+
+    // Tail.
+    while (in < end)
+    {
+        put_bits(&bw, encoder->codes[*in], encoder->lens[*in]);
+        in++;
+    }
+
+    return bit_writer_finish(&bw, buffer);
+}
+
+#else
+
+bool cpu_has_avx2_bmi2(void)
+{
+    return false;
+}
+
+umemchunk_t encode_block_avx2(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer)
+{
+    UASSERT(false);
+    umemchunk_t output = {0};
+    return output;
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __ENCODE_SIMD_H__
+#define __ENCODE_SIMD_H__
+
+#include <stdbool.h>
+#include "huffman.h"
+
+// Longest code the vector kernel can handle, codes are gathered as 32-bit
+// lanes.
+#define AVX2_MAX_CODE_LENGTH 32
+
+// Longest code for which groups of 4 codes fit a 64-bit lane.
+#define AVX2_QUAD_MAX_CODE_LENGTH 16
+
+bool cpu_has_avx2_bmi2(void);
+umemchunk_t encode_block_avx2(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer);
+
+#endif
@@ -0,0 +1,405 @@
+#include <math.h>
+#include <ugeneric.h>
+#include "bitio.h"
+#include "frame.h"
+
+struct _frame_codec {
+    hcfg_t cfg; // config of shared table decoders, progress output is disabled
+    size_t tables_count;
+    htable_t **tables;
+    hnode_t **roots;
+    hdecoder_t **decoders;
+};
+
+hframe_codec_t *build_frame_codec(const hstat_t *stats, size_t tables_count, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(stats || !tables_count);
+    UASSERT_INPUT(tables_count <= FRAME_MAX_TABLES);
+    UASSERT_INPUT(cfg);
+
+    hframe_codec_t *codec = uzalloc(sizeof(*codec));
+    codec->cfg = *cfg;
+    codec->cfg.verbose = false;
+    codec->cfg.dump_tree = false;
+    codec->cfg.dump_lookup_table = false;
+
+    codec->tables_count = tables_count;
+    codec->tables = ucalloc(tables_count + 1, sizeof(htable_t *));
+    codec->roots = ucalloc(tables_count + 1, sizeof(hnode_t *));
+    codec->decoders = ucalloc(tables_count + 1, sizeof(hdecoder_t *));
+    for (size_t i = 0; i < tables_count; i++)
+    {
+        hstat_t stat = stats[i];
+        for (size_t j = 0; j < HCODES_TABLE_SIZE; j++)
+        {
+            if (!stat.frequencies[j])
+            {
+                stat.frequencies[j] = 1;
+            }
+        }
+        codec->tables[i] = build_canonical_table(&stat, &codec->cfg);
+        codec->roots[i] = build_tree_from_codes(codec->tables[i]);
+        codec->decoders[i] = build_decoder(codec->roots[i], &codec->cfg);
+    }
+
+    return codec;
+}
+
+void destroy_frame_codec(hframe_codec_t *codec)
+{
+    if (codec)
+    {
+        for (size_t i = 0; i < codec->tables_count; i++)
+        {
+            destroy_decoder(codec->decoders[i]);
+            destroy_tree(codec->roots[i]);
+            ufree(codec->tables[i]);
+        }
+        ufree(codec->decoders);
+        ufree(codec->roots);
+        ufree(codec->tables);
+        ufree(codec);
+    }
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint32_t k1 = *(const uint32_t *)a;
+    uint32_t k2 = *(const uint32_t *)b;
+    return (k1 > k2) - (k1 < k2);
+}
+
+// Table of a single message, code lengths are computed in place (Moffat and
+// Katajainen) which is a lot cheaper than building the tree.
+static void build_frame_table(const hstat_t *stat, htable_t *table)
+{
+    uint32_t keys[HCODES_TABLE_SIZE]; // frequency << 8 | symbol
+    int a[HCODES_TABLE_SIZE];
+    int n = 0;
+
+    memset(table, 0, sizeof(*table));
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (stat->frequencies[i])
+        {
+            keys[n++] = (stat->frequencies[i] << 8) | i;
+        }
+    }
+    qsort(keys, n, sizeof(keys[0]), compare_keys);
+    for (int i = 0; i < n; i++)
+    {
+        a[i] = keys[i] >> 8;
+    }
+
+    if (n > 1)
+    {
+        // Parent pointers of internal nodes, left to right.
+        int root = 0, leaf = 2, next;
+        a[0] += a[1];
+        for (next = 1; next < n - 1; next++)
+        {
+            if (leaf >= n || a[root] < a[leaf])
+            {
+                a[next] = a[root];
+                a[root++] = next;
+            }
+            else
+            {
+                a[next] = a[leaf++];
+            }
+            if (leaf >= n || (root < next && a[root] < a[leaf]))
+            {
+                a[next] += a[root];
+                a[root++] = next;
+            }
+            else
+            {
+                a[next] += a[leaf++];
+            }
+        }
+
+        // Depths of internal nodes, right to left.
+        a[n - 2] = 0;
+        for (next = n - 3; next >= 0; next--)
+        {
+            a[next] = a[a[next]] + 1;
+        }
+
+        // Depths of leaves, right to left.
+        int avail = 1, used = 0, depth = 0;
+        root = n - 2;
+        next = n - 1;
+        while (avail > 0)
+        {
+            while (root >= 0 && a[root] == depth)
+            {
+                used++;
+                root--;
+            }
+            while (avail > used)
+            {
+                a[next--] = depth;
+                avail--;
+            }
+            avail = 2 * used;
+            depth++;
+            used = 0;
+        }
+    }
+    else
+    {
+        a[0] = 0;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        hcode_t *hcode = &table->hcodes[keys[i] & 0xff];
+        hcode->present = true;
+        hcode->len = a[i];
+    }
+    table->symbols_count = n;
+    table->max_code_len = a[0];
+    assign_canonical_codes(table);
+}
+
+// Lower bound of the size of the message coded with its own table: entropy
+// of the message plus the smallest packed table with that many symbols
+// (flags, count, symbols list and nibble lengths).
+static size_t get_own_table_min_bits(const hstat_t *stat, size_t size)
+{
+    double bits = 0;
+    size_t count = 0;
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (stat->frequencies[i])
+        {
+            bits += stat->frequencies[i] * log2((double)size / stat->frequencies[i]);
+            count++;
+        }
+    }
+
+    return (size_t)bits + 8 * (2 + (count < 32 ? count : 32) + (count + 1) / 2);
+}
+
+// Tables of single frames are used once, so only a small lookup table is
+// built for them, codes longer than FRAME_PEEK_NBITS are decoded by walking
+// the tree. Returns number of decoded bytes, less than size if the
+// bitstream is truncated.
+static size_t decode_packed(const htable_t *table, const uint8_t *data, size_t data_size, uint8_t *out,
+                            size_t size)
+{
+    uint16_t peek[1 << FRAME_PEEK_NBITS]; // symbol | code length << 8, 0 length for long codes
+    unsigned int nbits = table->max_code_len < FRAME_PEEK_NBITS ? table->max_code_len : FRAME_PEEK_NBITS;
+    hnode_t *root = NULL;
+    bit_reader_t br;
+    size_t i;
+
+    // Code of the only symbol is 0 bits long.
+    if (table->symbols_count == 1)
+    {
+        for (i = 0; !table->hcodes[i].present; i++);
+        memset(out, i, size);
+        return size;
+    }
+
+    memset(peek, 0, (1 << nbits) * sizeof(peek[0]));
+    for (i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        const hcode_t *hcode = &table->hcodes[i];
+        if (hcode->present && hcode->len <= nbits)
+        {
+            for (size_t j = 0; j < (1U << (nbits - hcode->len)); j++)
+            {
+                peek[hcode->code | (j << hcode->len)] = i | (hcode->len << 8);
+            }
+        }
+    }
+    if (table->max_code_len > nbits)
+    {
+        root = build_tree_from_codes(table);
+    }
+
+    bit_reader_init(&br, data, data_size);
+    for (i = 0; i < size; i++)
+    {
+        bit_reader_refill(&br);
+        uint16_t item = peek[bit_reader_peek(&br, nbits)];
+        unsigned int len = item >> 8;
+        if (len && len <= br.avail)
+        {
+            out[i] = (uint8_t)item;
+            bit_reader_skip(&br, len);
+            continue;
+        }
+        if (!root)
+        {
+            break;
+        }
+
+        const hnode_t *node = root;
+        while (!node->is_leaf && br.avail)
+        {
+            node = bit_reader_peek(&br, 1) ? node->right : node->left;
+            bit_reader_skip(&br, 1);
+            if (!br.avail)
+            {
+                bit_reader_refill(&br);
+            }
+        }
+        if (!node->is_leaf)
+        {
+            break;
+        }
+        out[i] = node->code;
+    }
+
+    if (root)
+    {
+        destroy_tree(root);
+    }
+
+    return i;
+}
+
+umemchunk_t frame_compress(const hframe_codec_t *codec, umemchunk_t message, ubuffer_t *output)
+{
+    UASSERT_INPUT(codec);
+    UASSERT_INPUT(output);
+    UASSERT_INPUT(message.size <= FRAME_MAX_SIZE);
+
+    const uint8_t *in = message.data;
+    const htable_t *table = NULL;
+    htable_t own;
+    hstat_t stat = {0};
+    size_t best_bits = message.size * 8;
+    uint8_t kind = FRAME_STORED;
+
+    for (size_t i = 0; i < message.size; i++)
+    {
+        stat.frequencies[in[i]]++;
+    }
+    for (size_t i = 0; i < codec->tables_count; i++)
+    {
+        size_t bits = get_coded_bits(codec->tables[i], &stat);
+        if (bits < best_bits)
+        {
+            best_bits = bits;
+            kind = i;
+            table = codec->tables[i];
+        }
+    }
+    if (message.size >= FRAME_MIN_PACKED_SIZE && get_own_table_min_bits(&stat, message.size) < best_bits)
+    {
+        build_frame_table(&stat, &own);
+        if (get_coded_bits(&own, &stat) + get_packed_bits(&own) < best_bits)
+        {
+            kind = FRAME_PACKED;
+            table = &own;
+        }
+    }
+
+    ubuffer_reset(output);
+    ubuffer_append_byte(output, kind);
+    append_varint(output, message.size);
+    if (kind == FRAME_STORED)
+    {
+        ubuffer_append_data(output, message.data, message.size);
+    }
+    else
+    {
+        if (kind == FRAME_PACKED)
+        {
+            pack_code_lengths(&own, output);
+        }
+
+        // Bitstream follows the frame header, guard bytes are not stored.
+        size_t header_size = output->data_size;
+        ubuffer_reserve_capacity(output, header_size + (message.size * table->max_code_len) / 8 + 16 +
+                                         HBLOCK_GUARD_BYTES);
+        bit_writer_t bw = {.out = (uint8_t *)output->data + header_size};
+        for (size_t i = 0; i < message.size; i++)
+        {
+            put_bits(&bw, table->hcodes[in[i]].code, table->hcodes[in[i]].len);
+        }
+        bit_writer_finish(&bw, output);
+        output->data_size -= HBLOCK_GUARD_BYTES;
+    }
+
+    umemchunk_t frame = {
+        .data = output->data,
+        .size = output->data_size,
+    };
+
+    return frame;
+}
+
+bool frame_decompress(const hframe_codec_t *codec, umemchunk_t frame, ubuffer_t *buffer, umemchunk_t *message)
+{
+    UASSERT_INPUT(codec);
+    UASSERT_INPUT(buffer);
+    UASSERT_INPUT(message);
+
+    const uint8_t *p = frame.data;
+    const uint8_t *end = p + frame.size;
+    htable_t own;
+    uint32_t size;
+    uint8_t kind;
+
+    if (frame.size < 1)
+    {
+        return false;
+    }
+    kind = *p++;
+    if (!read_varint(&p, end, &size) || size > FRAME_MAX_SIZE)
+    {
+        return false;
+    }
+
+    if (kind == FRAME_STORED)
+    {
+        if ((size_t)(end - p) != size)
+        {
+            return false;
+        }
+        ubuffer_reset(buffer);
+        ubuffer_append_data(buffer, p, size);
+        message->data = buffer->data;
+        message->size = size;
+        return true;
+    }
+
+    if (kind == FRAME_PACKED)
+    {
+        size_t used = unpack_code_lengths(p, end - p, &own);
+        if (!used)
+        {
+            return false;
+        }
+        p += used;
+        ubuffer_reserve_capacity(buffer, size + 1);
+        buffer->data_size = decode_packed(&own, p, end - p, buffer->data, size);
+        message->data = buffer->data;
+        message->size = buffer->data_size;
+        return message->size == size;
+    }
+
+    if (kind >= codec->tables_count)
+    {
+        return false;
+    }
+
+    // Decoders may read guard bytes past the bitstream and write 8 bytes
+    // past the message, so the bitstream is copied behind that.
+    size_t bits_size = end - p;
+    size_t offset = size + 8;
+    ubuffer_reserve_capacity(buffer, offset + bits_size + HBLOCK_GUARD_BYTES);
+    uint8_t *bits = (uint8_t *)buffer->data + offset;
+    memcpy(bits, p, bits_size);
+    memset(bits + bits_size, 0, HBLOCK_GUARD_BYTES);
+
+    umemchunk_t input = {.data = bits, .size = bits_size + HBLOCK_GUARD_BYTES};
+    *message = decode_block(codec->decoders[kind], input, buffer, size);
+
+    return message->size == size;
+}
@@ -0,0 +1,43 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "huffman.h"
+
+// Compact frames for small messages, the archive header alone is bigger
+// than a typical RPC payload. Frame is a kind byte, varint size of the
+// message and the bitstream padded to a byte:
+//   - kind < FRAME_MAX_TABLES: message is coded with the shared table of
+//     this ID, tables are built once by build_frame_codec() on both sides;
+//   - FRAME_PACKED: packed code lengths (see pack_code_lengths()) of the
+//     table built for the message precede the bitstream;
+//   - FRAME_STORED: message is stored as is.
+// The cheapest kind is picked for every message. Frames carry no checksum,
+// transport is expected to have one.
+#define FRAME_MAX_TABLES 254
+#define FRAME_PACKED 0xfe
+#define FRAME_STORED 0xff
+
+// Shorter messages never get tables of their own, packed code lengths
+// would outweigh the savings.
+#define FRAME_MIN_PACKED_SIZE 256
+
+// Width of the lookup table used to decode frames with packed tables.
+#define FRAME_PEEK_NBITS 11
+
+// Messages are limited so a corrupted size can't blow up the output buffer.
+#define FRAME_MAX_SIZE (16 * 1024 * 1024)
+
+typedef struct _frame_codec hframe_codec_t;
+
+// Every symbol gets a code in every shared table, so any message can be
+// coded with any of them.
+hframe_codec_t *build_frame_codec(const hstat_t *stats, size_t tables_count, const hcfg_t *cfg);
+void destroy_frame_codec(hframe_codec_t *codec);
+
+umemchunk_t frame_compress(const hframe_codec_t *codec, umemchunk_t message, ubuffer_t *output);
+
+// Returns false if the frame is corrupted. Buffer also keeps a copy of the
+// bitstream past the message.
+bool frame_decompress(const hframe_codec_t *codec, umemchunk_t frame, ubuffer_t *buffer, umemchunk_t *message);
+
+#endif
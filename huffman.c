@@ -6,19 +6,76 @@
 #include <math.h>
 
 #include "huffman.h"
+#include "adaptive.h"
+#include "bitio.h"
+#include "context.h"
+#include "crc32c.h"
+#include "encode_simd.h"
+#include "profile.h"
+#include "sync.h"
 #include "util.h"
+#include "wide.h"
+
+// Lookup table kernels specialized for every supported width: the mask and
+// the number of lookups per 64-bit load are constants, so the lookups are
+// unrolled, and decoded data of an item is found by its index. A load at
+// the byte of the current bit has at least 57 bits past that bit and a
+// lookup consumes at most NBITS of them. Every lookup copies NBITS bytes,
+// the most an item decodes, so kernels stop when a load worth of copies
+// could go past the block or a load past the input.
+#define LUT_KERNEL_WIDTHS(X) \
+    X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24)
+
+#define DEFINE_LUT_KERNEL(NBITS)                                                                             \
+static void decode_lut_##NBITS(const hdecode_lut_t *lut, const uint8_t *in, size_t in_size, uint8_t *out,   \
+                               size_t original_size, size_t *bit_offset, size_t *output_size)              \
+{                                                                                                           \
+    const hdecode_lut_item_t *items = lut->items;                                                           \
+    const uint8_t *data = lut->data;                                                                        \
+    size_t bo = *bit_offset;                                                                                \
+    size_t os = *output_size;                                                                               \
+                                                                                                            \
+    while (bo / 8 + sizeof(uint64_t) <= in_size && os + (57 / NBITS) * NBITS <= original_size)              \
+    {                                                                                                       \
+        uint64_t bits;                                                                                      \
+        memcpy(&bits, in + bo / 8, sizeof(bits));                                                           \
+        bits >>= bo % 8;                                                                                    \
+        for (int k = 0; k < 57 / NBITS; k++)                                                                \
+        {                                                                                                   \
+            size_t index = bits & ((1U << NBITS) - 1);                                                      \
+            const hdecode_lut_item_t *li = &items[index];                                                   \
+            memcpy(out + os, data + index * (NBITS + 1), NBITS);                                            \
+            os += li->decoded_data_size;                                                                    \
+            bo += li->decoded_bits;                                                                         \
+            bits >>= li->decoded_bits;                                                                      \
+        }                                                                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    *bit_offset = bo;                                                                                       \
+    *output_size = os;                                                                                      \
+}
+
+LUT_KERNEL_WIDTHS(DEFINE_LUT_KERNEL)
+
+#define LUT_KERNEL_ENTRY(NBITS) [NBITS] = decode_lut_##NBITS,
+
+static const hlut_kernel_t lut_kernels[MAX_CACHE_NBITS + 1] = {
+    LUT_KERNEL_WIDTHS(LUT_KERNEL_ENTRY)
+};
 
-static hdecode_lut_t *build_lookup_table(const hnode_t *root, const hcfg_t *cfg)
+static hdecode_lut_t *build_lookup_table(const hnode_t *root, uint8_t nbits, const hcfg_t *cfg)
 {
     const hnode_t *node;
     hdecode_lut_item_t *li = NULL;
-    size_t nrecords = 1 << cfg->cache_nbits;
+    size_t nrecords = 1 << nbits;
     size_t lut_size = nrecords * sizeof(hdecode_lut_item_t);
 
     hdecode_lut_t *lut = umalloc(sizeof(hdecode_lut_t));
 
     lut->items = umalloc(lut_size);
-    lut->nbits = cfg->cache_nbits;
+    lut->data = ucalloc(nrecords, nbits + 1);
+    lut->nbits = nbits;
+    lut->kernel = nbits <= MAX_CACHE_NBITS ? lut_kernels[nbits] : NULL;
 
     if (cfg->verbose)
     {
@@ -30,10 +87,10 @@ static hdecode_lut_t *build_lookup_table(const hnode_t *root, const hcfg_t *cfg)
         node = root;
         li = &lut->items[i];
         li->node = NULL;
-        li->decoded_data = uzalloc(cfg->cache_nbits + 1);
+        li->decoded_data = lut->data + i * (nbits + 1);
         li->decoded_data_size = 0;
         li->decoded_bits = 0;
-        for (size_t j = 0; j < cfg->cache_nbits; j++)
+        for (size_t j = 0; j < nbits; j++)
         {
             node = ((1 << j) & i) ? node->right : node->left;
             if (node->is_leaf)
@@ -59,16 +116,156 @@ static void destroy_lookup_table(hdecode_lut_t *lut)
 {
     if (lut)
     {
-        size_t lut_records = 1 << lut->nbits;
-        for (size_t i = 0; i < lut_records; i++)
-        {
-            ufree(lut->items[i].decoded_data);
-        }
+        ufree(lut->data);
         ufree(lut->items);
         ufree(lut);
     }
 }
 
+static void remember_internal_node(const hnode_t *node, void *cb_data, char *path, size_t path_len)
+{
+    if (!node->is_leaf)
+    {
+        uvector_append(cb_data, G_CPTR(node));
+    }
+}
+
+static int compare_pointers(const void *p1, const void *p2)
+{
+    const void *a = *(const void **)p1;
+    const void *b = *(const void **)p2;
+    return (a > b) - (a < b);
+}
+
+static hdecode_fsm_t *build_fsm(const hnode_t *root, const hcfg_t *cfg)
+{
+    UASSERT(!root->is_leaf);
+
+    uvector_t *v = uvector_create();
+    traverse_htree(root, remember_internal_node, v, NULL, 0, SIZE_MAX);
+    size_t states_count = uvector_get_size(v);
+    UASSERT(states_count <= UINT8_MAX + 1);
+
+    // Map of node pointers to state numbers, root is the last one visited
+    // by traverse_htree() so it is swapped to be state 0.
+    const hnode_t **states = umalloc(states_count * sizeof(*states));
+    const hnode_t **sorted = umalloc(states_count * sizeof(*sorted));
+    uint8_t *state_of = umalloc(states_count);
+    for (size_t i = 0; i < states_count; i++)
+    {
+        states[i] = G_AS_PTR(uvector_get_at(v, i));
+    }
+    states[states_count - 1] = states[0];
+    states[0] = root;
+    memcpy(sorted, states, states_count * sizeof(*sorted));
+    qsort(sorted, states_count, sizeof(*sorted), compare_pointers);
+    for (size_t i = 0; i < states_count; i++)
+    {
+        const hnode_t **p = bsearch(&states[i], sorted, states_count, sizeof(*sorted), compare_pointers);
+        state_of[p - sorted] = i;
+    }
+
+    hdecode_fsm_t *fsm = umalloc(sizeof(*fsm));
+    fsm->states_count = states_count;
+    fsm->items = umalloc(states_count * 256 * sizeof(hdecode_fsm_item_t));
+
+    if (cfg->verbose)
+    {
+        printf("Building decoding state machine (%zu bytes) ... ", states_count * 256 * sizeof(hdecode_fsm_item_t));
+    }
+
+    for (size_t s = 0; s < states_count; s++)
+    {
+        for (size_t byte = 0; byte < 256; byte++)
+        {
+            hdecode_fsm_item_t *item = &fsm->items[s * 256 + byte];
+            const hnode_t *node = states[s];
+            memset(item, 0, sizeof(*item));
+            for (size_t bit = 0; bit < 8; bit++)
+            {
+                node = ((1 << bit) & byte) ? node->right : node->left;
+                if (node->is_leaf)
+                {
+                    item->symbols[item->symbols_count++] = node->code;
+                    node = root;
+                }
+            }
+            const hnode_t **p = bsearch(&node, sorted, states_count, sizeof(*sorted), compare_pointers);
+            item->next_state = state_of[p - sorted];
+        }
+    }
+
+    if (cfg->verbose)
+    {
+        printf("Done.\n");
+    }
+
+    ufree(state_of);
+    ufree(sorted);
+    ufree(states);
+    uvector_destroy(v);
+
+    return fsm;
+}
+
+static void destroy_fsm(hdecode_fsm_t *fsm)
+{
+    if (fsm)
+    {
+        ufree(fsm->items);
+        ufree(fsm);
+    }
+}
+
+size_t get_blocks_count(size_t input_size, const hcfg_t *cfg)
+{
+    return input_size / cfg->block_size + (bool)(input_size % cfg->block_size);
+}
+
+// Number of histograms gathered for the codec: one per context in order-1
+// mode, one per high byte of a symbol in wide mode, one per block in
+// adaptive mode.
+size_t get_stat_count(size_t blocks_count, const hcfg_t *cfg)
+{
+    if (cfg->adaptive)
+    {
+        return blocks_count ? blocks_count : 1;
+    }
+    if (cfg->order1)
+    {
+        return CONTEXTS_COUNT;
+    }
+    if (cfg->wide)
+    {
+        return WIDE_SYMBOLS_COUNT / HCODES_TABLE_SIZE;
+    }
+    return 1;
+}
+
+void update_stat(hstat_t *stats, size_t block, umemchunk_t m, const hcfg_t *cfg)
+{
+    if (cfg->adaptive)
+    {
+        stats += block;
+    }
+    else if (cfg->order1)
+    {
+        update_context_stat(stats, m);
+        return;
+    }
+    if (cfg->wide)
+    {
+        update_wide_stat(stats, m);
+        return;
+    }
+
+    for (size_t j = 0; j < m.size; j++)
+    {
+        // TODO: check for uint32_t overflow
+        stats->frequencies[((uint8_t *)m.data)[j]]++;
+    }
+}
+
 hstat_t *build_stat(ufile_reader_t *fr, const hcfg_t *cfg)
 {
     UASSERT_INPUT(fr);
@@ -79,10 +276,12 @@ hstat_t *build_stat(ufile_reader_t *fr, const hcfg_t *cfg)
     size_t t = 0;
     size_t file_size = 0;
 
-    hstat_t *stat = uzalloc(sizeof(*stat));
+    size_t block = 0;
+
+    file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+    hstat_t *stat = ucalloc(get_stat_count(get_blocks_count(file_size, cfg), cfg), sizeof(*stat));
     if (cfg->verbose)
     {
-        file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
         t = (file_size / cfg->block_size) / 58;
         printf("Building stat: ");
     }
@@ -90,11 +289,7 @@ hstat_t *build_stat(ufile_reader_t *fr, const hcfg_t *cfg)
     while (ufile_reader_has_next(fr))
     {
         m = G_AS_MEMCHUNK(ufile_reader_read(fr, cfg->block_size, NULL));
-        for (size_t j = 0; j < m.size; j++)
-        {
-            // TODO: check for uint32_t overflow
-            stat->frequencies[((uint8_t *)m.data)[j]]++;
-        }
+        update_stat(stat, block++, m, cfg);
         if (cfg->verbose && i++ > t)
         {
             i = 0;
@@ -110,9 +305,10 @@ hstat_t *build_stat(ufile_reader_t *fr, const hcfg_t *cfg)
     return stat;
 }
 
-static umemchunk_t encode_block(umemchunk_t input, ubuffer_t *buffer,
-                                const hcfg_t *cfg, const htable_t *htable)
+static umemchunk_t encode_block_scalar(const hencoder_t *encoder, umemchunk_t input,
+                                       ubuffer_t *buffer)
 {
+    const htable_t *htable = encoder->htable;
     uint8_t *in = input.data;
     hcode_t hcode;
     uint64_t bits = 0; // max code length assumed to be 64
@@ -148,35 +344,221 @@ static umemchunk_t encode_block(umemchunk_t input, ubuffer_t *buffer,
     return output;
 }
 
-uvector_t *encode(ufile_reader_t *fr, ufile_writer_t *fw,
-                  const htable_t *htable, const hcfg_t *cfg)
+// Two input bytes per lookup, the pair table is indexed by a little-endian
+// 16-bit word so the first byte's code occupies the low bits.
+static umemchunk_t encode_block_pair(const hencoder_t *encoder, umemchunk_t input,
+                                     ubuffer_t *buffer)
+{
+    const uint8_t *in = input.data;
+    const uint8_t *end = in + input.size;
+    const uint64_t code_mask = (1LLU << PAIR_LEN_SHIFT) - 1;
+    bit_writer_t bw;
+    uint64_t pair;
+
+    bit_writer_init(&bw, buffer, input.size, encoder->max_code_len);
+    while (end - in >= 2)
+    {
+        pair = encoder->pairs[in[0] | (in[1] << 8)];
+        put_bits(&bw, pair & code_mask, pair >> PAIR_LEN_SHIFT);
+        in += 2;
+    }
+    if (in < end)
+    {
+        put_bits(&bw, encoder->htable->hcodes[*in].code, encoder->htable->hcodes[*in].len);
+    }
+
+    return bit_writer_finish(&bw, buffer);
+}
+
+static const char *encoder_names[HENCODER_COUNT] = {
+    [HENCODER_AUTO] = "auto",
+    [HENCODER_SCALAR] = "scalar",
+    [HENCODER_PAIR] = "pair",
+    [HENCODER_AVX2] = "avx2",
+};
+
+const char *get_encoder_name(hencoder_type_t type)
+{
+    UASSERT(type < HENCODER_COUNT);
+    return encoder_names[type];
+}
+
+bool encoder_is_supported(hencoder_type_t type, const htable_t *htable)
+{
+    switch (type)
+    {
+        case HENCODER_SCALAR:
+            return true;
+        case HENCODER_PAIR:
+            return htable->max_code_len <= PAIR_MAX_CODE_LENGTH;
+        case HENCODER_AVX2:
+            return htable->max_code_len <= AVX2_MAX_CODE_LENGTH && cpu_has_avx2_bmi2();
+        default:
+            return false;
+    }
+}
+
+// Vector kernel is the fastest while it merges codes into quads, the pair
+// table wins for longer codes.
+static hencoder_type_t pick_encoder(const htable_t *htable)
+{
+    if (htable->max_code_len <= AVX2_QUAD_MAX_CODE_LENGTH && encoder_is_supported(HENCODER_AVX2, htable))
+    {
+        return HENCODER_AVX2;
+    }
+    if (encoder_is_supported(HENCODER_PAIR, htable))
+    {
+        return HENCODER_PAIR;
+    }
+    if (encoder_is_supported(HENCODER_AVX2, htable))
+    {
+        return HENCODER_AVX2;
+    }
+
+    return HENCODER_SCALAR;
+}
+
+hencoder_t *build_encoder(const htable_t *htable, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(htable);
+    UASSERT_INPUT(cfg);
+
+    hencoder_t *encoder = uzalloc(sizeof(*encoder));
+    encoder->htable = htable;
+    encoder->cfg = cfg;
+    encoder->max_code_len = htable->max_code_len;
+
+    if (cfg->encoder == HENCODER_AUTO)
+    {
+        encoder->type = pick_encoder(htable);
+    }
+    else if (encoder_is_supported(cfg->encoder, htable))
+    {
+        encoder->type = cfg->encoder;
+    }
+    else
+    {
+        fprintf(stderr, "Warning: %s encoder is not supported for this table or CPU, using scalar one.\n",
+                get_encoder_name(cfg->encoder));
+        encoder->type = HENCODER_SCALAR;
+    }
+
+    if (encoder->type == HENCODER_AVX2)
+    {
+        for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+        {
+            encoder->codes[i] = htable->hcodes[i].code;
+            encoder->lens[i] = htable->hcodes[i].len;
+        }
+    }
+    else if (encoder->type == HENCODER_PAIR)
+    {
+        const hcode_t *hcodes = htable->hcodes;
+        encoder->pairs = umalloc(HCODES_TABLE_SIZE * HCODES_TABLE_SIZE * sizeof(uint64_t));
+        for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+        {
+            for (size_t j = 0; j < HCODES_TABLE_SIZE; j++)
+            {
+                encoder->pairs[i | (j << 8)] = PAIR_CODE(hcodes[i].code | (hcodes[j].code << hcodes[i].len),
+                                                         hcodes[i].len + hcodes[j].len);
+            }
+        }
+    }
+
+    return encoder;
+}
+
+void destroy_encoder(hencoder_t *encoder)
+{
+    if (encoder)
+    {
+        ufree(encoder->pairs);
+        ufree(encoder->context_codes);
+        ufree(encoder->wide_codes);
+        destroy_adaptive_encoder(encoder->adaptive);
+        ufree(encoder);
+    }
+}
+
+// Encode one block into the buffer, encoder is read-only here so the same
+// encoder can be used from several threads, each with its own buffer.
+umemchunk_t encode_block(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer)
+{
+    // Stored blocks need no guard bytes, they are copied back as is.
+    if (encoder->store)
+    {
+        ubuffer_reset(buffer);
+        ubuffer_append_data(buffer, input.data, input.size);
+        umemchunk_t output = {.data = buffer->data, .size = buffer->data_size};
+        return output;
+    }
+    if (encoder->adaptive)
+    {
+        return encode_block_adaptive(encoder, input, buffer);
+    }
+    if (encoder->context_codes)
+    {
+        return encode_block_context(encoder, input, buffer);
+    }
+    if (encoder->wide_codes)
+    {
+        return encode_block_wide(encoder, input, buffer);
+    }
+
+    switch (encoder->type)
+    {
+        case HENCODER_PAIR:
+            return encode_block_pair(encoder, input, buffer);
+        case HENCODER_AVX2:
+            return encode_block_avx2(encoder, input, buffer);
+        default:
+            return encode_block_scalar(encoder, input, buffer);
+    }
+}
+
+// Blocks are read according to the layout of the header, see
+// allocate_header(), their descriptors and sync points (if any) are stored
+// to the header.
+void encode(ufile_reader_t *fr, ufile_writer_t *fw, const hencoder_t *encoder, huffman_archive_header_t *hdr,
+            const hcfg_t *cfg)
 {
     umemchunk_t input, output;
     ubuffer_t buffer = {0};
-    uvector_t *blocks = uvector_create();
-    uvector_set_void_destroyer(blocks, free);
+    uint64_t *points = get_header_sync_points(hdr);
     block_descriptor_t *bds;
     size_t i = 0;
     size_t t = 0;
-    size_t file_size = 0;
 
     if (cfg->verbose)
     {
-        file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
-        t = (file_size / cfg->block_size) / 58;
+        t = hdr->blocks_count / 58;
+        printf("Using %s encoder%s.\n", encoder->store ? "store" : encoder->context_codes ? "order-1" :
+                                         encoder->wide_codes ? "wide" : get_encoder_name(encoder->type),
+               encoder->adaptive ? " with adaptive tables" : "");
         printf("Encoding file: ");
     }
 
-    while (ufile_reader_has_next(fr))
+    for (size_t block = 0; block < hdr->blocks_count; block++)
     {
-        bds = umalloc(sizeof(*bds));
+        bds = &hdr->blocks[block];
         bds->original_offset = G_AS_SIZE(ufile_reader_get_position(fr));
-        input = G_AS_MEMCHUNK(ufile_reader_read(fr, cfg->block_size, NULL));
-        output = encode_block(input, &buffer, cfg, htable);
+        profile_start(HSTAGE_IO);
+        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->original_size, NULL));
+        profile_stop(HSTAGE_IO, input.size);
+        UASSERT(input.size == bds->original_size);
+        profile_start(HSTAGE_ENCODE);
+        output = encode_block(encoder, input, &buffer);
+        if (hdr->sync_interval)
+        {
+            build_sync_points(encoder->htable, input, hdr->sync_interval, points);
+            points += get_sync_points_count(input.size, hdr->sync_interval);
+        }
+        profile_stop(HSTAGE_ENCODE, input.size);
+        profile_start(HSTAGE_IO);
         ufile_writer_write(fw, output);
-        bds->original_size = input.size;
+        profile_stop(HSTAGE_IO, output.size);
         bds->compressed_size = output.size;
-        uvector_append(blocks, G_PTR(bds));
+        bds->checksum = crc32c(0, input.data, input.size);
         if (cfg->verbose && i++ > t)
         {
             i = 0;
@@ -190,8 +572,6 @@ uvector_t *encode(ufile_reader_t *fr, ufile_writer_t *fw,
     }
 
     ubuffer_destroy(&buffer);
-
-    return blocks;
 }
 
 static const unsigned char rmasks[] = {
@@ -229,9 +609,9 @@ static uint32_t _get_bits(uint8_t *data, size_t offset, uint8_t nbits)
     return t;
 }
 
-static umemchunk_t _decode_block(umemchunk_t input, ubuffer_t *buffer,
-                                size_t original_size, const hcfg_t *cfg,
-                                const hnode_t *root, const hdecode_lut_t *lut)
+static umemchunk_t decode_block_lut(umemchunk_t input, ubuffer_t *buffer,
+                                    size_t original_size, const hcfg_t *cfg,
+                                    const hnode_t *root, const hdecode_lut_t *lut)
 {
     hdecode_lut_item_t *li = NULL;
     uint8_t *in = input.data;
@@ -241,7 +621,14 @@ static umemchunk_t _decode_block(umemchunk_t input, ubuffer_t *buffer,
     uint32_t bits;
     uint8_t decoded_data_size;
 
-    while (output_size < original_size)
+    if (lut->kernel)
+    {
+        lut->kernel(lut, in, input.size, out, original_size, &bit_offset, &output_size);
+    }
+
+    // Lookups read up to 4 bytes starting at the current one, a valid block
+    // never gets into its guard bytes, a corrupted one stops there.
+    while (output_size < original_size && bit_offset / 8 + HBLOCK_GUARD_BYTES <= input.size)
     {
         bits = _get_bits(in, bit_offset, lut->nbits);
         li = &lut->items[bits];
@@ -290,14 +677,47 @@ static umemchunk_t _decode_block(umemchunk_t input, ubuffer_t *buffer,
     return output;
 }
 
-static umemchunk_t decode_block(umemchunk_t input, ubuffer_t *buffer,
-                                size_t original_size, const hcfg_t *cfg,
-                                const hnode_t *root, const hdecode_lut_t *lut)
+// Every step consumes a whole input byte and emits up to 8 symbols, the
+// state carries a partially decoded code over to the next byte, so codes
+// of any length are handled without falling back to the tree. All 8 symbol
+// slots are copied at once, decode_block() reserves room for that.
+static umemchunk_t decode_block_fsm(umemchunk_t input, ubuffer_t *buffer,
+                                    size_t original_size, const hcfg_t *cfg,
+                                    const hdecode_fsm_t *fsm)
+{
+    const hdecode_fsm_item_t *items = fsm->items;
+    const hdecode_fsm_item_t *item;
+    const uint8_t *in = input.data;
+    const uint8_t *in_end = in + input.size;
+    uint8_t *out = buffer->data;
+    uint8_t *out_end = out + original_size;
+    size_t state = 0;
+
+    while (out < out_end && in < in_end)
+    {
+        item = &items[(state << 8) | *in++];
+        memcpy(out, item->symbols, sizeof(item->symbols));
+        out += item->symbols_count;
+        state = item->next_state;
+    }
+
+    umemchunk_t output = {
+        .data = buffer->data,
+        .size = (out < out_end) ? out - (uint8_t *)buffer->data : original_size,
+    };
+
+    return output;
+}
+
+static umemchunk_t decode_block_tree(umemchunk_t input, ubuffer_t *buffer,
+                                     size_t original_size, const hcfg_t *cfg,
+                                     const hnode_t *root, const hdecode_lut_t *lut)
 {
     uint8_t bitptr = 8;
     uint8_t byte = 0;
     bool next_bit;
     uint8_t *in = input.data;
+    uint8_t *in_end = in + input.size;
     uint8_t *out = buffer->data;
 
     ubuffer_reset(buffer);
@@ -312,6 +732,11 @@ static umemchunk_t decode_block(umemchunk_t input, ubuffer_t *buffer,
             }
             if (8 == bitptr)
             {
+                if (in == in_end)
+                {
+                    // Corrupted block, return what was decoded so far.
+                    goto out;
+                }
                 byte = *in++;
                 bitptr = 0;
             }
@@ -322,6 +747,7 @@ static umemchunk_t decode_block(umemchunk_t input, ubuffer_t *buffer,
         *out++ = node->code;
     }
 
+out:;
     umemchunk_t output = {
         .data = buffer->data,
         .size = buffer->data_size,
@@ -346,109 +772,425 @@ void dump_lookup_table(const hdecode_lut_t *lut)
     }
 }
 
-void decode(ufile_reader_t *fr, ufile_writer_t *fw, const hnode_t *root,
-            const huffman_archive_header_t *hdr, const hcfg_t *cfg)
+static const char *decoder_names[HDECODER_COUNT] = {
+    [HDECODER_AUTO] = "auto",
+    [HDECODER_TREE] = "tree",
+    [HDECODER_LUT] = "lut",
+    [HDECODER_FSM] = "fsm",
+};
+
+const char *get_decoder_name(hdecoder_type_t type)
 {
-    const block_descriptor_t *bds;
-    hdecode_lut_t *lut = NULL;
-    umemchunk_t input, output;
-    ubuffer_t buffer = {0};
+    UASSERT(type < HDECODER_COUNT);
+    return decoder_names[type];
+}
 
-    size_t j = 0;
-    size_t t = 0;
+// Memory taken by a lookup table: items and per-item decoded data.
+static size_t get_lut_size(uint8_t nbits)
+{
+    return (sizeof(hdecode_lut_item_t) + nbits + 1) << nbits;
+}
+
+static size_t get_fsm_size(const htable_t *table)
+{
+    return (table->symbols_count - 1) * 256 * sizeof(hdecode_fsm_item_t);
+}
 
-    if (cfg->cache_nbits)
+// The widest lookup table which fits L2 cache, every entry has to decode
+// at least one symbol so it can't be narrower than the longest code.
+static uint8_t pick_lut_nbits(const htable_t *table)
+{
+    size_t l2 = get_cache_size(2);
+    uint8_t nbits = table->max_code_len > MIN_CACHE_NBITS ? table->max_code_len : MIN_CACHE_NBITS;
+
+    if (nbits > MAX_CACHE_NBITS)
     {
-        lut = build_lookup_table(root, cfg);
-        if (cfg->dump_lookup_table)
-        {
-            dump_lookup_table(lut);
-        }
+        return 0;
     }
-
-    if (cfg->verbose)
+    while (nbits < MAX_CACHE_NBITS && get_lut_size(nbits + 1) <= l2)
     {
-        t = hdr->blocks_count / 58;
-        printf("Decoding file: ");
+        nbits++;
     }
 
-    for (size_t i = 0; i < hdr->blocks_count; i++)
-    {
-        bds = &hdr->blocks[i];
-        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
-        ubuffer_reserve_capacity(&buffer, bds->original_size);
-        output = (lut ? _decode_block : decode_block)(input, &buffer, bds->original_size, cfg, root, lut);
+    return nbits;
+}
 
-        // TODO: set position for writing a new block from bds->original_offset.
-        ufile_writer_write(fw, output);
-        if (cfg->verbose && j++ > t)
-        {
-            j = 0;
-            printf(".");
-            fflush(stdout);
-        }
-    }
-    if (cfg->verbose)
+// Table is narrowed down to the longest code to fit the budget, so
+// --cache-nbits is an upper limit under --max-memory.
+static uint8_t get_lut_nbits(const htable_t *table, const hcfg_t *cfg)
+{
+    uint8_t nbits = cfg->cache_nbits ? cfg->cache_nbits : pick_lut_nbits(table);
+
+    while (cfg->max_table_size && nbits > MIN_CACHE_NBITS && nbits > table->max_code_len &&
+           get_lut_size(nbits) > cfg->max_table_size)
     {
-        puts(" Done.");
+        nbits--;
     }
 
-    // Free decoding buffer.
-    ubuffer_destroy(&buffer);
-    destroy_lookup_table(lut);
+    return nbits;
 }
 
-static int compare_hnodes(const void *hnode1, const void *hnode2)
+static bool fits_table_budget(size_t size, const hcfg_t *cfg)
 {
-    const hnode_t *n1 = hnode1;
-    const hnode_t *n2 = hnode2;
+    return !cfg->max_table_size || size <= cfg->max_table_size;
+}
+
+static bool decoder_is_supported_by_table(hdecoder_type_t type, const htable_t *table, const hcfg_t *cfg)
+{
+    uint8_t nbits;
 
-    // Make sure highlighted nodes are at the top of the heap.
-    if (n1->highlight)
+    switch (type)
     {
-        return -1;
+        case HDECODER_TREE:
+            return true;
+        case HDECODER_LUT:
+            // Every table entry has to decode at least one symbol.
+            nbits = get_lut_nbits(table, cfg);
+            return table->symbols_count > 1 && nbits && table->max_code_len <= nbits &&
+                   fits_table_budget(get_lut_size(nbits), cfg);
+        case HDECODER_FSM:
+            return table->symbols_count > 1 && fits_table_budget(get_fsm_size(table), cfg);
+        default:
+            return false;
     }
-    else if (n2->highlight)
+}
+
+bool decoder_is_supported(hdecoder_type_t type, const hnode_t *root, const hcfg_t *cfg)
+{
+    htable_t *table = build_codes(root, cfg);
+    bool supported = decoder_is_supported_by_table(type, table, cfg);
+    ufree(table);
+
+    return supported;
+}
+
+// Estimated decoding speed in symbols per unit of work. The tree walker
+// spends a unit per bit, LUT and FSM decode a few symbols per lookup but
+// a lookup costs more and much more once the table falls out of L2 cache.
+static double get_decoder_score(hdecoder_type_t type, const htable_t *table, uint8_t nbits)
+{
+    double mean = table->mean_code_len > 1.0 ? table->mean_code_len : 1.0;
+    size_t l2 = get_cache_size(2);
+
+    switch (type)
     {
-        return 1;
+        case HDECODER_TREE:
+            return 1.0 / mean;
+        case HDECODER_LUT:
+            return ((nbits - mean / 2) / mean) /
+                   (LUT_LOOKUP_COST * (get_lut_size(nbits) > l2 ? CACHE_MISS_PENALTY : 1.0));
+        case HDECODER_FSM:
+            return (8.0 / mean) /
+                   (FSM_LOOKUP_COST * (get_fsm_size(table) > l2 ? CACHE_MISS_PENALTY : 1.0));
+        default:
+            return 0;
     }
-    else
+}
+
+static hdecoder_type_t pick_decoder(const htable_t *table, const hcfg_t *cfg)
+{
+    hdecoder_type_t best = HDECODER_TREE;
+    double best_score = 0;
+
+    for (hdecoder_type_t type = HDECODER_TREE; type < HDECODER_COUNT; type++)
     {
-        return n1->frequency - n2->frequency;
+        if (decoder_is_supported_by_table(type, table, cfg))
+        {
+            double score = get_decoder_score(type, table, get_lut_nbits(table, cfg));
+            if (score > best_score)
+            {
+                best = type;
+                best_score = score;
+            }
+        }
     }
+
+    return best;
 }
 
-hnode_t *build_tree(const hcfg_t *cfg, const hstat_t *stat)
+static hdecoder_t *build_decoder_as(const hnode_t *root, const htable_t *table, hdecoder_type_t type,
+                                    const hcfg_t *cfg)
 {
-    hnode_t *node;
-    size_t page = 0;
-
-    size_t j = 0;
-    size_t t = 0;
+    hdecoder_t *decoder = uzalloc(sizeof(*decoder));
+    decoder->root = root;
+    decoder->cfg = cfg;
+    decoder->type = type;
 
-    // Create leaves and put them to the heap.
-    uheap_t *h = uheap_create();
-    uheap_set_void_comparator(h, compare_hnodes);
-    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    if (decoder->type == HDECODER_LUT)
     {
-        if (stat->frequencies[i])
+        decoder->lut = build_lookup_table(root, get_lut_nbits(table, cfg), cfg);
+        decoder->table_size = get_lut_size(decoder->lut->nbits);
+        if (cfg->dump_lookup_table)
         {
-            node = umalloc(sizeof(*node));
-            node->left = NULL;
-            node->right = NULL;
-            node->is_leaf = true;
-            node->code = i;
-            node->code_as_str = escape_symbol(i);
-            node->highlight = false;
-            node->frequency = stat->frequencies[i];
-            uheap_push(h, G_PTR(node));
+            dump_lookup_table(decoder->lut);
         }
     }
-
-    if (cfg->dump_tree)
+    else if (decoder->type == HDECODER_FSM)
     {
-        generate_graph(uheap_get_cells(h), uheap_get_size(h), page++);
+        decoder->fsm = build_fsm(root, cfg);
+        decoder->table_size = get_fsm_size(table);
     }
+
+    return decoder;
+}
+
+static void report_decoder(const hdecoder_t *decoder, const htable_t *table, const char *how)
+{
+    printf("Using %s decoder (%s): table %zu bytes", get_decoder_name(decoder->type), how, decoder->table_size);
+    if (decoder->lut)
+    {
+        printf(", %u bits", decoder->lut->nbits);
+    }
+    printf("; %u symbols, max/mean code len %u/%.2f; L1 %zu, L2 %zu bytes.\n",
+           table->symbols_count, table->max_code_len, table->mean_code_len,
+           get_cache_size(1), get_cache_size(2));
+}
+
+// Engine and LUT width are picked from code lengths of the tree and CPU
+// cache sizes unless forced by --decoder or --cache-nbits.
+hdecoder_t *build_decoder(const hnode_t *root, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(root);
+    UASSERT_INPUT(cfg);
+
+    htable_t *table = build_codes(root, cfg);
+    hdecoder_type_t type = cfg->decoder;
+
+    if (type == HDECODER_AUTO)
+    {
+        type = cfg->cache_nbits ? HDECODER_LUT : pick_decoder(table, cfg);
+    }
+    if (!decoder_is_supported_by_table(type, table, cfg))
+    {
+        fprintf(stderr, "Warning: %s decoder is not supported for this tree, using tree one.\n",
+                get_decoder_name(type));
+        type = HDECODER_TREE;
+    }
+
+    hdecoder_t *decoder = build_decoder_as(root, table, type, cfg);
+    if (cfg->verbose)
+    {
+        report_decoder(decoder, table, cfg->decoder == HDECODER_AUTO && !cfg->cache_nbits ? "auto" : "forced");
+    }
+    ufree(table);
+
+    return decoder;
+}
+
+// Build every supported decoder, run each on the block and keep the
+// fastest one.
+hdecoder_t *calibrate_decoder(const hnode_t *root, umemchunk_t input, size_t original_size, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(root);
+    UASSERT_INPUT(cfg);
+
+    htable_t *table = build_codes(root, cfg);
+    hdecoder_t *best = NULL;
+    double best_speed = 0;
+    ubuffer_t buffer = {0};
+
+    for (hdecoder_type_t type = HDECODER_TREE; type < HDECODER_COUNT; type++)
+    {
+        if (!decoder_is_supported_by_table(type, table, cfg))
+        {
+            continue;
+        }
+
+        hdecoder_t *decoder = build_decoder_as(root, table, type, cfg);
+        size_t runs = 0;
+        double t = get_time();
+        do
+        {
+            decode_block(decoder, input, &buffer, original_size);
+            runs++;
+        } while (get_time() - t < CALIBRATION_SECONDS);
+        double speed = runs / (get_time() - t);
+
+        if (speed > best_speed)
+        {
+            destroy_decoder(best);
+            best = decoder;
+            best_speed = speed;
+        }
+        else
+        {
+            destroy_decoder(decoder);
+        }
+    }
+
+    if (cfg->verbose)
+    {
+        report_decoder(best, table, "calibrated");
+    }
+    ubuffer_destroy(&buffer);
+    ufree(table);
+
+    return best;
+}
+
+void destroy_decoder(hdecoder_t *decoder)
+{
+    if (decoder)
+    {
+        destroy_lookup_table(decoder->lut);
+        destroy_fsm(decoder->fsm);
+        destroy_context_decoder(decoder->context);
+        destroy_wide_decoder(decoder->wide);
+        destroy_adaptive_decoder(decoder->adaptive);
+        ufree(decoder);
+    }
+}
+
+// Decode one block into the buffer, decoder is read-only here so the same
+// decoder can be used from several threads, each with its own buffer.
+umemchunk_t decode_block(const hdecoder_t *decoder, umemchunk_t input,
+                         ubuffer_t *buffer, size_t original_size)
+{
+    umemchunk_t output;
+
+    if (decoder->store)
+    {
+        ubuffer_reset(buffer);
+        ubuffer_append_data(buffer, input.data, input.size < original_size ? input.size : original_size);
+        output.data = buffer->data;
+        output.size = buffer->data_size;
+        return output;
+    }
+    if (decoder->adaptive)
+    {
+        return decode_block_adaptive(decoder, input, buffer, original_size);
+    }
+
+    // FSM decoder writes up to 8 bytes past the decoded data.
+    ubuffer_reserve_capacity(buffer, original_size + 8);
+    if (decoder->context || decoder->wide)
+    {
+        output = (decoder->context ? decode_block_context : decode_block_wide)(decoder, input, buffer,
+                                                                                original_size);
+        buffer->data_size = output.size;
+        return output;
+    }
+
+    switch (decoder->type)
+    {
+        case HDECODER_LUT:
+            output = decode_block_lut(input, buffer, original_size, decoder->cfg, decoder->root, decoder->lut);
+            break;
+        case HDECODER_FSM:
+            output = decode_block_fsm(input, buffer, original_size, decoder->cfg, decoder->fsm);
+            break;
+        default:
+            output = decode_block_tree(input, buffer, original_size, decoder->cfg, decoder->root, NULL);
+            break;
+    }
+    buffer->data_size = output.size;
+
+    return output;
+}
+
+void decode(ufile_reader_t *fr, ufile_writer_t *fw, const hdecoder_t *decoder,
+            const huffman_archive_header_t *hdr, const hcfg_t *cfg)
+{
+    const block_descriptor_t *bds;
+    umemchunk_t input, output;
+    ubuffer_t buffer = {0};
+
+    size_t j = 0;
+    size_t t = 0;
+
+    if (cfg->verbose)
+    {
+        t = hdr->blocks_count / 58;
+        printf("Decoding file: ");
+    }
+
+    for (size_t i = 0; i < hdr->blocks_count; i++)
+    {
+        bds = &hdr->blocks[i];
+        profile_start(HSTAGE_IO);
+        input = G_AS_MEMCHUNK(ufile_reader_read(fr, bds->compressed_size, NULL));
+        profile_stop(HSTAGE_IO, input.size);
+        profile_start(HSTAGE_DECODE);
+        output = decode_block(decoder, input, &buffer, bds->original_size);
+        profile_stop(HSTAGE_DECODE, output.size);
+        if (output.size != bds->original_size || crc32c(0, output.data, output.size) != bds->checksum)
+        {
+            fprintf(stderr, "Error: checksum mismatch in block %zu, archive is corrupted.\n", i);
+            exit(EXIT_FAILURE);
+        }
+
+        // TODO: set position for writing a new block from bds->original_offset.
+        profile_start(HSTAGE_IO);
+        ufile_writer_write(fw, output);
+        profile_stop(HSTAGE_IO, output.size);
+        if (cfg->verbose && j++ > t)
+        {
+            j = 0;
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+    }
+
+    // Free decoding buffer.
+    ubuffer_destroy(&buffer);
+}
+
+static hnode_t *create_hnode(harena_t *arena)
+{
+    hnode_t *node = arena_alloc(arena, sizeof(*node));
+    memset(node, 0, sizeof(*node));
+    node->code = -1;
+    return node;
+}
+
+static int compare_hnodes(const void *hnode1, const void *hnode2)
+{
+    const hnode_t *n1 = hnode1;
+    const hnode_t *n2 = hnode2;
+    return n1->frequency - n2->frequency;
+}
+
+hnode_t *build_tree(const hcfg_t *cfg, const hstat_t *stat)
+{
+    return build_tree_from_frequencies(cfg, stat->frequencies, HCODES_TABLE_SIZE);
+}
+
+// Tree of an alphabet of symbols_count symbols, symbols with zero frequency
+// are left out.
+hnode_t *build_tree_from_frequencies(const hcfg_t *cfg, const uint32_t *frequencies, size_t symbols_count)
+{
+    harena_t *arena = arena_create(TREE_ARENA_CHUNK_SIZE);
+    FILE *log = cfg->dump_tree ? open_tree_log() : NULL;
+    unsigned int id = 0;
+    hnode_t *node;
+
+    size_t j = 0;
+    size_t t = 0;
+
+    // Create leaves and put them to the heap.
+    uheap_t *h = uheap_create();
+    uheap_set_void_comparator(h, compare_hnodes);
+    for (size_t i = 0; i < symbols_count; i++)
+    {
+        if (frequencies[i])
+        {
+            node = create_hnode(arena);
+            node->is_leaf = true;
+            node->code = i;
+            node->id = id++;
+            node->frequency = frequencies[i];
+            uheap_push(h, G_PTR(node));
+            if (log)
+            {
+                log_tree_node(log, node);
+            }
+        }
+    }
+
     if (cfg->verbose)
     {
         t = uheap_get_size(h) / 58;
@@ -461,33 +1203,15 @@ hnode_t *build_tree(const hcfg_t *cfg, const hstat_t *stat)
     {
         n1 = G_AS_PTR(uheap_pop(h));
         n2 = G_AS_PTR(uheap_pop(h));
-
-        if (cfg->dump_tree)
-        {
-            n1->highlight = true;
-            n2->highlight = true;
-            uheap_push(h, G_PTR(n1));
-            uheap_push(h, G_PTR(n2));
-            generate_graph(uheap_get_cells(h), uheap_get_size(h), page++);
-            n1 = G_AS_PTR(uheap_pop(h));
-            n2 = G_AS_PTR(uheap_pop(h));
-            n1->highlight = false;
-            n2->highlight = false;
-        }
-        node = umalloc(sizeof(*node));
+        node = create_hnode(arena);
         node->left = n1;
         node->right = n2;
-        node->is_leaf = false;
-        node->code = -1;
-        node->code_as_str = ustring_fmt("%s%s", n1->code_as_str, n2->code_as_str);
-        node->highlight = false;
+        node->id = id++;
         node->frequency = n1->frequency + n2->frequency;
         uheap_push(h, G_PTR(node));
-        if (cfg->dump_tree)
+        if (log)
         {
-            node->highlight = true;
-            generate_graph(uheap_get_cells(h), uheap_get_size(h), page++);
-            node->highlight = false;
+            log_tree_node(log, node);
         }
         if (cfg->verbose && j++ > t)
         {
@@ -500,10 +1224,15 @@ hnode_t *build_tree(const hcfg_t *cfg, const hstat_t *stat)
     {
         puts(" Done.");
     }
+    if (log)
+    {
+        fclose(log);
+    }
 
     hnode_t *root = G_AS_PTR(uheap_pop(h));
     UASSERT(uheap_is_empty(h));
     uheap_destroy(h);
+    root->arena = arena;
     return root;
 }
 
@@ -562,7 +1291,7 @@ static void gather_hcode(const hnode_t *hnode, void *cb_data,
     UASSERT_INPUT(cb_data);
     UASSERT_INPUT(path);
 
-    hcode_t *hcodes = cb_data;
+    htable_t *table = cb_data;
     hcode_t hcode = {0};
 
     if (hnode->is_leaf)
@@ -575,7 +1304,14 @@ static void gather_hcode(const hnode_t *hnode, void *cb_data,
             }
         }
         hcode.len = path_len;
-        hcodes[hnode->code] = hcode;
+        hcode.present = true;
+        table->hcodes[hnode->code] = hcode;
+        table->symbols_count++;
+        table->mean_code_len += (double)hnode->frequency * hcode.len;
+        if (hcode.len > table->max_code_len)
+        {
+            table->max_code_len = hcode.len;
+        }
     }
 }
 
@@ -586,22 +1322,391 @@ htable_t *build_codes(const hnode_t *root, const hcfg_t *cfg)
 
     char path[MAX_HCODE_LENGTH + 1] = {0};
     htable_t *table = uzalloc(sizeof(*table));
-    traverse_htree(root, gather_hcode, table->hcodes, path, 0, SIZE_MAX);
+    traverse_htree(root, gather_hcode, table, path, 0, SIZE_MAX);
+    table->mean_code_len /= root->frequency;
 
     return table;
 }
 
-static void destroy_hnode(const hnode_t *hnode, void *cb_data,
-                          char *path, size_t path_len)
+// All the nodes go at once with the arena.
+void destroy_tree(hnode_t *root)
+{
+    UASSERT_INPUT(root);
+    arena_destroy(root->arena);
+}
+
+static int compare_code_lengths(const void *p1, const void *p2)
+{
+    const hcode_t *c1 = *(const hcode_t **)p1;
+    const hcode_t *c2 = *(const hcode_t **)p2;
+
+    if (c1->len != c2->len)
+    {
+        return c1->len - c2->len;
+    }
+
+    return (c1 > c2) - (c1 < c2); // by symbol
+}
+
+// Replace codes with canonical ones of the same lengths: codes of the same
+// length are consecutive numbers in symbol order and shorter codes come
+// first. The first bit sent is the MSB of the canonical code, so the code
+// is stored bit-reversed (LSB of code corresponds to root of the htree).
+void assign_canonical_codes(htable_t *table)
+{
+    UASSERT_INPUT(table);
+
+    hcode_t *sorted[HCODES_TABLE_SIZE];
+    size_t count = 0;
+    uint64_t code = 0;
+    uint8_t len = 0;
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (table->hcodes[i].present)
+        {
+            sorted[count++] = &table->hcodes[i];
+        }
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_code_lengths);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        code <<= sorted[i]->len - len;
+        len = sorted[i]->len;
+        sorted[i]->code = 0;
+        for (uint8_t j = 0; j < len; j++)
+        {
+            if (code & (1LLU << (len - 1 - j)))
+            {
+                sorted[i]->code |= 1LLU << j;
+            }
+        }
+        code++;
+    }
+}
+
+static void complete_hnode(const hnode_t *hnode, void *cb_data,
+                           char *path, size_t path_len)
 {
     // Cast away const qualifier imposed by callback signature.
     hnode_t *node = (hnode_t*)hnode;
-    ufree(node->code_as_str);
-    ufree(node);
+    if (!node->is_leaf)
+    {
+        node->frequency = node->left->frequency + node->right->frequency;
+    }
 }
 
-void destroy_tree(hnode_t *root)
+// Tree of a table with (canonical) codes, frequencies of leaves are implied
+// by code lengths. The table must define a complete prefix code, see
+// unpack_code_lengths().
+hnode_t *build_tree_from_codes(const htable_t *table)
 {
-    UASSERT_INPUT(root);
-    traverse_htree(root, destroy_hnode, NULL, NULL, 0, SIZE_MAX);
+    UASSERT_INPUT(table);
+
+    harena_t *arena = arena_create(TREE_ARENA_CHUNK_SIZE);
+    char path[MAX_HCODE_LENGTH + 1] = {0};
+    hnode_t *root = NULL;
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        const hcode_t *hcode = &table->hcodes[i];
+        hnode_t **link = &root;
+        if (!hcode->present)
+        {
+            continue;
+        }
+        for (uint8_t j = 0; j < hcode->len; j++)
+        {
+            if (!*link)
+            {
+                *link = create_hnode(arena);
+            }
+            link = ((hcode->code >> j) & 1) ? &(*link)->right : &(*link)->left;
+        }
+        UASSERT(!*link);
+        *link = create_hnode(arena);
+        (*link)->is_leaf = true;
+        (*link)->code = i;
+        (*link)->frequency = 1LLU << (table->max_code_len - hcode->len);
+    }
+    UASSERT(root);
+
+    traverse_htree(root, complete_hnode, NULL, path, 0, SIZE_MAX);
+    root->arena = arena;
+
+    return root;
+}
+
+// Canonical code table of the stat, tree is built quietly.
+htable_t *build_canonical_table(const hstat_t *stat, const hcfg_t *cfg)
+{
+    hcfg_t quiet = *cfg;
+    quiet.verbose = false;
+    quiet.dump_tree = false;
+
+    hnode_t *root = build_tree(&quiet, stat);
+    htable_t *table = build_codes(root, &quiet);
+    destroy_tree(root);
+    assign_canonical_codes(table);
+
+    return table;
+}
+
+// Canonical codes of tables with the same code lengths are the same.
+bool have_same_code_lengths(const htable_t *t1, const htable_t *t2)
+{
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (t1->hcodes[i].present != t2->hcodes[i].present || t1->hcodes[i].len != t2->hcodes[i].len)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Size of the data with the stat coded with the table, SIZE_MAX if some
+// symbol of the stat has no code in the table.
+size_t get_coded_bits(const htable_t *table, const hstat_t *stat)
+{
+    size_t bits = 0;
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (stat->frequencies[i])
+        {
+            if (!table->hcodes[i].present)
+            {
+                return SIZE_MAX;
+            }
+            bits += (size_t)stat->frequencies[i] * table->hcodes[i].len;
+        }
+    }
+
+    return bits;
+}
+
+// Size of blocks_count blocks coded with the table, stat is their total
+// histogram. Bitstream size is exact, every block pads its part to a byte
+// (one byte at least) and adds guard bytes, so the blocks take from
+// min_size to max_size bytes, exactly min_size for a single block.
+void predict_encoded_size(const htable_t *table, const hstat_t *stat, size_t blocks_count, size_t *min_size,
+                          size_t *max_size)
+{
+    UASSERT_INPUT(table);
+    UASSERT_INPUT(stat);
+    UASSERT_INPUT(min_size);
+    UASSERT_INPUT(max_size);
+
+    size_t bits = get_coded_bits(table, stat);
+    UASSERT(bits != SIZE_MAX);
+    size_t bytes = (bits + 7) / 8;
+
+    *min_size = (bytes > blocks_count ? bytes : blocks_count) + blocks_count * HBLOCK_GUARD_BYTES;
+    *max_size = bytes + blocks_count * (1 + HBLOCK_GUARD_BYTES);
+}
+
+// Size of the table packed with pack_code_lengths().
+size_t get_packed_bits(const htable_t *table)
+{
+    ubuffer_t packed = {0};
+    pack_code_lengths(table, &packed);
+    size_t bits = packed.data_size * 8;
+    ubuffer_destroy(&packed);
+    return bits;
+}
+
+void merge_stat(hstat_t *dst, const hstat_t *src)
+{
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        dst->frequencies[i] += src->frequencies[i];
+    }
+}
+
+// Packed code lengths: flags, number of symbols minus one, symbols present
+// (listed or as a 256-bit map, whichever is shorter) and their code lengths
+// (in nibbles when all of them fit, in bytes otherwise).
+#define PACKED_SYMBOLS_MAP 0x01
+#define PACKED_NIBBLES     0x02
+#define PACKED_LIST_MAX    (HCODES_TABLE_SIZE / 8)
+
+void pack_code_lengths(const htable_t *table, ubuffer_t *output)
+{
+    UASSERT_INPUT(table);
+    UASSERT_INPUT(output);
+    UASSERT(table->symbols_count);
+
+    uint8_t flags = 0;
+    uint8_t map[HCODES_TABLE_SIZE / 8] = {0};
+    uint8_t nibbles = 0;
+    size_t count = 0;
+
+    if (table->symbols_count > PACKED_LIST_MAX)
+    {
+        flags |= PACKED_SYMBOLS_MAP;
+    }
+    if (table->max_code_len < 16)
+    {
+        flags |= PACKED_NIBBLES;
+    }
+    ubuffer_append_byte(output, flags);
+    ubuffer_append_byte(output, table->symbols_count - 1);
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (!table->hcodes[i].present)
+        {
+            continue;
+        }
+        if (flags & PACKED_SYMBOLS_MAP)
+        {
+            map[i / 8] |= 1 << (i % 8);
+        }
+        else
+        {
+            ubuffer_append_byte(output, i);
+        }
+    }
+    if (flags & PACKED_SYMBOLS_MAP)
+    {
+        ubuffer_append_data(output, map, sizeof(map));
+    }
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        uint8_t len = table->hcodes[i].len;
+        if (!table->hcodes[i].present)
+        {
+            continue;
+        }
+        if (!(flags & PACKED_NIBBLES))
+        {
+            ubuffer_append_byte(output, len);
+        }
+        else if (count++ % 2)
+        {
+            ubuffer_append_byte(output, nibbles | (len << 4));
+        }
+        else
+        {
+            nibbles = len;
+        }
+    }
+    if ((flags & PACKED_NIBBLES) && (count % 2))
+    {
+        ubuffer_append_byte(output, nibbles);
+    }
+}
+
+// Unpack code lengths and assign canonical codes, returns number of bytes
+// consumed or 0 when data is truncated or lengths don't make a complete
+// prefix code.
+size_t unpack_code_lengths(const uint8_t *data, size_t size, htable_t *table)
+{
+    UASSERT_INPUT(data);
+    UASSERT_INPUT(table);
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    uint8_t flags;
+    size_t count;
+    uint64_t kraft = 0; // sum of 2^(PAIR_LEN_SHIFT - len)
+
+    memset(table, 0, sizeof(*table));
+    if (end - p < 2)
+    {
+        return 0;
+    }
+    flags = *p++;
+    count = *p++ + 1;
+
+    if (flags & PACKED_SYMBOLS_MAP)
+    {
+        if (end - p < HCODES_TABLE_SIZE / 8)
+        {
+            return 0;
+        }
+        for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+        {
+            if (p[i / 8] & (1 << (i % 8)))
+            {
+                table->hcodes[i].present = true;
+                table->symbols_count++;
+            }
+        }
+        p += HCODES_TABLE_SIZE / 8;
+    }
+    else
+    {
+        if ((size_t)(end - p) < count)
+        {
+            return 0;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!table->hcodes[p[i]].present)
+            {
+                table->hcodes[p[i]].present = true;
+                table->symbols_count++;
+            }
+        }
+        p += count;
+    }
+    if (table->symbols_count != count)
+    {
+        return 0;
+    }
+
+    if ((size_t)(end - p) < ((flags & PACKED_NIBBLES) ? (count + 1) / 2 : count))
+    {
+        return 0;
+    }
+    count = 0;
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        hcode_t *hcode = &table->hcodes[i];
+        if (!hcode->present)
+        {
+            continue;
+        }
+        if (flags & PACKED_NIBBLES)
+        {
+            hcode->len = (p[count / 2] >> (4 * (count % 2))) & 0x0f;
+        }
+        else
+        {
+            hcode->len = p[count];
+        }
+        count++;
+
+        // Single symbol is coded with 0 bits, otherwise every code has
+        // at least one bit.
+        if (hcode->len > PAIR_LEN_SHIFT || (hcode->len == 0) != (table->symbols_count == 1))
+        {
+            return 0;
+        }
+        if (hcode->len)
+        {
+            kraft += 1LLU << (PAIR_LEN_SHIFT - hcode->len);
+            if (kraft > (1LLU << PAIR_LEN_SHIFT))
+            {
+                return 0;
+            }
+        }
+        if (hcode->len > table->max_code_len)
+        {
+            table->max_code_len = hcode->len;
+        }
+    }
+    p += (flags & PACKED_NIBBLES) ? (count + 1) / 2 : count;
+    if (table->symbols_count > 1 && kraft != (1LLU << PAIR_LEN_SHIFT))
+    {
+        return 0;
+    }
+
+    assign_canonical_codes(table);
+
+    return p - data;
 }
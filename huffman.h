@@ -6,6 +6,37 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <ugeneric.h>
+#include "arena.h"
+
+// Encoder engines, HENCODER_AUTO picks the fastest one supported by CPU.
+typedef enum {
+    HENCODER_AUTO = 0,
+    HENCODER_SCALAR,
+    HENCODER_PAIR,
+    HENCODER_AVX2,
+    HENCODER_COUNT,
+} hencoder_type_t;
+
+// Decoder engines, HDECODER_AUTO picks one from code lengths and CPU cache
+// sizes.
+typedef enum {
+    HDECODER_AUTO = 0,
+    HDECODER_TREE,
+    HDECODER_LUT,
+    HDECODER_FSM,
+    HDECODER_COUNT,
+} hdecoder_type_t;
+
+// Block I/O engines of compression and extraction, HIO_URING falls back
+// to HIO_UFILE when io_uring isn't available.
+typedef enum {
+    HIO_UFILE = 0,
+    HIO_URING,
+    HIO_COUNT,
+} hio_engine_t;
+
+// Warm decoders of a daemon worker, see daemon.h.
+typedef struct _decoder_cache hdecoder_cache_t;
 
 // App config.
 typedef struct {
@@ -20,30 +51,69 @@ typedef struct {
     bool dry_run;
     bool extract_mode;
     bool dump_blocks_map;
+    bool batch_mode;
+    size_t threads;
+    bool bench;
+    hencoder_type_t encoder;
+    hdecoder_type_t decoder;
+    bool calibrate;
+    bool test_mode;
+    bool order1;
+    bool wide;
+    bool adaptive;
+    bool segment;
+    size_t min_block_size; // segment size limits in segment mode
+    size_t max_block_size;
+    bool stream;
+    size_t flush_size; // largest chunk in stream mode
+    size_t message_size; // benchmark frames of this size instead of blocks
+    bool append;
+    const char *update_file; // archive of the previous version of the input
+    size_t sync_interval;
+    bool range; // extract range_size bytes from range_offset
+    size_t range_offset;
+    size_t range_size;
+    bool profile;
+    hio_engine_t io_engine;
+    size_t max_memory; // extraction memory budget, 0 for no limit
+    size_t max_table_size; // decoding tables budget of a decoder, 0 for no limit
+    size_t queue_depth; // blocks in flight of the io_uring engine, 0 for AIO_QUEUE_DEPTH
+    const char *daemon_socket; // serve requests on this socket
+    const char *server_socket; // send the command to the daemon on this socket
+    hdecoder_cache_t *decoder_cache; // set for requests run by a daemon worker
+    bool render_tree; // render frames [render_first, render_last] of a --dump-tree log
+    size_t render_first;
+    size_t render_last;
+    bool selftest; // run every engine pair on generated data, see selftest.h
 } hcfg_t;
 
-// Huffman tree node.
+// Huffman tree node, nodes are allocated from the arena of the tree, see
+// destroy_tree().
+#define TREE_ARENA_CHUNK_SIZE 16384
 struct _node {
-    char *code_as_str;
+    harena_t *arena; // set in the root only
     size_t frequency;
     struct _node *left;
     struct _node *right;
     unsigned int code;
-    bool highlight;
+    unsigned int id; // creation order of a tree built from frequencies, see TREE_LOG_FILE
     bool is_leaf;
 };
 typedef struct _node hnode_t;
 
-// Huffman code, LSB of code corresponds to root of the htree.
+// Huffman code, LSB of code corresponds to root of the htree. Code of the
+// only symbol of a single-symbol table is 0 bits long.
 typedef struct {
     uint8_t len;
+    bool present;
     uint64_t code;
 } hcode_t;
 
 typedef struct {
     uint32_t original_size;
     uint32_t compressed_size;
-    uint32_t original_offset;
+    uint64_t original_offset; // inputs may be larger than 4 GiB
+    uint32_t checksum; // CRC-32C of original data
 } block_descriptor_t;
 
 // Code table, index in the table is corresponded symbol code.
@@ -56,28 +126,101 @@ typedef struct {
 typedef struct {
     hcode_t hcodes[HCODES_TABLE_SIZE];
     double mean_code_len;
+    uint8_t max_code_len;
+    uint16_t symbols_count;
 } htable_t;
 
+#define HUFFMAN_ARCHIVE_SIGNATURE "PKHUF"
+#define HUFFMAN_ARCHIVE_VERSION 5
+
+// Archive codecs.
+typedef enum {
+    HCODEC_STATIC = 0, // one code table built from the header stat
+    HCODEC_ORDER1,     // code table per previous byte, see context.h
+    HCODEC_WIDE,       // 16-bit symbols, see wide.h
+    HCODEC_ADAPTIVE,   // code table per block, see adaptive.h
+    HCODEC_STREAM,     // one-pass adaptive codec, no blocks, see stream.h
+    HCODEC_STORE,      // blocks are stored as is, coding wouldn't make them smaller
+    HCODEC_COUNT,
+} hcodec_t;
+
+// Archive flags.
+#define HARCHIVE_INDEX_AT_END 1 // block descriptors and tables are stored after the blocks (--append)
+
+// Sync points (sync_points_count of them, see sync.h) and codec tables
+// (tables_size bytes) follow the block descriptors.
 typedef struct {
+    char signature[sizeof(HUFFMAN_ARCHIVE_SIGNATURE) - 1];
+    uint8_t version;
+    uint8_t codec;
+    uint8_t flags;
     hstat_t stat;
     uint32_t blocks_count;
+    uint32_t tables_size;
+    uint32_t sync_interval;
+    uint32_t sync_points_count;
     block_descriptor_t blocks[];
 } huffman_archive_header_t;
 
 // Maximum supported len, very pessimistic, much smaller usually.
 #define MAX_HCODE_LENGTH 64
 
+size_t get_blocks_count(size_t input_size, const hcfg_t *cfg);
+size_t get_stat_count(size_t blocks_count, const hcfg_t *cfg);
+void update_stat(hstat_t *stats, size_t block, umemchunk_t m, const hcfg_t *cfg);
 hstat_t *build_stat(ufile_reader_t *fr, const hcfg_t *cfg);
-uvector_t *encode(ufile_reader_t *fr, ufile_writer_t *fw, const htable_t *htable, const hcfg_t *cfg);
-void decode(ufile_reader_t *fr, ufile_writer_t *fw, const hnode_t *root, const huffman_archive_header_t *hdr, const hcfg_t *cfg);
+
+typedef struct _adaptive_encoder hadaptive_encoder_t;
+
+// Block encoder, built once per code table and read-only afterwards.
+typedef struct {
+    const htable_t *htable;
+    const hcfg_t *cfg;
+    hencoder_type_t type;
+    uint8_t max_code_len;
+    uint32_t codes[HCODES_TABLE_SIZE]; // 32-bit copies for vector kernels
+    uint32_t lens[HCODES_TABLE_SIZE];
+    uint64_t *pairs; // codes of all byte pairs, see PAIR_CODE()
+    uint64_t *context_codes; // order-1 codes indexed by context << 8 | byte
+    uint64_t *wide_codes; // codes of 16-bit symbols
+    hadaptive_encoder_t *adaptive; // per block tables, see adaptive.h
+    bool store; // blocks are copied as is (HCODEC_STORE)
+} hencoder_t;
+
+// Pair table entry keeps the combined code of two symbols in the low bits
+// and its length in the top 6 bits of a 64-bit word.
+#define PAIR_LEN_SHIFT 58
+#define PAIR_MAX_CODE_LENGTH (PAIR_LEN_SHIFT / 2)
+#define PAIR_CODE(code, len) ((code) | ((uint64_t)(len) << PAIR_LEN_SHIFT))
+
+hencoder_t *build_encoder(const htable_t *htable, const hcfg_t *cfg);
+bool encoder_is_supported(hencoder_type_t type, const htable_t *htable);
+void destroy_encoder(hencoder_t *encoder);
+umemchunk_t encode_block(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer);
+const char *get_encoder_name(hencoder_type_t type);
 
 typedef void (*traverse_cb)(const hnode_t *node, void *cb_data, char *path, size_t path_len);
 void traverse_htree(const hnode_t *node, traverse_cb cb, void *cb_data, char *path, size_t path_len, size_t max_depth);
 
 hnode_t *build_tree(const hcfg_t *cfg, const hstat_t *stat);
+hnode_t *build_tree_from_frequencies(const hcfg_t *cfg, const uint32_t *frequencies, size_t symbols_count);
 htable_t *build_codes(const hnode_t *root, const hcfg_t *cfg);
 void destroy_tree(hnode_t *root);
 
+// Canonical codes are defined by code lengths only, so that is all what has
+// to be stored for a table.
+void assign_canonical_codes(htable_t *table);
+hnode_t *build_tree_from_codes(const htable_t *table);
+void pack_code_lengths(const htable_t *table, ubuffer_t *output);
+size_t unpack_code_lengths(const uint8_t *data, size_t size, htable_t *table);
+htable_t *build_canonical_table(const hstat_t *stat, const hcfg_t *cfg);
+bool have_same_code_lengths(const htable_t *t1, const htable_t *t2);
+size_t get_coded_bits(const htable_t *table, const hstat_t *stat);
+size_t get_packed_bits(const htable_t *table);
+void predict_encoded_size(const htable_t *table, const hstat_t *stat, size_t blocks_count, size_t *min_size,
+                          size_t *max_size);
+void merge_stat(hstat_t *dst, const hstat_t *src);
+
 // Lookup table item.
 typedef struct {
     const hnode_t *node;
@@ -86,10 +229,77 @@ typedef struct {
     uint8_t decoded_bits;
 } hdecode_lut_item_t;
 
+// Decoding loop of a lookup table of a particular width, it decodes as
+// much of the block as it safely can and leaves the rest to the generic
+// loop, bit_offset and output_size are advanced past the decoded part.
+struct _decode_lut;
+typedef void (*hlut_kernel_t)(const struct _decode_lut *lut, const uint8_t *in, size_t in_size, uint8_t *out,
+                              size_t original_size, size_t *bit_offset, size_t *output_size);
+
 // Lookup table.
-typedef struct {
+typedef struct _decode_lut {
     hdecode_lut_item_t *items;
+    uint8_t *data; // decoded data of all the items, nbits + 1 bytes each
     uint8_t nbits;
+    hlut_kernel_t kernel; // specialized for nbits, picked once per table
 } hdecode_lut_t;
 
+// Finite-state machine item, states are internal nodes of the tree (root is
+// state 0), every transition consumes one input byte.
+typedef struct {
+    uint8_t symbols[8];
+    uint8_t symbols_count;
+    uint8_t next_state;
+} hdecode_fsm_item_t;
+
+// Finite-state machine, states_count x 256 transitions.
+typedef struct {
+    hdecode_fsm_item_t *items;
+    size_t states_count;
+} hdecode_fsm_t;
+
+// Supported lookup table widths.
+#define MIN_CACHE_NBITS 8
+#define MAX_CACHE_NBITS 24
+
+// Relative cost of a table lookup for decoder selection: LUT extracts an
+// unaligned bit field and copies symbols through a pointer, FSM indexes by
+// a whole byte. Tables which do not fit L2 cache are penalized.
+#define LUT_LOOKUP_COST 3.0
+#define FSM_LOOKUP_COST 1.0
+#define CACHE_MISS_PENALTY 4.0
+
+// Time spent running every decoder on the first block with --calibrate.
+#define CALIBRATION_SECONDS 0.01
+
+typedef struct _context_decoder hcontext_decoder_t;
+typedef struct _wide_decoder hwide_decoder_t;
+typedef struct _adaptive_decoder hadaptive_decoder_t;
+
+// Block decoder, built once per archive and read-only afterwards.
+typedef struct {
+    const hnode_t *root;
+    const hcfg_t *cfg;
+    hdecoder_type_t type;
+    hdecode_lut_t *lut;
+    hdecode_fsm_t *fsm;
+    hcontext_decoder_t *context; // order-1 tables, see context.h
+    hwide_decoder_t *wide; // 16-bit symbol tables, see wide.h
+    hadaptive_decoder_t *adaptive; // per block tables, see adaptive.h
+    bool store; // blocks are copied as is (HCODEC_STORE)
+    size_t table_size; // memory taken by decoding tables
+} hdecoder_t;
+
+hdecoder_t *build_decoder(const hnode_t *root, const hcfg_t *cfg);
+hdecoder_t *calibrate_decoder(const hnode_t *root, umemchunk_t input, size_t original_size, const hcfg_t *cfg);
+bool decoder_is_supported(hdecoder_type_t type, const hnode_t *root, const hcfg_t *cfg);
+const char *get_decoder_name(hdecoder_type_t type);
+void destroy_decoder(hdecoder_t *decoder);
+umemchunk_t decode_block(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer, size_t original_size);
+
+void encode(ufile_reader_t *fr, ufile_writer_t *fw, const hencoder_t *encoder, huffman_archive_header_t *hdr,
+            const hcfg_t *cfg);
+void decode(ufile_reader_t *fr, ufile_writer_t *fw, const hdecoder_t *decoder, const huffman_archive_header_t *hdr,
+            const hcfg_t *cfg);
+
 #endif
@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ugeneric.h>
+#include "iobench.h"
+#include "uring.h"
+#include "util.h"
+
+// Backends return false and set errno when they can't run here.
+typedef bool (*io_copy_fn)(const char *input_file, const char *output_file, size_t block_size);
+
+// Block copied by a slot of the io_uring backend, it is read and then
+// written at the same offset.
+typedef struct {
+    size_t offset;
+    size_t size;
+    size_t done; // bytes of the current read or write
+} iobench_slot_t;
+
+// Keeps errno of the failure being reported.
+static void close_fd(int fd)
+{
+    int error = errno;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    errno = error;
+}
+
+static int open_output(const char *output_file, int flags)
+{
+    return open(output_file, O_WRONLY | O_CREAT | O_TRUNC | flags, 0644);
+}
+
+// Copy is done when it reaches the storage, not the page cache.
+static bool sync_output(const char *output_file)
+{
+    int fd = open(output_file, O_WRONLY);
+    bool ok = fd >= 0 && fdatasync(fd) == 0;
+    close_fd(fd);
+    return ok;
+}
+
+// Input is read from the storage by every run, not from the page cache
+// filled by the previous one.
+static void evict_input(const char *input_file)
+{
+    int fd = open(input_file, O_RDONLY);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static bool copy_ufile(const char *input_file, const char *output_file, size_t block_size)
+{
+    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(input_file, block_size));
+    ufile_writer_t *fw = G_AS_PTR(ufile_writer_create(output_file));
+
+    while (ufile_reader_has_next(fr))
+    {
+        ufile_writer_write(fw, G_AS_MEMCHUNK(ufile_reader_read(fr, block_size, NULL)));
+    }
+    ufile_reader_destroy(fr);
+    ufile_writer_destroy(fw);
+
+    return true;
+}
+
+static bool copy_read_write(const char *input_file, const char *output_file, size_t block_size)
+{
+    int in = open(input_file, O_RDONLY);
+    int out = open_output(output_file, 0);
+    uint8_t *buffer = umalloc(block_size);
+    ssize_t n = -1;
+    bool ok = in >= 0 && out >= 0;
+
+    while (ok && (n = read(in, buffer, block_size)) > 0)
+    {
+        ok = write(out, buffer, n) == n;
+    }
+    ok = ok && n == 0;
+
+    ufree(buffer);
+    close_fd(in);
+    close_fd(out);
+
+    return ok;
+}
+
+static bool copy_pread_pwrite(const char *input_file, const char *output_file, size_t block_size)
+{
+    int in = open(input_file, O_RDONLY);
+    int out = open_output(output_file, 0);
+    uint8_t *buffer = umalloc(block_size);
+    size_t offset = 0;
+    ssize_t n = -1;
+    bool ok = in >= 0 && out >= 0;
+
+    while (ok && (n = pread(in, buffer, block_size, offset)) > 0)
+    {
+        ok = pwrite(out, buffer, n, offset) == n;
+        offset += n;
+    }
+    ok = ok && n == 0;
+
+    ufree(buffer);
+    close_fd(in);
+    close_fd(out);
+
+    return ok;
+}
+
+static bool copy_mmap(const char *input_file, const char *output_file, size_t block_size)
+{
+    int in = open(input_file, O_RDONLY);
+    int out = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    bool ok = false;
+
+    if (in >= 0 && out >= 0 && fstat(in, &st) == 0 && ftruncate(out, st.st_size) == 0)
+    {
+        uint8_t *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+        uint8_t *dst = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+        if (src != MAP_FAILED && dst != MAP_FAILED)
+        {
+            madvise(src, st.st_size, MADV_SEQUENTIAL);
+            for (size_t offset = 0; offset < (size_t)st.st_size; offset += block_size)
+            {
+                size_t n = st.st_size - offset < block_size ? st.st_size - offset : block_size;
+                memcpy(dst + offset, src + offset, n);
+            }
+            ok = true;
+        }
+        if (src != MAP_FAILED)
+        {
+            munmap(src, st.st_size);
+        }
+        if (dst != MAP_FAILED)
+        {
+            munmap(dst, st.st_size);
+        }
+    }
+    close_fd(in);
+    close_fd(out);
+
+    return ok;
+}
+
+// Page cache is bypassed, so buffers, offsets and sizes are aligned and the
+// padded tail of the output is cut after the copy.
+static bool copy_direct(const char *input_file, const char *output_file, size_t block_size)
+{
+    size_t size = (block_size + IOBENCH_DIRECT_ALIGN - 1) / IOBENCH_DIRECT_ALIGN * IOBENCH_DIRECT_ALIGN;
+    int in = open(input_file, O_RDONLY | O_DIRECT);
+    int out = open_output(output_file, O_DIRECT);
+    void *buffer = NULL;
+    size_t offset = 0;
+    ssize_t n = -1;
+    bool ok = in >= 0 && out >= 0 && posix_memalign(&buffer, IOBENCH_DIRECT_ALIGN, size) == 0;
+
+    while (ok && (n = pread(in, buffer, size, offset)) > 0)
+    {
+        size_t padded = (n + IOBENCH_DIRECT_ALIGN - 1) / IOBENCH_DIRECT_ALIGN * IOBENCH_DIRECT_ALIGN;
+        memset((uint8_t *)buffer + n, 0, padded - n);
+        ok = pwrite(out, buffer, padded, offset) == (ssize_t)padded;
+        offset += n;
+    }
+    ok = ok && n == 0 && ftruncate(out, offset) == 0;
+
+    free(buffer);
+    close_fd(in);
+    close_fd(out);
+
+    return ok;
+}
+
+// Remainder of a short read or write is requested again. User data is slot
+// index times two plus one for writes.
+static void submit_slot(huring_t *ring, int fd, const struct iovec *iov, iobench_slot_t *slots, size_t slot,
+                        bool fixed, bool write)
+{
+    iobench_slot_t *s = &slots[slot];
+    uint8_t *buffer = (uint8_t *)iov[slot].iov_base + s->done;
+    int buf_index = fixed ? (int)slot : -1;
+
+    if (write)
+    {
+        uring_prep_write(ring, fd, buffer, s->size - s->done, s->offset + s->done, buf_index, 2 * slot + 1);
+    }
+    else
+    {
+        uring_prep_read(ring, fd, buffer, s->size - s->done, s->offset + s->done, buf_index, 2 * slot);
+    }
+}
+
+static void start_slot(huring_t *ring, int in, const struct iovec *iov, iobench_slot_t *slots, size_t slot,
+                       bool fixed, size_t offset, size_t size)
+{
+    slots[slot].offset = offset;
+    slots[slot].size = size;
+    slots[slot].done = 0;
+    submit_slot(ring, in, iov, slots, slot, fixed, false);
+}
+
+// Every slot reads a block and then writes it at the same offset, the ring
+// keeps IOBENCH_QUEUE_DEPTH slots busy. Slot buffers are registered once.
+static bool copy_uring(const char *input_file, const char *output_file, size_t block_size)
+{
+    huring_t *ring = uring_create(2 * IOBENCH_QUEUE_DEPTH);
+    if (!ring)
+    {
+        return false;
+    }
+
+    int in = open(input_file, O_RDONLY);
+    int out = open_output(output_file, 0);
+    struct stat st;
+    if (in < 0 || out < 0 || fstat(in, &st) != 0)
+    {
+        close_fd(in);
+        close_fd(out);
+        uring_destroy(ring);
+        return false;
+    }
+
+    size_t input_size = st.st_size;
+    size_t blocks_count = input_size / block_size + (bool)(input_size % block_size);
+    uint8_t *buffers = umalloc(IOBENCH_QUEUE_DEPTH * block_size);
+    iobench_slot_t slots[IOBENCH_QUEUE_DEPTH];
+    struct iovec iov[IOBENCH_QUEUE_DEPTH];
+    for (size_t i = 0; i < IOBENCH_QUEUE_DEPTH; i++)
+    {
+        iov[i].iov_base = buffers + i * block_size;
+        iov[i].iov_len = block_size;
+    }
+    bool fixed = uring_register_buffers(ring, iov, IOBENCH_QUEUE_DEPTH);
+
+    size_t next = 0, in_flight = 0;
+    for (size_t i = 0; i < IOBENCH_QUEUE_DEPTH && next < blocks_count; i++, next++, in_flight++)
+    {
+        size_t offset = next * block_size;
+        size_t size = input_size - offset < block_size ? input_size - offset : block_size;
+        start_slot(ring, in, iov, slots, i, fixed, offset, size);
+    }
+
+    bool ok = true;
+    while (in_flight)
+    {
+        uint64_t user_data;
+        int res = 0;
+        if (uring_submit(ring) < 0 || !uring_wait(ring, &user_data, &res) || res <= 0)
+        {
+            // Input shorter than its size is an I/O error too.
+            errno = res < 0 ? -res : res == 0 ? EIO : errno;
+            ok = false;
+            break;
+        }
+        size_t slot = user_data / 2;
+        bool write = user_data % 2;
+        slots[slot].done += res;
+        if (slots[slot].done < slots[slot].size)
+        {
+            submit_slot(ring, write ? out : in, iov, slots, slot, fixed, write);
+        }
+        else if (!write)
+        {
+            slots[slot].done = 0;
+            submit_slot(ring, out, iov, slots, slot, fixed, true);
+        }
+        else if (next < blocks_count)
+        {
+            size_t offset = next++ * block_size;
+            size_t size = input_size - offset < block_size ? input_size - offset : block_size;
+            start_slot(ring, in, iov, slots, slot, fixed, offset, size);
+        }
+        else
+        {
+            in_flight--;
+        }
+    }
+
+    ufree(buffers);
+    close_fd(in);
+    close_fd(out);
+    uring_destroy(ring);
+
+    return ok;
+}
+
+void io_bench(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    static const struct {
+        const char *name;
+        io_copy_fn copy;
+    } backends[] = {
+        {"ufile", copy_ufile},
+        {"read/write", copy_read_write},
+        {"pread/pwrite", copy_pread_pwrite},
+        {"mmap", copy_mmap},
+        {"O_DIRECT", copy_direct},
+        {"io_uring", copy_uring},
+    };
+    struct stat st;
+
+    if (stat(input_file, &st) != 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s.\n", input_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->verbose)
+    {
+        printf("Dry run mode: copying %s to %s by %zu byte blocks with every I/O backend.\n", input_file,
+               output_file, cfg->block_size);
+    }
+    printf("%-14s %10s %10s %6s\n", "Backend", "Time, s", "MB/s", "Runs");
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        struct stat out_st;
+        size_t runs = 0;
+        double t = 0;
+        bool ok;
+        do
+        {
+            evict_input(input_file);
+            double start = get_time();
+            errno = 0;
+            ok = backends[i].copy(input_file, output_file, cfg->block_size) && sync_output(output_file);
+            t += get_time() - start;
+            runs++;
+        } while (ok && t < IOBENCH_MIN_SECONDS);
+        t /= runs;
+
+        if (!ok)
+        {
+            printf("%-14s unavailable (%s)\n", backends[i].name, strerror(errno));
+        }
+        else if (stat(output_file, &out_st) != 0 || out_st.st_size != st.st_size)
+        {
+            fprintf(stderr, "Error: %s backend produced a copy of wrong size.\n", backends[i].name);
+            exit(EXIT_FAILURE);
+        }
+        else
+        {
+            printf("%-14s %10.3f %10.1f %6zu\n", backends[i].name, t, t > 0 ? st.st_size / t / 1e6 : 0.0, runs);
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef __IOBENCH_H__
+#define __IOBENCH_H__
+
+#include "huffman.h"
+
+// Requests kept in flight by the io_uring backend.
+#define IOBENCH_QUEUE_DEPTH 16
+
+// Alignment of O_DIRECT buffers, offsets and sizes.
+#define IOBENCH_DIRECT_ALIGN 4096
+
+// Every backend copies the input again until that much time is spent.
+#define IOBENCH_MIN_SECONDS 1.0
+
+// Copy input to output by blocks of cfg->block_size, the access pattern of
+// compression, with every I/O backend and report throughput of each one:
+// it is the ceiling the codecs can reach on that storage (--dry-run).
+void io_bench(const char *input_file, const char *output_file, const hcfg_t *cfg);
+
+#endif
@@ -1,171 +1,87 @@
+#include <ctype.h>
+#include <errno.h>
 #include <ugeneric.h>
 #include "huffman.h"
 #include "util.h"
+#include "archive.h"
+#include "batch.h"
+#include "bench.h"
+#include "daemon.h"
+#include "aio.h"
+#include "frame.h"
+#include "iobench.h"
+#include "pool.h"
+#include "profile.h"
+#include "segment.h"
+#include "selftest.h"
+#include "stream.h"
 
-const char SIGNATURE[] = "PKHUF";
 const char *VER = "Huffman archiver, "__DATE__" "__TIME__ ".";
 
-static void compress(const char *input_file, const char *output_file, const hcfg_t *cfg);
-static void extract(const char *input_file, const char *output_file, const hcfg_t *cfg);
-
-static char *serialize_block(const void *block, size_t *output_size)
-{
-    const block_descriptor_t *bds = block;
-    const char *fmt = "{\"original_size\": %zu, \"compressed_size\": %zu, \"original_offset\": %zu}";
-    return ustring_fmt_sized(fmt, output_size, bds->original_size, bds->compressed_size, bds->original_offset);
-}
-
-static huffman_archive_header_t *allocate_header(size_t input_size, hstat_t *stat, const hcfg_t *cfg)
-{
-    huffman_archive_header_t *hdr = ucalloc(1, sizeof(*hdr));
-    hdr->blocks_count = input_size / cfg->block_size + (bool)(input_size % cfg->block_size);
-    memcpy(&hdr->stat, stat, sizeof(*stat));
-    return hdr;
-}
-
-static void compress(const char *input_file, const char *output_file, const hcfg_t *cfg)
-{
-    uvector_t *blocks;
-    size_t input_size;
-    ufile_reader_t *fr;
-    ufile_writer_t *fw;
-
-    // Gather statistics.
-    fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
-    input_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
-    if (input_size == 0)
-    {
-        fprintf(stderr, "Error: input file is empty.\n");
-        exit(EXIT_FAILURE);
-    }
-    hstat_t *stat = build_stat(fr, cfg);
-
-    // Build Huffman tree.
-    hnode_t *root = build_tree(cfg, stat);
-
-    // Build codes.
-    htable_t *table = build_codes(root, cfg);
-
-    if (cfg->dump_table)
-    {
-        dump_table(table, stat);
-    }
-
-    // Allocate archive header.
-    huffman_archive_header_t *hdr = allocate_header(input_size, stat, cfg);
-    size_t full_header_size = sizeof(*hdr) + hdr->blocks_count * sizeof(block_descriptor_t);
-    fw = G_AS_PTR(ufile_writer_create(output_file));
-    ufile_writer_set_position(fw, full_header_size);
-
-    // Encode.
-    ufile_reader_set_position(fr, 0);
-    blocks = encode(fr, fw, table, cfg);
-    UASSERT(uvector_get_size(blocks) == hdr->blocks_count);
-
-    // Write archive header.
-    umemchunk_t m = {.data = hdr, .size = sizeof(*hdr)};
-    ufile_writer_set_position(fw, 0);
-    ufile_writer_write(fw, m);
-    ugeneric_t *a = uvector_get_cells(blocks);
-    for (size_t i = 0; i < hdr->blocks_count; i++)
-    {
-        block_descriptor_t *bds = G_AS_PTR(a[i]);
-        m.data = bds;
-        m.size = sizeof(*bds);
-        ufile_writer_write(fw, m);
-    }
-
-    if (cfg->dump_blocks_map)
-    {
-        uvector_set_void_serializer(blocks, serialize_block);
-        uvector_print(blocks);
-    }
-
-    uvector_destroy(blocks);
-
-    // Cleanup.
-    ufile_reader_destroy(fr);
-    ufile_writer_destroy(fw);
-    ufree(hdr);
-    ufree(stat);
-    ufree(table);
-    destroy_tree(root);
-}
-
-static void extract(const char *input_file, const char *output_file, const hcfg_t *cfg)
-{
-    umemchunk_t m;
-    size_t input_size;
-
-    // Load archive header.
-    ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(input_file, cfg->block_size));
-    input_size  = G_AS_SIZE(ufile_reader_get_file_size(fr));
-    if (input_size == 0)
-    {
-        fprintf(stderr, "Error: input file is empty.\n");
-        exit(EXIT_FAILURE);
-    }
-    m = G_AS_MEMCHUNK(ufile_reader_read(fr, sizeof(huffman_archive_header_t), NULL));
-    huffman_archive_header_t *hdr = m.data;
-
-    size_t full_header_size = sizeof(huffman_archive_header_t) + sizeof(block_descriptor_t) * hdr->blocks_count;
-    hdr = umalloc(full_header_size);
-    ufile_reader_set_position(fr, 0);
-    ufile_reader_read(fr, full_header_size, hdr);
-
-    if (cfg->dump_blocks_map)
-    {
-        printf("Blocks map: [");
-        for (size_t i = 0; i < hdr->blocks_count; i++)
-        {
-            char *str = serialize_block(&hdr->blocks[i], NULL);
-            printf("%s", str);
-            ufree(str);
-            if (i < hdr->blocks_count - 1)
-            {
-                printf(", ");
-            }
-        }
-        printf("]\n");
-    }
-
-    // Build Huffman tree.
-    hnode_t *root = build_tree(cfg, &hdr->stat);
-
-    if (cfg->dump_table)
-    {
-        // Build codes.
-        htable_t *table = build_codes(root, cfg);
-        dump_table(table, &hdr->stat);
-        ufree(table);
-    }
-
-    // Decode.
-    ufile_writer_t *fw = G_AS_PTR(ufile_writer_create(output_file));
-    decode(fr, fw, root, hdr, cfg);
-
-    // Cleanup.
-    ufile_reader_destroy(fr);
-    ufile_writer_destroy(fw);
-    destroy_tree(root);
-    ufree(hdr);
-}
 void usage(const char *app_name)
 {
     fprintf(stderr, "Usage: %s input_file [-c|-x] output_file [OPTION]...\n", app_name);
+    fprintf(stderr, "       %s input_dir|list_file [-c|-x] output_dir --batch [OPTION]...\n", app_name);
+    fprintf(stderr, "       %s input_file --bench [OPTION]...\n", app_name);
+    fprintf(stderr, "       %s archive_file --test [OPTION]...\n", app_name);
+    fprintf(stderr, "       %s --daemon SOCKET [--threads N] [-v]\n", app_name);
+    fprintf(stderr, "       %s tree.log --render-tree FIRST[:LAST]\n", app_name);
+    fprintf(stderr, "       %s --selftest [--block-size SIZE] [--cache-nbits NBITS]\n", app_name);
     puts("  -c                 compress");
     puts("  -x                 extract");
     puts("  -v                 verbose output");
-    puts("  --dump-tree        dump huffman tree creation to dot files");
+    puts("  --dump-tree        log huffman tree creation to tree.log, a line per node");
+    puts("  --render-tree FIRST[:LAST] render frames of a tree.log (forest after FIRST merges) to treeNNN.dot files");
     puts("  --dump-table       dump huffman codes");
-    puts("  --dry-run          copy input to output (i/o test)");
+    puts("  --dry-run          copy input to output with every I/O backend and report their throughput");
     puts("  --block-size SIZE  block size when reading file (compressing only)");
     puts("  --dump-blocks-map  show blocks headers");
-   // puts("  --cache-nbits NBITS cache size in bits (decoder only), [8 ... 24] or 0 to disable");
+    puts("  --batch            process every file of a directory (or listed in a file) into output_dir");
+    puts("  --threads N        number of worker threads in batch and test modes, defaults to number of CPUs");
+    puts("  --test             verify archive checksums without writing anything");
+    puts("  --bench            measure speed of encoder and decoder engines on input_file");
+    puts("  --message-size SIZE benchmark compact frames of SIZE byte messages instead of blocks (with --bench)");
+    puts("  --encoder NAME     encoder engine: auto, scalar, pair, avx2");
+    puts("  --decoder NAME     decoder engine: auto, tree, lut, fsm");
+    puts("  --cache-nbits NBITS lookup table width for lut decoder, [8 ... 24], picked automatically by default");
+    puts("  --max-memory SIZE  memory budget of extraction, K, M and G suffixes are accepted, peak RSS is reported");
+    puts("  --io NAME          block I/O engine of compression and extraction: ufile, uring");
+    puts("  --calibrate        pick decoder by running each one on the first block (extracting only)");
+    puts("  --order1           code every byte with a table picked by the previous byte (compressing only)");
+    puts("  --wide             code 16-bit symbols, for UTF-16 text or 16-bit samples (compressing only)");
+    puts("  --adaptive         pick code table per block, for inputs whose content changes (compressing only)");
+    puts("  --segment          place block boundaries where content changes, implies --adaptive (compressing only)");
+    puts("  --profile          report time and hardware counters of every stage (compressing and extracting)");
+    puts("  --sync-interval SIZE record a sync point every SIZE bytes of a block for parallel and range decoding");
+    puts("  --range OFFSET:SIZE extract only SIZE bytes starting at OFFSET (extracting only)");
+    puts("  --update ARCHIVE   copy blocks of ARCHIVE which didn't change in input_file (compressing only)");
+    puts("  --append           compress only data added to input_file since the archive was updated (compressing only)");
+    puts("  --stream           one-pass adaptive coding, output is flushed as input comes in, - is stdin/stdout");
+    puts("  --flush-size SIZE  largest chunk in --stream mode, defaults to 64 KiB");
+    puts("  --min-block-size SIZE shortest segment in --segment mode, defaults to 32 KiB");
+    puts("  --max-block-size SIZE longest segment in --segment mode, defaults to 1 MiB");
+    puts("  --daemon SOCKET    serve --server clients on a Unix socket by --threads worker processes");
+    puts("  --server SOCKET    run the command by the daemon listening on SOCKET");
+    puts("  --selftest         round trip generated data through every encoder and decoder pair, print their speed");
     puts("  -V                 display software version");
     puts("  -h                 print this message");
 }
 
+// Value of a numeric option, exits unless it is a decimal number in
+// [min, max] range.
+static size_t parse_size_option(const char *option, const char *value, size_t min, size_t max)
+{
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(value, &end, 10);
+    if (!isdigit((unsigned char)value[0]) || *end || errno || n < min || n > max)
+    {
+        fprintf(stderr, "Error: %s must be in [%zu, %zu] range.\n", option, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
 void parse_cli(int argc, char **argv, hcfg_t *cfg)
 {
     if (argc < 2)
@@ -185,9 +101,13 @@ void parse_cli(int argc, char **argv, hcfg_t *cfg)
         exit(EXIT_SUCCESS);
     }
 
-    cfg->input_file = argv[1];
-
-    int idx = 2;
+    // Daemon and self-test have no input of their own.
+    int idx = 1;
+    if (strcmp(argv[1], "--daemon") != 0 && strcmp(argv[1], "--selftest") != 0)
+    {
+        cfg->input_file = argv[1];
+        idx = 2;
+    }
     while (idx < argc)
     {
         if (strcmp(argv[idx], "-c") == 0)
@@ -224,6 +144,25 @@ void parse_cli(int argc, char **argv, hcfg_t *cfg)
         {
             cfg->dump_tree = true;
         }
+        else if (strcmp(argv[idx], "--render-tree") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            int n = sscanf(argv[idx], "%zu:%zu", &cfg->render_first, &cfg->render_last);
+            if (n < 1 || (n == 2 && cfg->render_last < cfg->render_first))
+            {
+                fprintf(stderr, "Error: --render-tree expects FIRST[:LAST].\n");
+                exit(EXIT_FAILURE);
+            }
+            if (n == 1)
+            {
+                cfg->render_last = cfg->render_first;
+            }
+            cfg->render_tree = true;
+        }
         else if (strcmp(argv[idx], "--dump-table") == 0)
         {
             cfg->dump_table = true;
@@ -236,6 +175,205 @@ void parse_cli(int argc, char **argv, hcfg_t *cfg)
         {
             cfg->dump_lookup_table = true;
         }
+        else if (strcmp(argv[idx], "--batch") == 0)
+        {
+            cfg->batch_mode = true;
+        }
+        else if (strcmp(argv[idx], "--threads") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->threads = parse_size_option("--threads", argv[idx], 1, HPOOL_MAX_THREADS);
+        }
+        else if (strcmp(argv[idx], "--test") == 0)
+        {
+            cfg->test_mode = true;
+        }
+        else if (strcmp(argv[idx], "--bench") == 0)
+        {
+            cfg->bench = true;
+        }
+        else if (strcmp(argv[idx], "--encoder") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->encoder = HENCODER_COUNT;
+            for (hencoder_type_t type = HENCODER_AUTO; type < HENCODER_COUNT; type++)
+            {
+                if (strcmp(argv[idx], get_encoder_name(type)) == 0)
+                {
+                    cfg->encoder = type;
+                }
+            }
+            if (cfg->encoder == HENCODER_COUNT)
+            {
+                goto bad_cli;
+            }
+        }
+        else if (strcmp(argv[idx], "--decoder") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->decoder = HDECODER_COUNT;
+            for (hdecoder_type_t type = HDECODER_AUTO; type < HDECODER_COUNT; type++)
+            {
+                if (strcmp(argv[idx], get_decoder_name(type)) == 0)
+                {
+                    cfg->decoder = type;
+                }
+            }
+            if (cfg->decoder == HDECODER_COUNT)
+            {
+                goto bad_cli;
+            }
+        }
+        else if (strcmp(argv[idx], "--max-memory") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            char unit = 0;
+            int n = sscanf(argv[idx], "%zu%c", &cfg->max_memory, &unit);
+            size_t shift = unit == 'K' ? 10 : unit == 'M' ? 20 : unit == 'G' ? 30 : 0;
+            if (n < 1 || !cfg->max_memory || (n == 2 && !shift))
+            {
+                fprintf(stderr, "Error: --max-memory expects SIZE[K|M|G].\n");
+                exit(EXIT_FAILURE);
+            }
+            cfg->max_memory <<= shift;
+        }
+        else if (strcmp(argv[idx], "--io") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->io_engine = HIO_COUNT;
+            for (hio_engine_t engine = HIO_UFILE; engine < HIO_COUNT; engine++)
+            {
+                if (strcmp(argv[idx], get_io_engine_name(engine)) == 0)
+                {
+                    cfg->io_engine = engine;
+                }
+            }
+            if (cfg->io_engine == HIO_COUNT)
+            {
+                goto bad_cli;
+            }
+        }
+        else if (strcmp(argv[idx], "--calibrate") == 0)
+        {
+            cfg->calibrate = true;
+        }
+        else if (strcmp(argv[idx], "--order1") == 0)
+        {
+            cfg->order1 = true;
+        }
+        else if (strcmp(argv[idx], "--wide") == 0)
+        {
+            cfg->wide = true;
+        }
+        else if (strcmp(argv[idx], "--adaptive") == 0)
+        {
+            cfg->adaptive = true;
+        }
+        else if (strcmp(argv[idx], "--segment") == 0)
+        {
+            cfg->segment = true;
+        }
+        else if (strcmp(argv[idx], "--profile") == 0)
+        {
+            cfg->profile = true;
+        }
+        else if (strcmp(argv[idx], "--sync-interval") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            // Archive header keeps it in 32 bits.
+            cfg->sync_interval = parse_size_option("--sync-interval", argv[idx], 1, UINT32_MAX);
+        }
+        else if (strcmp(argv[idx], "--range") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            if (sscanf(argv[idx], "%zu:%zu", &cfg->range_offset, &cfg->range_size) != 2 || !cfg->range_size)
+            {
+                fprintf(stderr, "Error: --range expects OFFSET:SIZE.\n");
+                exit(EXIT_FAILURE);
+            }
+            cfg->range = true;
+        }
+        else if (strcmp(argv[idx], "--update") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->update_file = argv[idx];
+        }
+        else if (strcmp(argv[idx], "--append") == 0)
+        {
+            cfg->append = true;
+        }
+        else if (strcmp(argv[idx], "--message-size") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->message_size = parse_size_option("--message-size", argv[idx], 1, FRAME_MAX_SIZE);
+        }
+        else if (strcmp(argv[idx], "--stream") == 0)
+        {
+            cfg->stream = true;
+        }
+        else if (strcmp(argv[idx], "--flush-size") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->flush_size = parse_size_option("--flush-size", argv[idx], 1, UINT32_MAX / 8);
+        }
+        else if (strcmp(argv[idx], "--min-block-size") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->min_block_size = parse_size_option("--min-block-size", argv[idx], SEGMENT_WINDOW, UINT32_MAX);
+        }
+        else if (strcmp(argv[idx], "--max-block-size") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->max_block_size = parse_size_option("--max-block-size", argv[idx], SEGMENT_WINDOW, UINT32_MAX);
+        }
         else if (strcmp(argv[idx], "--block-size") == 0)
         {
             idx++;
@@ -243,7 +381,34 @@ void parse_cli(int argc, char **argv, hcfg_t *cfg)
             {
                 goto bad_cli;
             }
-            cfg->block_size = atoi(argv[idx]); // TODO: atoi
+            // Block descriptors keep sizes in 32 bits.
+            cfg->block_size = parse_size_option("--block-size", argv[idx], 1, UINT32_MAX);
+        }
+        else if (strcmp(argv[idx], "--daemon") == 0)
+        {
+            idx++;
+            if (idx == argc || cfg->input_file)
+            {
+                goto bad_cli;
+            }
+            cfg->daemon_socket = argv[idx];
+        }
+        else if (strcmp(argv[idx], "--selftest") == 0)
+        {
+            if (cfg->input_file)
+            {
+                goto bad_cli;
+            }
+            cfg->selftest = true;
+        }
+        else if (strcmp(argv[idx], "--server") == 0)
+        {
+            idx++;
+            if (idx == argc)
+            {
+                goto bad_cli;
+            }
+            cfg->server_socket = argv[idx];
         }
         else if (strcmp(argv[idx], "--cache-nbits") == 0)
         {
@@ -252,13 +417,14 @@ void parse_cli(int argc, char **argv, hcfg_t *cfg)
             {
                 goto bad_cli;
             }
-            cfg->cache_nbits = atoi(argv[idx]); // TODO: atoi
-            if (cfg->cache_nbits < 8 || cfg->cache_nbits > 24)
+            int nbits = atoi(argv[idx]); // TODO: atoi
+            if (nbits < MIN_CACHE_NBITS || nbits > MAX_CACHE_NBITS)
             {
-                cfg->cache_nbits = 0;
-                fprintf(stderr, "Error: invalid value %u for --cache-nbits, should be in [8, 24] range, cache is disabled.\n",
-                                 cfg->cache_nbits);
+                fprintf(stderr, "Error: invalid value %d for --cache-nbits, should be in [%d, %d] range, picking it automatically.\n",
+                                 nbits, MIN_CACHE_NBITS, MAX_CACHE_NBITS);
+                nbits = 0;
             }
+            cfg->cache_nbits = nbits;
         }
         else
         {
@@ -267,11 +433,108 @@ void parse_cli(int argc, char **argv, hcfg_t *cfg)
         idx++;
     }
 
-    if (!cfg->input_file || !cfg->output_file)
+    // Counters are reported by compression and extraction only.
+    if (cfg->profile && (cfg->daemon_socket || cfg->selftest || cfg->render_tree || cfg->test_mode || cfg->bench ||
+                         cfg->batch_mode || cfg->stream || cfg->dry_run))
+    {
+        fprintf(stderr, "Error: --profile can be used only for compressing and extracting a single file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->daemon_socket)
+    {
+        if (cfg->server_socket)
+        {
+            goto bad_cli;
+        }
+        return;
+    }
+    if (cfg->selftest)
+    {
+        return;
+    }
+
+    if (!cfg->input_file || (!cfg->output_file && !cfg->bench && !cfg->test_mode && !cfg->render_tree))
     {
         goto bad_cli;
     }
 
+    if (cfg->order1 + cfg->wide + cfg->adaptive > 1)
+    {
+        fprintf(stderr, "Error: only one of --order1, --wide and --adaptive can be used.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->segment)
+    {
+        if (cfg->order1 || cfg->wide)
+        {
+            fprintf(stderr, "Error: --segment can't be used with --order1 and --wide.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (cfg->max_block_size < cfg->min_block_size)
+        {
+            fprintf(stderr, "Error: --min-block-size must not exceed --max-block-size.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Every segment gets its own table if it pays off.
+        cfg->adaptive = true;
+    }
+
+    // Sync points are bit offsets of codes of the static codec.
+    if (cfg->sync_interval && (cfg->order1 || cfg->wide || cfg->adaptive || cfg->segment || cfg->stream ||
+                               cfg->append))
+    {
+        fprintf(stderr, "Error: --sync-interval can't be used with --order1, --wide, --adaptive, --segment, "
+                        "--stream and --append.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->range && (!cfg->extract_mode || cfg->batch_mode))
+    {
+        fprintf(stderr, "Error: --range can be used only for extracting a single archive.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->max_memory && (!cfg->extract_mode || cfg->batch_mode))
+    {
+        fprintf(stderr, "Error: --max-memory can be used only for extracting a single archive.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->update_file && (cfg->append || cfg->segment || cfg->stream || cfg->batch_mode))
+    {
+        fprintf(stderr, "Error: --update can't be used with --append, --segment, --stream and --batch.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->append)
+    {
+        if (cfg->order1 || cfg->wide || cfg->segment || cfg->stream || cfg->batch_mode)
+        {
+            fprintf(stderr, "Error: --append can't be used with --order1, --wide, --segment, --stream and --batch.\n");
+            exit(EXIT_FAILURE);
+        }
+        // New blocks may need tables of their own.
+        cfg->adaptive = true;
+    }
+
+    if (cfg->stream)
+    {
+        if (cfg->order1 || cfg->wide || cfg->adaptive || cfg->segment || cfg->batch_mode)
+        {
+            fprintf(stderr, "Error: --stream can't be used with --order1, --wide, --adaptive, --segment and --batch.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Blocks boundaries must not split symbols.
+    if (cfg->wide && cfg->block_size % 2)
+    {
+        fprintf(stderr, "Error: block size must be even with --wide.\n");
+        exit(EXIT_FAILURE);
+    }
+
     return;
 
 bad_cli:
@@ -286,7 +549,9 @@ ugeneric_t io_error_handler(ugeneric_t io_error, void *ctx)
     exit(UGENERIC_EXIT_IO);
 }
 
-int main(int argc, char **argv)
+// Command line of the process or of a daemon request, cache of warm
+// decoders is passed by daemon workers.
+static int run(int argc, char **argv, hdecoder_cache_t *cache)
 {
     // Init to default values.
     hcfg_t cfg = {
@@ -301,70 +566,120 @@ int main(int argc, char **argv)
         .extract_mode = false,
         .dump_blocks_map = false,
         .cache_nbits = 0,
+        .batch_mode = false,
+        .threads = 0,
+        .bench = false,
+        .encoder = HENCODER_AUTO,
+        .decoder = HDECODER_AUTO,
+        .calibrate = false,
+        .test_mode = false,
+        .order1 = false,
+        .wide = false,
+        .adaptive = false,
+        .segment = false,
+        .min_block_size = DEFAULT_MIN_BLOCK_SIZE,
+        .max_block_size = DEFAULT_MAX_BLOCK_SIZE,
+        .stream = false,
+        .flush_size = DEFAULT_FLUSH_SIZE,
+        .message_size = 0,
+        .append = false,
+        .update_file = NULL,
+        .sync_interval = 0,
+        .range = false,
+        .range_offset = 0,
+        .range_size = 0,
+        .profile = false,
+        .io_engine = HIO_UFILE,
+        .max_memory = 0,
+        .max_table_size = 0,
+        .queue_depth = 0,
+        .daemon_socket = NULL,
+        .server_socket = NULL,
+        .decoder_cache = NULL,
+        .render_tree = false,
+        .render_first = 0,
+        .render_last = 0,
+        .selftest = false,
     //    .cache_nbits = 11,
     };
 
     parse_cli(argc, argv, &cfg);
 
+    if (cfg.daemon_socket)
+    {
+        daemon_run(cfg.daemon_socket, &cfg, run);
+        return EXIT_SUCCESS;
+    }
+    if (cfg.server_socket)
+    {
+        return daemon_request(cfg.server_socket, argc, argv);
+    }
+    cfg.decoder_cache = cache;
+
     libugeneric_set_file_error_handler(io_error_handler, NULL);
 
-    if (strcmp(cfg.input_file, cfg.output_file) == 0)
+    if (cfg.selftest)
     {
-        fprintf(stderr, "Error: reading and writing to the same file.\n");
-        return EXIT_FAILURE;
+        return selftest(&cfg) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    if (cfg.dry_run)
+    if (cfg.render_tree)
     {
-        ugeneric_t g;
-        umemchunk_t buffer;
-        size_t file_size = 0;
-        size_t i = 0;
-        size_t t = 0;
+        render_tree_log(cfg.input_file, cfg.render_first, cfg.render_last);
+        return EXIT_SUCCESS;
+    }
 
-        ufile_reader_t *fr = G_AS_PTR(ufile_reader_create(cfg.input_file, cfg.block_size));
-        ufile_writer_t *fw = G_AS_PTR(ufile_writer_create(cfg.output_file));
+    if (cfg.test_mode)
+    {
+        return test_archive(cfg.input_file, &cfg) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-        // Try to follow the exact I/O pattern as in real encoding/decoding, i.e. read by
-        // big chunks (cfg.block_size) than process them byte by byte and store with big
-        // chunks.
-        buffer.data = umalloc(cfg.block_size);
-        buffer.size = cfg.block_size;
+    if (cfg.bench)
+    {
+        bench(cfg.input_file, &cfg);
+        return EXIT_SUCCESS;
+    }
 
-        if (cfg.verbose)
-        {
-            printf("Dry run mode: copying input file to the ouput file.\n");
-            file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
-            t = (file_size / cfg.block_size) / 58;
-            printf("Copying file: ");
-        }
-        while (ufile_reader_has_next(fr))
-        {
-            g = ufile_reader_read(fr, cfg.block_size, NULL);
-            buffer.size = G_AS_MEMCHUNK_SIZE(g);
-            for (size_t i = 0; i < buffer.size; i++)
-            {
-                ((uint8_t *)buffer.data)[i]  = ((uint8_t *)G_AS_MEMCHUNK_DATA(g))[i];
-            }
-            ufile_writer_write(fw, buffer);
+    if (strcmp(cfg.input_file, cfg.output_file) == 0 && strcmp(cfg.input_file, "-") != 0)
+    {
+        fprintf(stderr, "Error: reading and writing to the same file.\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg.update_file && strcmp(cfg.update_file, cfg.output_file) == 0)
+    {
+        fprintf(stderr, "Error: --update archive can't be overwritten, use another output file.\n");
+        return EXIT_FAILURE;
+    }
 
-            if (cfg.verbose && i++ > t)
-            {
-                i = 0;
-                printf(".");
-                fflush(stdout);
-            }
-        }
-        if (cfg.verbose)
+    if (cfg.batch_mode)
+    {
+        batch(cfg.input_file, cfg.output_file, &cfg);
+        return EXIT_SUCCESS;
+    }
+
+    // Messages can't go to stdout, it may be the output.
+    if (cfg.stream)
+    {
+        if (cfg.extract_mode)
         {
-            puts(" Done.");
+            return stream_extract(cfg.input_file, cfg.output_file, &cfg) ? EXIT_SUCCESS : EXIT_FAILURE;
         }
-        ufree(buffer.data);
-        ufile_reader_destroy(fr);
-        ufile_writer_destroy(fw);
+        stream_compress(cfg.input_file, cfg.output_file, &cfg);
+        return EXIT_SUCCESS;
+    }
+
+    if (cfg.dry_run)
+    {
+        io_bench(cfg.input_file, cfg.output_file, &cfg);
         return EXIT_SUCCESS;
     }
 
+    // Reported and closed below, daemon workers run many requests.
+    if (cfg.profile)
+    {
+        profile_init();
+    }
+
     if (cfg.extract_mode)
     {
         if (cfg.verbose)
@@ -379,8 +694,25 @@ int main(int argc, char **argv)
         {
             printf("Compressing %s to %s.\n", cfg.input_file, cfg.output_file);
         }
-        compress(cfg.input_file, cfg.output_file, &cfg);
+        if (cfg.update_file)
+        {
+            update(cfg.input_file, cfg.output_file, &cfg);
+        }
+        else if (cfg.append)
+        {
+            append(cfg.input_file, cfg.output_file, &cfg);
+        }
+        else
+        {
+            compress(cfg.input_file, cfg.output_file, &cfg);
+        }
     }
+    profile_report();
 
     return EXIT_SUCCESS;
 }
+
+int main(int argc, char **argv)
+{
+    return run(argc, argv, NULL);
+}
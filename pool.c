@@ -0,0 +1,269 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <ugeneric.h>
+
+#include "pool.h"
+
+typedef struct {
+    hpool_task_fn fn;
+    void *arg;
+} hpool_task_t;
+
+// Ring buffer of tasks, owner works on the tail, thieves on the head.
+typedef struct {
+    pthread_mutex_t lock;
+    hpool_task_t *tasks;
+    size_t capacity;
+    size_t head;
+    size_t size;
+} hpool_deque_t;
+
+typedef struct {
+    hpool_t *pool;
+    size_t index;
+} hpool_worker_t;
+
+struct _pool {
+    pthread_t *threads;
+    hpool_worker_t *workers;
+    hpool_deque_t *deques;
+    size_t nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t idle;
+    size_t queued;  // tasks sitting in deques
+    size_t pending; // tasks submitted but not finished yet
+    size_t next;    // round-robin deque for tasks submitted from outside
+    size_t steals;
+    bool stop;
+};
+
+// Worker the current thread belongs to, NULL for non-pool threads.
+static _Thread_local hpool_worker_t *current_worker;
+
+static void deque_push(hpool_deque_t *d, hpool_task_t task)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->size == d->capacity)
+    {
+        size_t capacity = d->capacity ? d->capacity * 2 : 64;
+        hpool_task_t *tasks = umalloc(capacity * sizeof(*tasks));
+        for (size_t i = 0; i < d->size; i++)
+        {
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        }
+        ufree(d->tasks);
+        d->tasks = tasks;
+        d->capacity = capacity;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->size) % d->capacity] = task;
+    d->size++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static bool deque_pop_tail(hpool_deque_t *d, hpool_task_t *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size)
+    {
+        d->size--;
+        *task = d->tasks[(d->head + d->size) % d->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+static bool deque_pop_head(hpool_deque_t *d, hpool_task_t *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size)
+    {
+        *task = d->tasks[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        d->size--;
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+static bool take_task(hpool_worker_t *w, hpool_task_t *task)
+{
+    hpool_t *pool = w->pool;
+    bool stolen = false;
+    bool found = deque_pop_tail(&pool->deques[w->index], task);
+
+    for (size_t i = 1; !found && i < pool->nthreads; i++)
+    {
+        found = deque_pop_head(&pool->deques[(w->index + i) % pool->nthreads], task);
+        stolen = found;
+    }
+
+    if (found)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pool->steals += stolen;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return found;
+}
+
+static void *worker_main(void *arg)
+{
+    hpool_worker_t *w = arg;
+    hpool_t *pool = w->pool;
+    hpool_task_t task;
+
+    current_worker = w;
+    while (true)
+    {
+        if (take_task(w, &task))
+        {
+            task.fn(task.arg);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0)
+            {
+                pthread_cond_broadcast(&pool->idle);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queued && !pool->stop)
+        {
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        }
+        if (pool->stop && !pool->queued)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+hpool_t *hpool_create(size_t nthreads)
+{
+    UASSERT_INPUT(nthreads);
+
+    hpool_t *pool = uzalloc(sizeof(*pool));
+    pool->nthreads = nthreads;
+    pool->threads = ucalloc(nthreads, sizeof(pthread_t));
+    pool->workers = ucalloc(nthreads, sizeof(hpool_worker_t));
+    pool->deques = ucalloc(nthreads, sizeof(hpool_deque_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        int err = pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]);
+        UASSERT(err == 0);
+    }
+
+    return pool;
+}
+
+void hpool_submit(hpool_t *pool, hpool_task_fn fn, void *arg)
+{
+    UASSERT_INPUT(pool);
+    UASSERT_INPUT(fn);
+
+    hpool_task_t task = {.fn = fn, .arg = arg};
+    size_t index;
+
+    // Task is counted in the same critical section it is pushed, otherwise
+    // a worker could take it and decrement queued first.
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    if (current_worker && current_worker->pool == pool)
+    {
+        index = current_worker->index;
+    }
+    else
+    {
+        index = pool->next++ % pool->nthreads;
+    }
+    deque_push(&pool->deques[index], task);
+    pool->queued++;
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait until all the submitted tasks (and the tasks they have spawned) are
+// finished, must not be called from a pool thread.
+void hpool_wait(hpool_t *pool)
+{
+    UASSERT_INPUT(pool);
+    UASSERT(current_worker == NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+    {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t hpool_get_steals(hpool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    size_t steals = pool->steals;
+    pthread_mutex_unlock(&pool->lock);
+
+    return steals;
+}
+
+void hpool_destroy(hpool_t *pool)
+{
+    if (pool)
+    {
+        hpool_wait(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->wakeup);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (size_t i = 0; i < pool->nthreads; i++)
+        {
+            pthread_join(pool->threads[i], NULL);
+            pthread_mutex_destroy(&pool->deques[i].lock);
+            ufree(pool->deques[i].tasks);
+        }
+
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->wakeup);
+        pthread_cond_destroy(&pool->idle);
+        ufree(pool->deques);
+        ufree(pool->workers);
+        ufree(pool->threads);
+        ufree(pool);
+    }
+}
+
+size_t get_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
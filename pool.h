@@ -0,0 +1,26 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Largest number of workers taken from the command line.
+#define HPOOL_MAX_THREADS 1024
+
+typedef void (*hpool_task_fn)(void *arg);
+
+typedef struct _pool hpool_t;
+
+// Work-stealing thread pool, every worker owns a deque of tasks, it takes
+// tasks from the tail of its own deque and steals from the head of the
+// others once its own deque is empty. Tasks may submit further tasks,
+// those go to the deque of the submitting worker.
+hpool_t *hpool_create(size_t nthreads);
+void hpool_submit(hpool_t *pool, hpool_task_fn fn, void *arg);
+void hpool_wait(hpool_t *pool);
+void hpool_destroy(hpool_t *pool);
+size_t hpool_get_steals(hpool_t *pool);
+
+size_t get_cpu_count(void);
+
+#endif
@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "profile.h"
+#include "util.h"
+
+#define PROFILE_COUNTERS 5
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counter_desc_t;
+
+static const counter_desc_t counters[PROFILE_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const char *stage_names[HSTAGE_COUNT] = {
+    [HSTAGE_STAT] = "stat",
+    [HSTAGE_TREE] = "tree",
+    [HSTAGE_DECODER] = "decoder",
+    [HSTAGE_ENCODE] = "encode",
+    [HSTAGE_DECODE] = "decode",
+    [HSTAGE_IO] = "i/o",
+};
+
+typedef struct {
+    size_t calls;
+    size_t bytes;
+    double time;
+    uint64_t counts[PROFILE_COUNTERS];
+    double start_time;
+    uint64_t start_counts[PROFILE_COUNTERS];
+} stage_t;
+
+static struct {
+    bool enabled;
+    int fds[PROFILE_COUNTERS]; // -1 for unavailable counters
+    int error;                 // errno of the first failed counter
+    stage_t stages[HSTAGE_COUNT];
+} profile;
+
+static uint64_t read_counter(int fd)
+{
+    uint64_t value = 0;
+
+    if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value))
+    {
+        value = 0;
+    }
+
+    return value;
+}
+
+void profile_init(void)
+{
+    memset(&profile, 0, sizeof(profile));
+    profile.enabled = true;
+
+    for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+    {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = counters[i].type,
+            .config = counters[i].config,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        profile.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (profile.fds[i] < 0 && !profile.error)
+        {
+            profile.error = errno;
+        }
+    }
+}
+
+void profile_start(hstage_t stage)
+{
+    if (!profile.enabled)
+    {
+        return;
+    }
+
+    stage_t *s = &profile.stages[stage];
+    for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+    {
+        s->start_counts[i] = read_counter(profile.fds[i]);
+    }
+    s->start_time = get_time();
+}
+
+void profile_stop(hstage_t stage, size_t bytes)
+{
+    if (!profile.enabled)
+    {
+        return;
+    }
+
+    stage_t *s = &profile.stages[stage];
+    s->time += get_time() - s->start_time;
+    for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+    {
+        s->counts[i] += read_counter(profile.fds[i]) - s->start_counts[i];
+    }
+    s->bytes += bytes;
+    s->calls++;
+}
+
+void profile_report(void)
+{
+    size_t available = 0;
+
+    if (!profile.enabled)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+    {
+        available += profile.fds[i] >= 0;
+    }
+    if (!available)
+    {
+        printf("Hardware counters are not available (%s), timings only.\n", strerror(profile.error));
+    }
+    else if (available < PROFILE_COUNTERS)
+    {
+        printf("Some hardware counters are not available (%s).\n", strerror(profile.error));
+    }
+
+    // Counters are reported per byte processed by the stage.
+    printf("%-8s %8s %10s %10s", "Stage", "Calls", "Time, ms", "MB/s");
+    for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+    {
+        if (profile.fds[i] >= 0)
+        {
+            printf(" %9s/B", counters[i].name);
+        }
+    }
+    if (profile.fds[0] >= 0 && profile.fds[1] >= 0)
+    {
+        printf(" %6s", "IPC");
+    }
+    printf("\n");
+
+    for (size_t stage = 0; stage < HSTAGE_COUNT; stage++)
+    {
+        const stage_t *s = &profile.stages[stage];
+        if (!s->calls)
+        {
+            continue;
+        }
+        printf("%-8s %8zu %10.3f ", stage_names[stage], s->calls, s->time * 1e3);
+        if (s->bytes && s->time > 0)
+        {
+            printf("%10.1f", s->bytes / s->time / 1e6);
+        }
+        else
+        {
+            printf("%10s", "-");
+        }
+        for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+        {
+            if (profile.fds[i] < 0)
+            {
+                continue;
+            }
+            if (s->bytes)
+            {
+                printf(" %11.4f", (double)s->counts[i] / s->bytes);
+            }
+            else
+            {
+                printf(" %11s", "-");
+            }
+        }
+        if (profile.fds[0] >= 0 && profile.fds[1] >= 0)
+        {
+            printf(" %6.2f", s->counts[0] ? (double)s->counts[1] / s->counts[0] : 0.0);
+        }
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < PROFILE_COUNTERS; i++)
+    {
+        if (profile.fds[i] >= 0)
+        {
+            close(profile.fds[i]);
+        }
+    }
+    profile.enabled = false;
+}
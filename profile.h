@@ -0,0 +1,28 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stddef.h>
+
+// Stages of compression and extraction measured in --profile mode.
+typedef enum {
+    HSTAGE_STAT = 0, // gathering statistics, includes reading the input
+    HSTAGE_TREE,     // building trees and code tables
+    HSTAGE_DECODER,  // building lookup tables (LUT, FSM) of the decoder
+    HSTAGE_ENCODE,
+    HSTAGE_DECODE,
+    HSTAGE_IO,       // reading and writing blocks
+    HSTAGE_COUNT,
+} hstage_t;
+
+// Every stage is timed and, where perf_event_open() is permitted, measured
+// by hardware counters: cycles, instructions, L1 data and last level cache
+// misses and branch misses. Counters are opened for the calling thread, so
+// only stages run by the main thread are measured, worker threads of batch
+// and test modes are not. Counters the CPU (or VM) lacks are left out of
+// the report, when none is available only timings are reported.
+void profile_init(void);
+void profile_start(hstage_t stage);
+void profile_stop(hstage_t stage, size_t bytes);
+void profile_report(void);
+
+#endif
@@ -0,0 +1,158 @@
+#include <math.h>
+#include <ugeneric.h>
+#include "segment.h"
+
+typedef struct {
+    hstat_t *stats;   // per segment
+    size_t *offsets;  // segment starts and input size
+    size_t count;
+    size_t capacity;
+} segments_t;
+
+static void add_segment(segments_t *s, const hstat_t *stat, size_t end)
+{
+    if (s->count == s->capacity)
+    {
+        s->capacity *= 2;
+        s->stats = urealloc(s->stats, s->capacity * sizeof(hstat_t));
+        s->offsets = urealloc(s->offsets, (s->capacity + 1) * sizeof(size_t));
+    }
+    s->stats[s->count] = *stat;
+    s->offsets[++s->count] = end;
+}
+
+static void subtract_stat(hstat_t *dst, const hstat_t *src)
+{
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        dst->frequencies[i] -= src->frequencies[i];
+    }
+}
+
+// Extra bits needed to code data with stat r using the distribution of
+// stat s instead of its own one (Kullback-Leibler divergence times size).
+// Symbols unseen in s are given half an occurrence.
+static double get_divergence_bits(const hstat_t *r, size_t r_size, const hstat_t *s, size_t s_size)
+{
+    double bits = 0;
+
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        if (r->frequencies[i])
+        {
+            double p = (double)r->frequencies[i] / r_size;
+            double q = (s->frequencies[i] + 0.5) / (s_size + HCODES_TABLE_SIZE / 2);
+            bits += r->frequencies[i] * log2(p / q);
+        }
+    }
+
+    return bits;
+}
+
+// Split input into segments of [min_block_size, max_block_size] bytes
+// (the last one may be shorter), returns histogram of every segment.
+// Offsets get blocks_count + 1 items, the last one is the input size.
+hstat_t *build_segment_stat(ufile_reader_t *fr, size_t **offsets, size_t *blocks_count, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(fr);
+    UASSERT_INPUT(offsets);
+    UASSERT_INPUT(blocks_count);
+    UASSERT_INPUT(cfg);
+
+    segments_t segments = {0};
+    hstat_t ring[SEGMENT_HISTORY];
+    size_t ring_sizes[SEGMENT_HISTORY];
+    size_t ring_head = 0, ring_count = 0;
+    hstat_t segment = {0}, recent = {0}; // segment stat doesn't include recent windows
+    size_t segment_size = 0, recent_size = 0;
+    size_t position = 0;
+    umemchunk_t m;
+
+    size_t i = 0;
+    size_t t = 0;
+    size_t file_size = 0;
+
+    if (cfg->verbose)
+    {
+        file_size = G_AS_SIZE(ufile_reader_get_file_size(fr));
+        t = (file_size / SEGMENT_WINDOW) / 58;
+        printf("Building segments: ");
+    }
+
+    segments.capacity = 64;
+    segments.stats = umalloc(segments.capacity * sizeof(hstat_t));
+    segments.offsets = umalloc((segments.capacity + 1) * sizeof(size_t));
+    segments.offsets[0] = 0;
+
+    while (ufile_reader_has_next(fr))
+    {
+        m = G_AS_MEMCHUNK(ufile_reader_read(fr, SEGMENT_WINDOW, NULL));
+
+        if (segment_size + recent_size + m.size > cfg->max_block_size)
+        {
+            merge_stat(&segment, &recent);
+            add_segment(&segments, &segment, position);
+            memset(&segment, 0, sizeof(segment));
+            memset(&recent, 0, sizeof(recent));
+            segment_size = recent_size = 0;
+            ring_count = 0;
+        }
+
+        // Oldest window leaves the recent ones for the segment.
+        if (ring_count == SEGMENT_HISTORY)
+        {
+            merge_stat(&segment, &ring[ring_head]);
+            subtract_stat(&recent, &ring[ring_head]);
+            segment_size += ring_sizes[ring_head];
+            recent_size -= ring_sizes[ring_head];
+            ring_head = (ring_head + 1) % SEGMENT_HISTORY;
+            ring_count--;
+        }
+
+        hstat_t *window = &ring[(ring_head + ring_count) % SEGMENT_HISTORY];
+        memset(window, 0, sizeof(*window));
+        for (size_t j = 0; j < m.size; j++)
+        {
+            window->frequencies[((uint8_t *)m.data)[j]]++;
+        }
+        ring_sizes[(ring_head + ring_count) % SEGMENT_HISTORY] = m.size;
+        ring_count++;
+        merge_stat(&recent, window);
+        recent_size += m.size;
+        position += m.size;
+
+        // Recent windows start a new segment.
+        if (ring_count == SEGMENT_HISTORY && segment_size >= cfg->min_block_size &&
+            get_divergence_bits(&recent, recent_size, &segment, segment_size) > SEGMENT_SPLIT_BITS)
+        {
+            add_segment(&segments, &segment, position - recent_size);
+            memset(&segment, 0, sizeof(segment));
+            segment_size = 0;
+        }
+
+        if (cfg->verbose && i++ > t)
+        {
+            i = 0;
+            printf(".");
+            fflush(stdout);
+        }
+    }
+
+    if (segment_size + recent_size)
+    {
+        merge_stat(&segment, &recent);
+        add_segment(&segments, &segment, position);
+    }
+
+    if (cfg->verbose)
+    {
+        puts(" Done.");
+        printf("Input split into %zu segments, %zu bytes on average.\n", segments.count,
+               segments.count ? position / segments.count : 0);
+    }
+
+    *offsets = segments.offsets;
+    *blocks_count = segments.count;
+
+    return segments.stats;
+}
@@ -0,0 +1,20 @@
+#ifndef __SEGMENT_H__
+#define __SEGMENT_H__
+
+#include "huffman.h"
+
+// Content-aware segmentation: input is scanned in windows, histogram of
+// the last SEGMENT_HISTORY windows is compared with the one of the current
+// segment and a new segment starts where coding the recent windows with the
+// segment distribution would waste more than SEGMENT_SPLIT_BITS. Segments
+// become blocks of the adaptive codec, see adaptive.h.
+#define SEGMENT_WINDOW 4096
+#define SEGMENT_HISTORY 4
+#define SEGMENT_SPLIT_BITS 16384
+
+#define DEFAULT_MIN_BLOCK_SIZE (32 * 1024)
+#define DEFAULT_MAX_BLOCK_SIZE (1024 * 1024)
+
+hstat_t *build_segment_stat(ufile_reader_t *fr, size_t **offsets, size_t *blocks_count, const hcfg_t *cfg);
+
+#endif
@@ -0,0 +1,477 @@
+#include <ugeneric.h>
+#include "selftest.h"
+#include "util.h"
+
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    size_t size;
+} selftest_corpus_t;
+
+// Engines keep a pointer to their config, so it lives next to them.
+typedef struct {
+    char name[16];
+    hcfg_t cfg;
+    hencoder_t *encoder;
+    hdecoder_t *decoder;
+    bool timed; // column of the throughput matrix
+} selftest_engine_t;
+
+typedef struct {
+    size_t passed;
+    size_t failed;
+} selftest_result_t;
+
+#define MAX_DECODERS (HDECODER_COUNT + MAX_CACHE_NBITS - MIN_CACHE_NBITS + 1)
+
+// Whole corpus is a single block.
+#define WHOLE_CORPUS SIZE_MAX
+
+static const size_t block_sizes[] = {
+    0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 255, 256, 257,
+    4095, 4096, 4097, 65535, 65536, 65537, WHOLE_CORPUS,
+};
+
+// xorshift64*, corpora are the same on every run.
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// 64 symbols with frequencies 1 / rank, close to the letters of a text.
+static selftest_corpus_t generate_text(uint64_t *state)
+{
+    selftest_corpus_t corpus = {.name = "text", .size = 8 * 1024 * 1024};
+    double cumulative[64];
+    double total = 0;
+
+    for (size_t i = 0; i < 64; i++)
+    {
+        total += 1.0 / (i + 1);
+        cumulative[i] = total;
+    }
+    corpus.data = umalloc(corpus.size);
+    for (size_t i = 0; i < corpus.size; i++)
+    {
+        double r = (next_random(state) >> 11) * 0x1p-53 * total;
+        size_t s = 0;
+        while (s < 63 && cumulative[s] <= r)
+        {
+            s++;
+        }
+        corpus.data[i] = ' ' + s;
+    }
+
+    return corpus;
+}
+
+// Frequencies are Fibonacci numbers like in anomaly.py, the tree is a
+// 31 levels deep vine.
+static selftest_corpus_t generate_fibonacci(uint64_t *state)
+{
+    selftest_corpus_t corpus = {.name = "fibonacci"};
+    size_t f[32] = {1, 1};
+
+    for (size_t i = 2; i < 32; i++)
+    {
+        f[i] = f[i - 1] + f[i - 2];
+    }
+    for (size_t i = 0; i < 32; i++)
+    {
+        corpus.size += f[i];
+    }
+    corpus.data = umalloc(corpus.size);
+    for (size_t i = 0, n = 0; i < 32; i++)
+    {
+        memset(corpus.data + n, 'A' + i, f[i]);
+        n += f[i];
+    }
+    for (size_t i = corpus.size - 1; i > 0; i--)
+    {
+        size_t j = next_random(state) % (i + 1);
+        uint8_t t = corpus.data[i];
+        corpus.data[i] = corpus.data[j];
+        corpus.data[j] = t;
+    }
+
+    return corpus;
+}
+
+static selftest_corpus_t generate_random(uint64_t *state)
+{
+    selftest_corpus_t corpus = {.name = "random", .size = 4 * 1024 * 1024};
+
+    corpus.data = umalloc(corpus.size);
+    for (size_t i = 0; i < corpus.size; i++)
+    {
+        corpus.data[i] = next_random(state) >> 56;
+    }
+
+    return corpus;
+}
+
+// Code of the only symbol is 0 bits long.
+static selftest_corpus_t generate_single(uint64_t *state)
+{
+    selftest_corpus_t corpus = {.name = "single", .size = 1024 * 1024};
+
+    corpus.data = umalloc(corpus.size);
+    memset(corpus.data, 'x', corpus.size);
+
+    return corpus;
+}
+
+// Two symbols, one of them rare, every code is 1 bit long.
+static selftest_corpus_t generate_binary(uint64_t *state)
+{
+    selftest_corpus_t corpus = {.name = "binary", .size = 1024 * 1024};
+
+    corpus.data = umalloc(corpus.size);
+    for (size_t i = 0; i < corpus.size; i++)
+    {
+        corpus.data[i] = (next_random(state) % 256) ? 0 : 0xff;
+    }
+
+    return corpus;
+}
+
+static selftest_corpus_t (*const generators[])(uint64_t *state) = {
+    generate_text, generate_fibonacci, generate_random, generate_single, generate_binary,
+};
+
+static size_t build_encoders(const htable_t *table, const hcfg_t *cfg, selftest_engine_t *engines)
+{
+    size_t n = 0;
+
+    for (hencoder_type_t type = HENCODER_SCALAR; type < HENCODER_COUNT; type++)
+    {
+        if (encoder_is_supported(type, table))
+        {
+            selftest_engine_t *e = &engines[n++];
+            e->cfg = *cfg;
+            e->cfg.encoder = type;
+            e->encoder = build_encoder(table, &e->cfg);
+            e->timed = true;
+            snprintf(e->name, sizeof(e->name), "%s", get_encoder_name(type));
+        }
+    }
+
+    return n;
+}
+
+static bool add_decoder(const hnode_t *root, const hcfg_t *cfg, bool timed, selftest_engine_t *engines, size_t *n)
+{
+    selftest_engine_t *e = &engines[*n];
+    char name[sizeof(e->name)];
+
+    if (!decoder_is_supported(cfg->decoder, root, cfg))
+    {
+        return false;
+    }
+
+    e->cfg = *cfg;
+    e->decoder = build_decoder(root, &e->cfg);
+    e->timed = timed;
+    if (e->decoder->lut)
+    {
+        snprintf(name, sizeof(name), "%s/%u", get_decoder_name(e->decoder->type), e->decoder->lut->nbits);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "%s", get_decoder_name(e->decoder->type));
+    }
+
+    // Width sweep repeats the default table and narrowed ones.
+    for (size_t i = 0; i < *n; i++)
+    {
+        if (strcmp(engines[i].name, name) == 0)
+        {
+            destroy_decoder(e->decoder);
+            e->decoder = NULL;
+            return false;
+        }
+    }
+    memcpy(e->name, name, sizeof(name));
+    (*n)++;
+
+    return true;
+}
+
+// Decoders of the matrix with their default tables, then lookup tables of
+// every width.
+static size_t build_decoders(const hnode_t *root, const hcfg_t *cfg, selftest_engine_t *engines)
+{
+    hcfg_t dcfg = *cfg;
+    size_t n = 0;
+
+    for (hdecoder_type_t type = HDECODER_TREE; type < HDECODER_COUNT; type++)
+    {
+        dcfg.decoder = type;
+        add_decoder(root, &dcfg, true, engines, &n);
+    }
+
+    dcfg.decoder = HDECODER_LUT;
+    dcfg.max_table_size = SELFTEST_MAX_TABLE_SIZE;
+    for (uint8_t nbits = MIN_CACHE_NBITS; nbits <= MAX_CACHE_NBITS; nbits++)
+    {
+        dcfg.cache_nbits = nbits;
+        add_decoder(root, &dcfg, false, engines, &n);
+    }
+
+    return n;
+}
+
+static umemchunk_t get_block(const selftest_corpus_t *corpus, size_t size, size_t block_size, size_t i)
+{
+    umemchunk_t m = {
+        .data = corpus->data + i * block_size,
+        .size = (size - i * block_size < block_size) ? size - i * block_size : block_size,
+    };
+    return m;
+}
+
+// First blocks of the edge size are encoded by every encoder and decoded by
+// every decoder, zero size stands for an empty block.
+static void check_block_size(const selftest_corpus_t *corpus, size_t block_size,
+                             const selftest_engine_t *encoders, size_t encoders_count,
+                             const selftest_engine_t *decoders, size_t decoders_count,
+                             selftest_result_t *result)
+{
+    ubuffer_t reference = {0};
+    ubuffer_t encoded = {0};
+    ubuffer_t decoded = {0};
+    size_t size, blocks_count;
+
+    if (block_size == WHOLE_CORPUS)
+    {
+        block_size = corpus->size;
+    }
+    size = block_size * SELFTEST_CHECK_BLOCKS < corpus->size ? block_size * SELFTEST_CHECK_BLOCKS : corpus->size;
+    blocks_count = block_size ? (size + block_size - 1) / block_size : 1;
+
+    for (size_t e = 0; e < encoders_count; e++)
+    {
+        bool failed[MAX_DECODERS] = {0};
+
+        for (size_t i = 0; i < blocks_count; i++)
+        {
+            umemchunk_t block = {.data = corpus->data, .size = 0};
+            if (block_size)
+            {
+                block = get_block(corpus, size, block_size, i);
+            }
+            umemchunk_t m = encode_block(encoders[e].encoder, block, &encoded);
+
+            if (e > 0)
+            {
+                umemchunk_t r = encode_block(encoders[0].encoder, block, &reference);
+                if (m.size != r.size || memcmp(m.data, r.data, m.size) != 0)
+                {
+                    printf("FAIL: %s corpus, %s encoder output differs from %s one, block size %zu, block %zu\n",
+                           corpus->name, encoders[e].name, encoders[0].name, block_size, i);
+                    result->failed++;
+                }
+            }
+
+            for (size_t d = 0; d < decoders_count; d++)
+            {
+                umemchunk_t out = decode_block(decoders[d].decoder, m, &decoded, block.size);
+                if (!failed[d] && (out.size != block.size || memcmp(out.data, block.data, block.size) != 0))
+                {
+                    printf("FAIL: %s corpus, %s encoder, %s decoder, block size %zu, block %zu\n",
+                           corpus->name, encoders[e].name, decoders[d].name, block_size, i);
+                    failed[d] = true;
+                }
+            }
+        }
+
+        for (size_t d = 0; d < decoders_count; d++)
+        {
+            if (failed[d])
+            {
+                result->failed++;
+            }
+            else
+            {
+                result->passed++;
+            }
+        }
+    }
+
+    ubuffer_destroy(&reference);
+    ubuffer_destroy(&encoded);
+    ubuffer_destroy(&decoded);
+}
+
+// Rows are encoders with their speed, cells are speeds of the decoders on
+// their output, blocks are of --block-size.
+static void print_matrix(const selftest_corpus_t *corpus, size_t block_size,
+                         const selftest_engine_t *encoders, size_t encoders_count,
+                         const selftest_engine_t *decoders, size_t decoders_count,
+                         selftest_result_t *result)
+{
+    size_t blocks_count = (corpus->size + block_size - 1) / block_size;
+    size_t *offsets = umalloc((blocks_count + 1) * sizeof(size_t));
+    ubuffer_t buffer = {0};
+    ubuffer_t encoded = {0};
+    ubuffer_t decoded = {0};
+
+    printf("%-12s %10s", "MB/s", "encoder");
+    for (size_t d = 0; d < decoders_count; d++)
+    {
+        if (decoders[d].timed)
+        {
+            printf(" %10s", decoders[d].name);
+        }
+    }
+    printf("\n");
+
+    for (size_t e = 0; e < encoders_count; e++)
+    {
+        size_t runs = 0;
+        double t = get_time();
+
+        // Blocks of the last run are kept for decoding.
+        do
+        {
+            ubuffer_reset(&encoded);
+            offsets[0] = 0;
+            for (size_t i = 0; i < blocks_count; i++)
+            {
+                umemchunk_t m = encode_block(encoders[e].encoder, get_block(corpus, corpus->size, block_size, i),
+                                             &buffer);
+                ubuffer_append_data(&encoded, m.data, m.size);
+                offsets[i + 1] = encoded.data_size;
+            }
+            runs++;
+        } while (get_time() - t < SELFTEST_MIN_SECONDS);
+        t = get_time() - t;
+        printf("%-12s %10.1f", encoders[e].name, corpus->size * runs / t / 1e6);
+
+        for (size_t d = 0; d < decoders_count; d++)
+        {
+            bool same = true;
+
+            if (!decoders[d].timed)
+            {
+                continue;
+            }
+            runs = 0;
+            t = get_time();
+            do
+            {
+                for (size_t i = 0; i < blocks_count; i++)
+                {
+                    umemchunk_t block = get_block(corpus, corpus->size, block_size, i);
+                    umemchunk_t in = {
+                        .data = (uint8_t *)encoded.data + offsets[i],
+                        .size = offsets[i + 1] - offsets[i],
+                    };
+                    umemchunk_t m = decode_block(decoders[d].decoder, in, &decoded, block.size);
+                    if (runs == 0)
+                    {
+                        same = same && (m.size == block.size) && (memcmp(m.data, block.data, m.size) == 0);
+                    }
+                }
+                runs++;
+            } while (get_time() - t < SELFTEST_MIN_SECONDS);
+            t = get_time() - t;
+
+            if (same)
+            {
+                printf(" %10.1f", corpus->size * runs / t / 1e6);
+                result->passed++;
+            }
+            else
+            {
+                printf(" %10s", "FAIL");
+                result->failed++;
+            }
+        }
+        printf("\n");
+    }
+
+    ufree(offsets);
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&encoded);
+    ubuffer_destroy(&decoded);
+}
+
+bool selftest(const hcfg_t *cfg)
+{
+    UASSERT_INPUT(cfg);
+
+    selftest_result_t total = {0};
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    hcfg_t qcfg = *cfg;
+    qcfg.verbose = false;
+    qcfg.dump_tree = false;
+    qcfg.dump_table = false;
+    qcfg.dump_lookup_table = false;
+
+    for (size_t c = 0; c < sizeof(generators) / sizeof(generators[0]); c++)
+    {
+        selftest_engine_t encoders[HENCODER_COUNT] = {0};
+        selftest_engine_t decoders[MAX_DECODERS] = {0};
+        selftest_result_t result = {0};
+        selftest_corpus_t corpus = generators[c](&state);
+        hstat_t stat = {0};
+
+        for (size_t i = 0; i < corpus.size; i++)
+        {
+            stat.frequencies[corpus.data[i]]++;
+        }
+        hnode_t *root = build_tree(&qcfg, &stat);
+        htable_t *table = build_codes(root, &qcfg);
+        size_t encoders_count = build_encoders(table, &qcfg, encoders);
+        size_t decoders_count = build_decoders(root, &qcfg, decoders);
+
+        printf("Corpus %s: %zu bytes, %u symbols, max code length %u.\n", corpus.name, corpus.size,
+               table->symbols_count, table->max_code_len);
+        printf("Engines:");
+        for (size_t e = 0; e < encoders_count; e++)
+        {
+            printf(" %s", encoders[e].name);
+        }
+        printf(" |");
+        for (size_t d = 0; d < decoders_count; d++)
+        {
+            printf(" %s", decoders[d].name);
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++)
+        {
+            check_block_size(&corpus, block_sizes[i], encoders, encoders_count, decoders, decoders_count,
+                             &result);
+        }
+        print_matrix(&corpus, cfg->block_size, encoders, encoders_count, decoders, decoders_count, &result);
+        printf("Round trips: %zu passed, %zu failed.\n\n", result.passed, result.failed);
+
+        total.passed += result.passed;
+        total.failed += result.failed;
+        for (size_t e = 0; e < encoders_count; e++)
+        {
+            destroy_encoder(encoders[e].encoder);
+        }
+        for (size_t d = 0; d < decoders_count; d++)
+        {
+            destroy_decoder(decoders[d].decoder);
+        }
+        ufree(table);
+        destroy_tree(root);
+        ufree(corpus.data);
+    }
+
+    if (total.failed)
+    {
+        printf("Self-test failed: %zu of %zu round trips.\n", total.failed, total.passed + total.failed);
+        return false;
+    }
+    printf("Self-test passed: %zu round trips.\n", total.passed);
+
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef __SELFTEST_H__
+#define __SELFTEST_H__
+
+#include "huffman.h"
+
+// Differential test of the engines (--selftest): every encoder and decoder
+// pair round trips corpora generated in memory, the pathological ones
+// included, over block sizes around the edge cases of the kernels. All the
+// encoders have to produce the bitstream of the scalar one. A throughput
+// matrix of the pairs is printed for every corpus.
+
+// Only that many blocks of every edge size are checked.
+#define SELFTEST_CHECK_BLOCKS 8
+
+// Decoding tables budget of the lookup table width sweep, wider tables are
+// narrowed to fit it.
+#define SELFTEST_MAX_TABLE_SIZE (16 * 1024 * 1024)
+
+// Minimal time spent measuring every engine pair.
+#define SELFTEST_MIN_SECONDS 0.1
+
+// Returns false if any round trip fails.
+bool selftest(const hcfg_t *cfg);
+
+#endif
@@ -0,0 +1,486 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <ugeneric.h>
+#include "archive.h"
+#include "bitio.h"
+#include "crc32c.h"
+#include "stream.h"
+#include "util.h"
+
+#define FGK_ROOT (STREAM_NODES - 1)
+#define FGK_NONE (-1)
+
+typedef struct {
+    uint32_t weight;
+    int16_t parent;
+    int16_t left;   // FGK_NONE for leaves
+    int16_t right;
+    int16_t symbol; // FGK_NONE for NYT and internal nodes
+} fgk_node_t;
+
+// Nodes are stored in the order of their implicit numbers: weights never
+// decrease with the index, siblings are adjacent and root is the last one.
+typedef struct {
+    fgk_node_t nodes[STREAM_NODES];
+    int16_t leaves[HCODES_TABLE_SIZE]; // FGK_NONE for symbols not seen yet
+    int16_t nyt;
+} fgk_tree_t;
+
+// Buffered reader returning whatever the input has, it never waits for more
+// data than requested.
+typedef struct {
+    int fd;
+    size_t pos;
+    size_t size;
+    uint8_t data[4096];
+} stream_reader_t;
+
+static void fgk_reset(fgk_tree_t *t)
+{
+    for (size_t i = 0; i < HCODES_TABLE_SIZE; i++)
+    {
+        t->leaves[i] = FGK_NONE;
+    }
+    t->nyt = FGK_ROOT;
+    t->nodes[FGK_ROOT] = (fgk_node_t){.parent = FGK_NONE, .left = FGK_NONE, .right = FGK_NONE,
+                                      .symbol = FGK_NONE};
+}
+
+// Point children (or the symbol) of a node at its new position.
+static void fgk_attach(fgk_tree_t *t, int n)
+{
+    const fgk_node_t *node = &t->nodes[n];
+
+    if (node->left != FGK_NONE)
+    {
+        t->nodes[node->left].parent = n;
+        t->nodes[node->right].parent = n;
+    }
+    else if (node->symbol != FGK_NONE)
+    {
+        t->leaves[node->symbol] = n;
+    }
+    else
+    {
+        t->nyt = n;
+    }
+}
+
+// Exchange subtrees rooted at a and b, positions keep their parents.
+static void fgk_swap(fgk_tree_t *t, int a, int b)
+{
+    fgk_node_t tmp = t->nodes[a];
+
+    tmp.parent = t->nodes[b].parent;
+    t->nodes[b].parent = t->nodes[a].parent;
+    t->nodes[a] = t->nodes[b];
+    t->nodes[b] = tmp;
+    fgk_attach(t, a);
+    fgk_attach(t, b);
+}
+
+static void fgk_update(fgk_tree_t *t, uint8_t symbol)
+{
+    int n = t->leaves[symbol];
+
+    if (n == FGK_NONE)
+    {
+        // NYT gives birth to the new NYT and the leaf of the symbol.
+        int parent = t->nyt;
+        t->nodes[parent].left = parent - 2;
+        t->nodes[parent].right = parent - 1;
+        t->nodes[parent - 1] = (fgk_node_t){.parent = parent, .left = FGK_NONE, .right = FGK_NONE,
+                                            .symbol = symbol};
+        t->nodes[parent - 2] = (fgk_node_t){.parent = parent, .left = FGK_NONE, .right = FGK_NONE,
+                                            .symbol = FGK_NONE};
+        t->leaves[symbol] = parent - 1;
+        t->nyt = parent - 2;
+        n = parent - 1;
+    }
+
+    // Move every node of the path to the top of its weight block before
+    // incrementing it, it keeps the sibling property.
+    while (n != FGK_NONE)
+    {
+        // Parent is in the block only when the sibling is NYT.
+        int leader = n;
+        int parent = t->nodes[n].parent;
+        for (int i = n + 1; i <= FGK_ROOT && t->nodes[i].weight == t->nodes[n].weight; i++)
+        {
+            if (i != parent)
+            {
+                leader = i;
+            }
+        }
+        if (leader != n)
+        {
+            fgk_swap(t, n, leader);
+            n = leader;
+        }
+        t->nodes[n].weight++;
+        n = t->nodes[n].parent;
+    }
+
+    if (t->nodes[FGK_ROOT].weight >= STREAM_MAX_WEIGHT)
+    {
+        fgk_reset(t);
+    }
+}
+
+static void fgk_encode(fgk_tree_t *t, bit_writer_t *bw, uint8_t symbol)
+{
+    int n = t->leaves[symbol];
+    bool seen = (n != FGK_NONE);
+    uint64_t code = 0;
+    unsigned int len = 0;
+
+    // Path is collected bottom up, so root bit ends up in the LSB.
+    for (n = seen ? n : t->nyt; n != FGK_ROOT; n = t->nodes[n].parent)
+    {
+        code = (code << 1) | (t->nodes[t->nodes[n].parent].right == n);
+        len++;
+    }
+    UASSERT(len <= STREAM_MAX_CODE_LEN);
+    put_bits(bw, code, len);
+    if (!seen)
+    {
+        put_bits(bw, symbol, 8);
+    }
+    fgk_update(t, symbol);
+}
+
+// Returns false if the bitstream ends in the middle of a symbol.
+static bool fgk_decode(fgk_tree_t *t, bit_reader_t *br, uint8_t *symbol)
+{
+    int n = FGK_ROOT;
+
+    bit_reader_refill(br);
+    while (t->nodes[n].left != FGK_NONE)
+    {
+        if (!br->avail)
+        {
+            return false;
+        }
+        n = (br->bits & 1) ? t->nodes[n].right : t->nodes[n].left;
+        bit_reader_skip(br, 1);
+    }
+
+    if (n == t->nyt)
+    {
+        bit_reader_refill(br);
+        if (br->avail < 8)
+        {
+            return false;
+        }
+        *symbol = bit_reader_peek(br, 8);
+        bit_reader_skip(br, 8);
+    }
+    else
+    {
+        *symbol = t->nodes[n].symbol;
+    }
+    fgk_update(t, *symbol);
+
+    return true;
+}
+
+static int open_input(const char *file)
+{
+    int fd = strcmp(file, "-") ? open(file, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s.\n", file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static int open_output(const char *file)
+{
+    int fd = strcmp(file, "-") ? open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s.\n", file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "Error: write failed: %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+// Read what is available (blocking only if nothing is), returns 0 at the
+// end of input.
+static size_t read_some(int fd, void *data, size_t size)
+{
+    for (;;)
+    {
+        ssize_t n = read(fd, data, size);
+        if (n >= 0)
+        {
+            return n;
+        }
+        if (errno != EINTR)
+        {
+            fprintf(stderr, "Error: read failed: %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static bool input_ready(int fd)
+{
+    struct pollfd p = {.fd = fd, .events = POLLIN};
+    return poll(&p, 1, 0) > 0;
+}
+
+static bool reader_at_end(stream_reader_t *r)
+{
+    if (r->pos == r->size)
+    {
+        r->pos = 0;
+        r->size = read_some(r->fd, r->data, sizeof(r->data));
+    }
+    return r->size == 0;
+}
+
+// Returns number of bytes read, less than size only at the end of input.
+static size_t reader_read(stream_reader_t *r, void *data, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size && !reader_at_end(r))
+    {
+        size_t n = r->size - r->pos;
+        n = (n < size - done) ? n : size - done;
+        memcpy((uint8_t *)data + done, &r->data[r->pos], n);
+        r->pos += n;
+        done += n;
+    }
+
+    return done;
+}
+
+static bool reader_read_varint(stream_reader_t *r, uint32_t *value)
+{
+    uint8_t bytes[5];
+    size_t count = 0;
+    const uint8_t *p = bytes;
+
+    do
+    {
+        if (count == sizeof(bytes) || reader_read(r, &bytes[count], 1) != 1)
+        {
+            return false;
+        }
+    } while (bytes[count++] & 0x80);
+
+    return read_varint(&p, bytes + count, value);
+}
+
+// Encode and write out one chunk, returns its size in the archive.
+static size_t flush_chunk(fgk_tree_t *tree, const uint8_t *input, size_t size, int fd, ubuffer_t *buffer,
+                          ubuffer_t *chunk)
+{
+    bit_writer_t bw;
+    uint32_t checksum = crc32c(0, input, size);
+
+    bit_writer_init(&bw, buffer, size, STREAM_MAX_CODE_LEN + 8);
+    for (size_t i = 0; i < size; i++)
+    {
+        fgk_encode(tree, &bw, input[i]);
+    }
+    umemchunk_t bits = bit_writer_finish(&bw, buffer);
+    bits.size -= HBLOCK_GUARD_BYTES; // chunks are decoded bit by bit
+
+    // Single write per chunk, so a reader of the pipe never sees a part of it.
+    ubuffer_reset(chunk);
+    append_varint(chunk, size);
+    append_varint(chunk, bits.size);
+    ubuffer_append_data(chunk, &checksum, sizeof(checksum));
+    ubuffer_append_data(chunk, bits.data, bits.size);
+    write_all(fd, chunk->data, chunk->data_size);
+
+    return chunk->data_size;
+}
+
+void stream_compress(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    int in = open_input(input_file);
+    int out = open_output(output_file);
+    fgk_tree_t *tree = umalloc(sizeof(*tree));
+    uint8_t *input = umalloc(cfg->flush_size);
+    ubuffer_t buffer = {0}, chunk = {0};
+    hstat_t stat = {0};
+    size_t pending = 0, original_size = 0, compressed_size, chunks_count = 0;
+    size_t n;
+
+    huffman_archive_header_t *hdr = allocate_header(NULL, 0, &stat, 0, 0);
+    hdr->codec = HCODEC_STREAM;
+    compressed_size = get_header_size(hdr);
+    write_all(out, hdr, compressed_size);
+
+    fgk_reset(tree);
+    do
+    {
+        n = read_some(in, input + pending, cfg->flush_size - pending);
+        pending += n;
+        if (pending && (n == 0 || pending == cfg->flush_size || !input_ready(in)))
+        {
+            compressed_size += flush_chunk(tree, input, pending, out, &buffer, &chunk);
+            original_size += pending;
+            chunks_count++;
+            pending = 0;
+        }
+    } while (n);
+
+    // Output may be stdout.
+    if (cfg->verbose)
+    {
+        fprintf(stderr, "Stream: %zu bytes -> %zu bytes in %zu chunks.\n", original_size, compressed_size,
+                chunks_count);
+    }
+
+    if (in != STDIN_FILENO)
+    {
+        close(in);
+    }
+    if (out != STDOUT_FILENO && close(out) != 0)
+    {
+        fprintf(stderr, "Error: can't write %s: %s.\n", output_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&chunk);
+    ufree(input);
+    ufree(tree);
+    ufree(hdr);
+}
+
+// Chunk is corrupted if its header or bitstream is truncated, if bits don't
+// decode to the original size or if the checksum doesn't match.
+static bool decode_chunk(fgk_tree_t *tree, stream_reader_t *r, ubuffer_t *buffer, ubuffer_t *output)
+{
+    uint32_t original_size, compressed_size, checksum;
+    bit_reader_t br;
+    uint8_t *out;
+
+    if (!reader_read_varint(r, &original_size) || !reader_read_varint(r, &compressed_size) ||
+        reader_read(r, &checksum, sizeof(checksum)) != sizeof(checksum) ||
+        original_size > (uint64_t)compressed_size * 8)
+    {
+        return false;
+    }
+
+    ubuffer_reserve_capacity(buffer, compressed_size + 1);
+    if (reader_read(r, buffer->data, compressed_size) != compressed_size)
+    {
+        return false;
+    }
+
+    ubuffer_reserve_capacity(output, original_size + 1);
+    out = output->data;
+    bit_reader_init(&br, buffer->data, compressed_size);
+    for (size_t i = 0; i < original_size; i++)
+    {
+        if (!fgk_decode(tree, &br, &out[i]))
+        {
+            return false;
+        }
+    }
+    output->data_size = original_size;
+
+    return crc32c(0, out, original_size) == checksum;
+}
+
+bool stream_extract(const char *input_file, const char *output_file, const hcfg_t *cfg)
+{
+    stream_reader_t *r = umalloc(sizeof(*r));
+    fgk_tree_t *tree = umalloc(sizeof(*tree));
+    ubuffer_t buffer = {0}, output = {0};
+    huffman_archive_header_t hdr;
+    size_t original_size = 0, chunks_count = 0;
+    bool ok = true;
+    int out = -1;
+    double t = get_time();
+
+    r->fd = open_input(input_file);
+    r->pos = r->size = 0;
+    if (reader_read(r, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.signature, HUFFMAN_ARCHIVE_SIGNATURE, sizeof(hdr.signature)) != 0 ||
+        hdr.version != HUFFMAN_ARCHIVE_VERSION || hdr.codec != HCODEC_STREAM ||
+        hdr.blocks_count != 0 || hdr.tables_size != 0)
+    {
+        fprintf(stderr, "Error: %s is not a valid stream archive.\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    if (output_file)
+    {
+        out = open_output(output_file);
+    }
+
+    fgk_reset(tree);
+    while (!reader_at_end(r))
+    {
+        if (!decode_chunk(tree, r, &buffer, &output))
+        {
+            // Tree state is lost, nothing after a bad chunk can be decoded.
+            fprintf(stderr, "%s: chunk %zu is corrupted.\n", input_file, chunks_count);
+            ok = false;
+            break;
+        }
+        if (out >= 0)
+        {
+            write_all(out, output.data, output.data_size);
+        }
+        original_size += output.data_size;
+        chunks_count++;
+    }
+    t = get_time() - t;
+
+    if (!output_file && ok)
+    {
+        printf("%s: OK, %zu chunks, %zu bytes verified in %.3f s (%.1f MB/s).\n",
+               input_file, chunks_count, original_size, t, t > 0 ? original_size / t / 1e6 : 0.0);
+    }
+    else if (cfg->verbose)
+    {
+        fprintf(stderr, "Stream: %zu bytes in %zu chunks extracted.\n", original_size, chunks_count);
+    }
+
+    if (r->fd != STDIN_FILENO)
+    {
+        close(r->fd);
+    }
+    if (out >= 0 && out != STDOUT_FILENO && close(out) != 0)
+    {
+        fprintf(stderr, "Error: can't write %s: %s.\n", output_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ubuffer_destroy(&buffer);
+    ubuffer_destroy(&output);
+    ufree(tree);
+    ufree(r);
+
+    return ok;
+}
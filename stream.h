@@ -0,0 +1,33 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "huffman.h"
+
+// One-pass codec (FGK adaptive Huffman): encoder and decoder update the
+// same tree after every symbol, so neither a stat pass nor code tables are
+// needed and output can be flushed at any point. A symbol seen for the
+// first time is sent as the code of the NYT (not yet transmitted) node
+// followed by 8 raw bits.
+//
+// Archive is a header with HCODEC_STREAM and no blocks followed by chunks:
+// varint original size, varint compressed size, CRC-32C of original data
+// (4 bytes) and the bitstream padded to a byte. Tree is carried over from
+// chunk to chunk. A chunk is flushed when flush_size bytes of input are
+// pending or when no more input is ready, so data read from a pipe goes out
+// as soon as it comes in. "-" stands for stdin/stdout.
+#define STREAM_NODES (2 * HCODES_TABLE_SIZE + 1)
+
+// Tree is reset when the root weight reaches this value, it keeps codes
+// short enough for 64-bit writes (weights grow at least as Fibonacci
+// numbers with depth) and lets the tree forget stale statistics.
+#define STREAM_MAX_WEIGHT (1U << 24)
+#define STREAM_MAX_CODE_LEN 56
+
+#define DEFAULT_FLUSH_SIZE 65536
+
+void stream_compress(const char *input_file, const char *output_file, const hcfg_t *cfg);
+
+// Output file NULL only verifies checksums (--test).
+bool stream_extract(const char *input_file, const char *output_file, const hcfg_t *cfg);
+
+#endif
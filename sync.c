@@ -0,0 +1,174 @@
+#include <ugeneric.h>
+#include "bitio.h"
+#include "sync.h"
+
+size_t get_sync_points_count(size_t original_size, size_t sync_interval)
+{
+    return (sync_interval && original_size) ? (original_size - 1) / sync_interval : 0;
+}
+
+uint64_t *get_header_sync_points(const huffman_archive_header_t *hdr)
+{
+    return (uint64_t *)&hdr->blocks[hdr->blocks_count];
+}
+
+uint64_t *get_block_sync_points(const huffman_archive_header_t *hdr, size_t block)
+{
+    uint64_t *points = get_header_sync_points(hdr);
+
+    for (size_t i = 0; i < block; i++)
+    {
+        points += get_sync_points_count(hdr->blocks[i].original_size, hdr->sync_interval);
+    }
+
+    return points;
+}
+
+void build_sync_points(const htable_t *table, umemchunk_t input, size_t sync_interval, uint64_t *points)
+{
+    UASSERT_INPUT(table);
+    UASSERT_INPUT(sync_interval);
+
+    const uint8_t *in = input.data;
+    size_t count = get_sync_points_count(input.size, sync_interval);
+    uint64_t bits = 0;
+
+    for (size_t k = 0; k < count; k++)
+    {
+        for (size_t i = k * sync_interval; i < (k + 1) * sync_interval; i++)
+        {
+            bits += table->hcodes[in[i]].len;
+        }
+        points[k] = bits;
+    }
+}
+
+umemchunk_t decode_block_segments(const hdecoder_t *decoder, umemchunk_t input, const uint64_t *points,
+                                  size_t sync_interval, size_t original_size, size_t first, size_t count,
+                                  ubuffer_t *buffer)
+{
+    UASSERT_INPUT(decoder);
+    UASSERT_INPUT(buffer);
+
+    size_t points_count = get_sync_points_count(original_size, sync_interval);
+    UASSERT_INPUT(count && first + count <= points_count + 1);
+
+    uint64_t first_bit = first ? points[first - 1] : 0;
+    size_t start = first_bit / 8;
+    size_t end = input.size;
+    size_t size = original_size - first * sync_interval;
+    if (first + count <= points_count)
+    {
+        // One more byte for the code crossing the byte boundary.
+        end = points[first + count - 1] / 8 + 1;
+        size = count * sync_interval;
+    }
+    if (start >= end || end > input.size)
+    {
+        umemchunk_t empty = {.data = buffer->data, .size = 0};
+        return empty;
+    }
+
+    // Decoders start at a byte, so the segments are shifted to the first
+    // bit of their first code. Zeros past them stand for guard bytes.
+    unsigned int shift = first_bit % 8;
+    const uint8_t *in = (const uint8_t *)input.data + start;
+    size_t n = end - start;
+    uint8_t *shifted = umalloc(n + HBLOCK_GUARD_BYTES);
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned int next = (i + 1 < n) ? in[i + 1] : 0;
+        shifted[i] = shift ? (uint8_t)((in[i] >> shift) | (next << (8 - shift))) : in[i];
+    }
+    memset(shifted + n, 0, HBLOCK_GUARD_BYTES);
+
+    umemchunk_t segments = {.data = shifted, .size = n + HBLOCK_GUARD_BYTES};
+    umemchunk_t output = decode_block(decoder, segments, buffer, size);
+    ufree(shifted);
+
+    return output;
+}
+
+typedef struct {
+    const hdecoder_t *decoder;
+    umemchunk_t input;
+    const uint64_t *points;
+    size_t sync_interval;
+    size_t original_size;
+    size_t first;
+    size_t count;
+    uint8_t *output;
+    bool failed;
+} sync_task_t;
+
+static void decode_task(void *arg)
+{
+    sync_task_t *task = arg;
+    ubuffer_t buffer = {0};
+    size_t size = task->count * task->sync_interval;
+
+    if (task->original_size - task->first * task->sync_interval < size)
+    {
+        size = task->original_size - task->first * task->sync_interval;
+    }
+    umemchunk_t m = decode_block_segments(task->decoder, task->input, task->points, task->sync_interval,
+                                          task->original_size, task->first, task->count, &buffer);
+    if (m.size == size)
+    {
+        memcpy(task->output + task->first * task->sync_interval, m.data, size);
+    }
+    else
+    {
+        task->failed = true;
+    }
+    ubuffer_destroy(&buffer);
+}
+
+umemchunk_t decode_block_parallel(hpool_t *pool, size_t tasks_count, const hdecoder_t *decoder,
+                                  umemchunk_t input, const uint64_t *points, size_t sync_interval,
+                                  size_t original_size, ubuffer_t *buffer)
+{
+    UASSERT_INPUT(pool);
+    UASSERT_INPUT(tasks_count);
+
+    size_t segments_count = get_sync_points_count(original_size, sync_interval) + 1;
+    if (tasks_count > segments_count)
+    {
+        tasks_count = segments_count;
+    }
+    if (tasks_count == 1)
+    {
+        return decode_block(decoder, input, buffer, original_size);
+    }
+
+    sync_task_t *tasks = ucalloc(tasks_count, sizeof(sync_task_t));
+    ubuffer_reserve_capacity(buffer, original_size + 8);
+    for (size_t i = 0; i < tasks_count; i++)
+    {
+        sync_task_t *task = &tasks[i];
+        task->decoder = decoder;
+        task->input = input;
+        task->points = points;
+        task->sync_interval = sync_interval;
+        task->original_size = original_size;
+        task->first = segments_count * i / tasks_count;
+        task->count = segments_count * (i + 1) / tasks_count - task->first;
+        task->output = buffer->data;
+        hpool_submit(pool, decode_task, task);
+    }
+    hpool_wait(pool);
+
+    buffer->data_size = original_size;
+    for (size_t i = 0; i < tasks_count; i++)
+    {
+        if (tasks[i].failed)
+        {
+            buffer->data_size = 0;
+        }
+    }
+    ufree(tasks);
+
+    umemchunk_t output = {.data = buffer->data, .size = buffer->data_size};
+
+    return output;
+}
@@ -0,0 +1,32 @@
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include "huffman.h"
+#include "pool.h"
+
+// Sync points of static codec blocks (--sync-interval): point k of a block
+// is the bit offset of the code of its byte k * sync_interval, so the block
+// can be decoded from the middle, by several threads at once or starting
+// near the range to extract. Block of original_size bytes gets
+// (original_size - 1) / sync_interval points (none at offset 0), points
+// of all the blocks follow the block descriptors in the header. Bitstream
+// is the same as without sync points.
+
+size_t get_sync_points_count(size_t original_size, size_t sync_interval);
+uint64_t *get_header_sync_points(const huffman_archive_header_t *hdr);
+uint64_t *get_block_sync_points(const huffman_archive_header_t *hdr, size_t block);
+void build_sync_points(const htable_t *table, umemchunk_t input, size_t sync_interval, uint64_t *points);
+
+// Decode segments [first, first + count) of the block, segment i starts at
+// byte i * sync_interval of the block. Returned data is shorter than the
+// segments if the block is corrupted.
+umemchunk_t decode_block_segments(const hdecoder_t *decoder, umemchunk_t input, const uint64_t *points,
+                                  size_t sync_interval, size_t original_size, size_t first, size_t count,
+                                  ubuffer_t *buffer);
+
+// Decode the block by tasks_count pool tasks.
+umemchunk_t decode_block_parallel(hpool_t *pool, size_t tasks_count, const hdecoder_t *decoder,
+                                  umemchunk_t input, const uint64_t *points, size_t sync_interval,
+                                  size_t original_size, ubuffer_t *buffer);
+
+#endif
@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ugeneric.h>
+
+#include "uring.h"
+
+struct _uring {
+    int fd;
+    unsigned int entries;
+
+    // Submission ring.
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int pending; // prepared but not submitted yet
+
+    // Completion ring, shares the mapping with the submission one when
+    // the kernel has IORING_FEAT_SINGLE_MMAP.
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+huring_t *uring_create(unsigned int entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    huring_t *ring = uzalloc(sizeof(*ring));
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_size > ring->sq_size)
+        {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        close(fd);
+        ufree(ring);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(fd);
+            ufree(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ptr != ring->sq_ptr)
+        {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(fd);
+        ufree(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+    uint8_t *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return ring;
+}
+
+void uring_destroy(huring_t *ring)
+{
+    if (ring)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ptr != ring->sq_ptr)
+        {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+        ufree(ring);
+    }
+}
+
+bool uring_register_buffers(huring_t *ring, const struct iovec *iov, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+static bool prep(huring_t *ring, bool write, int fd, const void *buf, size_t size, uint64_t offset,
+                 int buf_index, uint64_t user_data)
+{
+    unsigned int tail = *ring->sq_tail + ring->pending;
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= ring->entries)
+    {
+        return false;
+    }
+
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    if (buf_index >= 0)
+    {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buf_index;
+    }
+    else
+    {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    ring->sq_array[index] = index;
+    ring->pending++;
+
+    return true;
+}
+
+bool uring_prep_read(huring_t *ring, int fd, void *buf, size_t size, uint64_t offset, int buf_index,
+                     uint64_t user_data)
+{
+    return prep(ring, false, fd, buf, size, offset, buf_index, user_data);
+}
+
+bool uring_prep_write(huring_t *ring, int fd, const void *buf, size_t size, uint64_t offset, int buf_index,
+                      uint64_t user_data)
+{
+    return prep(ring, true, fd, buf, size, offset, buf_index, user_data);
+}
+
+static int enter(huring_t *ring, unsigned int min_complete)
+{
+    int ret;
+
+    if (ring->pending)
+    {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->pending, __ATOMIC_RELEASE);
+        ring->pending = 0;
+    }
+
+    // Entries the kernel didn't consume last time are submitted again.
+    unsigned int to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+int uring_submit(huring_t *ring)
+{
+    return enter(ring, 0);
+}
+
+bool uring_wait(huring_t *ring, uint64_t *user_data, int *res)
+{
+    for (;;)
+    {
+        unsigned int head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            *user_data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (enter(ring, 1) < 0)
+        {
+            return false;
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Minimal io_uring wrapper on top of the raw system calls, there is no
+// liburing dependency. Requests are queued by uring_prep_*() and passed to
+// the kernel by uring_submit() (or uring_wait() when there are pending
+// ones). Buffer index is the index of a buffer registered by
+// uring_register_buffers(), -1 for unregistered memory.
+typedef struct _uring huring_t;
+
+// Returns NULL when io_uring isn't supported by the kernel or is disabled.
+huring_t *uring_create(unsigned int entries);
+void uring_destroy(huring_t *ring);
+
+bool uring_register_buffers(huring_t *ring, const struct iovec *iov, unsigned int count);
+
+// Return false when the submission queue is full.
+bool uring_prep_read(huring_t *ring, int fd, void *buf, size_t size, uint64_t offset, int buf_index,
+                     uint64_t user_data);
+bool uring_prep_write(huring_t *ring, int fd, const void *buf, size_t size, uint64_t offset, int buf_index,
+                      uint64_t user_data);
+
+// Returns number of submitted requests or -errno.
+int uring_submit(huring_t *ring);
+
+// Wait for a completion, res is the result of the request (bytes or
+// -errno). Returns false on io_uring_enter() failure.
+bool uring_wait(huring_t *ring, uint64_t *user_data, int *res);
+
+#endif
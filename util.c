@@ -1,11 +1,16 @@
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "util.h"
 #include "huffman.h"
 
-char *hcode2str(const hcode_t *code)
+char *hcode2str(const hcode_t *code, char *s)
 {
-    char *s = umalloc(code->len + 1);
     for (size_t i = 0; i < code->len; i++)
     {
        s[i] = (bool)(code->code & (1LLU << i)) + '0';
@@ -29,22 +34,21 @@ hcode_t str2hcode(const char *str, size_t str_len)
     return h;
 }
 
-char *escape_symbol(int in)
+char *escape_symbol(int in, char *out)
 {
-    char *out;
     if (in > 255)
     {
-        out = ustring_fmt("\\x{%04x}", in);
+        snprintf(out, ESCAPED_SYMBOL_SIZE, "\\x{%04x}", (uint16_t)in);
     }
     else
     {
         if (isprint(in) && (in != ' ') && (in != '\\'))
         {
-            out = ustring_fmt("%c", in);
+            snprintf(out, ESCAPED_SYMBOL_SIZE, "%c", in);
         }
         else
         {
-            out = ustring_fmt("\\x%02x", (unsigned char)in);
+            snprintf(out, ESCAPED_SYMBOL_SIZE, "\\x%02x", (unsigned char)in);
         }
     }
 
@@ -58,9 +62,9 @@ char *escape_string(const char *in)
 
     while (*in)
     {
-        if (*in == '\\')
+        if (*in == '\\' || *in == '"')
         {
-            *t++ = *in;
+            *t++ = '\\';
         }
         *t++ = *in++;
     }
@@ -82,8 +86,8 @@ void dump_table(const htable_t *table, const hstat_t *stat)
         if (stat->frequencies[i])
         {
             size_t len = table->hcodes[i].len;
-            char *ec = escape_symbol(i);
-            char *hcode = hcode2str(&table->hcodes[i]);
+            char ec[ESCAPED_SYMBOL_SIZE];
+            char hcode[MAX_HCODE_LENGTH + 1];
             if (len > max_code_len)
             {
                 max_code_len = len;
@@ -95,99 +99,323 @@ void dump_table(const htable_t *table, const hstat_t *stat)
             sum += len * stat->frequencies[i];
             count += stat->frequencies[i];
             printf("%7s%14"PRIu32"%10"PRIu32"      %s\n",
-                ec,
+                escape_symbol(i, ec),
                 stat->frequencies[i],
                 table->hcodes[i].len,
-                hcode
+                hcode2str(&table->hcodes[i], hcode)
             );
-            ufree(ec);
-            ufree(hcode);
         }
     }
     printf("min/max/mean code len: %zu, %zu, %f\n",
            min_code_len, max_code_len, (double)sum/count);
+    printf("predicted ratio: %.2f%% (%zu of %zu bytes, headers and block padding aside)\n",
+           100.0 * ((sum + 7) / 8) / count, (sum + 7) / 8, count);
 }
 
-static void dump_node(const hnode_t *node, FILE *f)
+FILE *open_tree_log(void)
 {
-    UASSERT(node);
-    UASSERT(f);
+    FILE *f = fopen(TREE_LOG_FILE, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Error: can't create %s: %s.\n", TREE_LOG_FILE, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    const char *color = NULL;
+    return f;
+}
 
-    if (!node->left && !node->right)
-        color = ", fillcolor=yellow";
+void log_tree_node(FILE *f, const hnode_t *node)
+{
+    if (node->is_leaf)
+    {
+        char symbol[ESCAPED_SYMBOL_SIZE];
+        fprintf(f, "leaf %u %zu %s\n", node->id, node->frequency, escape_symbol(node->code, symbol));
+    }
     else
-        color = ", fillcolor=gray";
+    {
+        fprintf(f, "merge %u %u %u %zu\n", node->id, node->left->id, node->right->id, node->frequency);
+    }
+}
+
+typedef struct {
+    size_t frequency;
+    size_t left;
+    size_t right;
+    bool is_leaf;
+    char *label; // symbols of the subtree
+} tree_log_node_t;
+
+static void render_frame(const tree_log_node_t *nodes, size_t leaves_count, size_t frame)
+{
+    char name[32];
+    size_t count = leaves_count + frame;
+
+    snprintf(name, sizeof(name), "tree%03zu.dot", frame);
+    FILE *f = fopen(name, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Error: can't create %s: %s.\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Node made by the last merge of the frame is highlighted.
+    fprintf(f, "digraph %zu {\n", frame);
+    for (size_t i = 0; i < count; i++)
+    {
+        const tree_log_node_t *node = &nodes[i];
+        const char *color = node->is_leaf ? "yellow" : (frame && i == count - 1) ? "red" : "gray";
+        char *label = escape_string(node->label);
+        fprintf(f, "    \"n%zu\" [style=filled, fillcolor=%s,label=\"%s\\n%zu\"];\n", i, color, label,
+                node->frequency);
+        if (!node->is_leaf)
+        {
+            fprintf(f, "    \"n%zu\" -> \"n%zu\" [label=0];\n", i, node->left);
+            fprintf(f, "    \"n%zu\" -> \"n%zu\" [label=1];\n", i, node->right);
+        }
+        ufree(label);
+    }
+    fputs("}\n", f);
+    fclose(f);
+}
+
+void render_tree_log(const char *log_file, size_t first, size_t last)
+{
+    FILE *f = fopen(log_file, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Error: can't open %s: %s.\n", log_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    if (node->highlight)
-        color = ", fillcolor=red";
+    tree_log_node_t *nodes = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t leaves_count = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), f))
+    {
+        tree_log_node_t node = {0};
+        char symbol[ESCAPED_SYMBOL_SIZE];
+        size_t id;
+        bool ok;
+        if (strncmp(line, "leaf ", 5) == 0)
+        {
+            ok = sscanf(line, "leaf %zu %zu %8s", &id, &node.frequency, symbol) == 3 && count == leaves_count;
+            node.is_leaf = true;
+            leaves_count++;
+        }
+        else
+        {
+            ok = sscanf(line, "merge %zu %zu %zu %zu", &id, &node.left, &node.right, &node.frequency) == 4 &&
+                 node.left < count && node.right < count;
+        }
+        if (!ok || id != count)
+        {
+            fprintf(stderr, "Error: %s is not a tree log, line %zu is broken.\n", log_file, count + 1);
+            exit(EXIT_FAILURE);
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 512;
+            nodes = urealloc(nodes, capacity * sizeof(tree_log_node_t));
+        }
+        if (node.is_leaf)
+        {
+            node.label = ustring_fmt("%s", symbol);
+        }
+        else
+        {
+            node.label = ustring_fmt("%s%s", nodes[node.left].label, nodes[node.right].label);
+        }
+        nodes[count++] = node;
+    }
+    fclose(f);
 
-    char *label = escape_string(node->code_as_str);
-    fprintf(f, "    \"%s\" [style=filled%s,label=\"%s\\n%zu\"];\n",
-            node->code_as_str, color, label, node->frequency);
-    if (node->left)
+    size_t frames_count = count ? count - leaves_count + 1 : 0;
+    if (first >= frames_count)
     {
-        fprintf(f, "    \"%s\" -> \"%s\" [label=0];\n",
-                node->code_as_str, node->left->code_as_str);
+        fprintf(stderr, "Error: %s has %zu frames.\n", log_file, frames_count);
+        exit(EXIT_FAILURE);
     }
-    if (node->right)
+    if (last >= frames_count)
     {
-        fprintf(f, "    \"%s\" -> \"%s\" [label=1];\n",
-                node->code_as_str, node->right->code_as_str);
+        last = frames_count - 1;
     }
+    for (size_t frame = first; frame <= last; frame++)
+    {
+        render_frame(nodes, leaves_count, frame);
+    }
+    printf("Rendered frames %zu to %zu of %zu.\n", first, last, frames_count);
 
-    ufree(label);
+    for (size_t i = 0; i < count; i++)
+    {
+        ufree(nodes[i].label);
+    }
+    ufree(nodes);
 }
 
-static void remember_node(const hnode_t *node, void *cb_data, char *path, size_t path_len)
+// Monotonic time in seconds.
+double get_time(void)
 {
-    uvector_t *nodes = cb_data;
-    uvector_append(nodes, G_CPTR(node));
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static int compare_hnodes(const void *hnode1, const void *hnode2)
+// Peak resident set size of the process in bytes.
+size_t get_peak_rss(void)
 {
-    const hnode_t *n1 = hnode1;
-    const hnode_t *n2 = hnode2;
-    return strcmp(n1->code_as_str, n2->code_as_str);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+
+    return (size_t)usage.ru_maxrss * 1024;
 }
 
-void generate_graph(const ugeneric_t *nodes, size_t count, size_t page)
+// Reserve disk space for the file to be written without changing its size,
+// so its blocks are allocated at once. Best effort, file systems may not
+// support it.
+void preallocate_file(const char *path, size_t size)
 {
-    // Assumed that there are count nodes in array pointed by *node
-    UASSERT(nodes);
-    UASSERT(count);
-    UASSERT(page < 1000);
+    int fd = size ? open(path, O_WRONLY) : -1;
+    if (fd >= 0)
+    {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+        close(fd);
+    }
+}
 
-    char tmp[sizeof("treeXXX.dot")];
+// Copy the first size bytes of a file to the start of another one. Data
+// is copied by the kernel, file systems with copy-on-write share the
+// blocks instead of copying them.
+bool copy_file_data(int in_fd, int out_fd, size_t size)
+{
+    loff_t in_offset = 0, out_offset = 0;
+    char buffer[65536];
 
-    if (page != -1)
+    while (size)
     {
-        snprintf(tmp, sizeof(tmp), "tree%03zu.dot", page);
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        size -= n;
     }
 
-    FILE *f = fopen(tmp, "w+");
-    UASSERT(f);
+    // Kernel may refuse to copy between file systems, rest goes through
+    // the buffer.
+    while (size)
+    {
+        ssize_t n = pread(in_fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), in_offset);
+        if (n <= 0 || pwrite(out_fd, buffer, n, out_offset) != n)
+        {
+            return false;
+        }
+        in_offset += n;
+        out_offset += n;
+        size -= n;
+    }
 
-    fprintf(f, "digraph %zu {\n", page);
+    return true;
+}
 
-    uvector_t *v = uvector_create();
-    uvector_set_void_comparator(v, compare_hnodes);
+// Atomically replace path by new_path and make the rename durable, both
+// have to be in the same directory.
+bool replace_file(const char *new_path, const char *path)
+{
+    if (rename(new_path, path) != 0)
+    {
+        return false;
+    }
 
-    for (size_t i = 0; i < count; i++)
+    char *dir_path = ustring_fmt("%s", path);
+    int fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
     {
-        traverse_htree(G_AS_PTR(nodes[i]), remember_node, v, NULL, 0, SIZE_MAX);
+        close(fd);
     }
-    uvector_sort(v);
+    ufree(dir_path);
 
-    size_t size = uvector_get_size(v);
-    for (size_t i = 0; i < size; i++)
+    return ok;
+}
+
+static bool read_sysfs_string(const char *path, char *buf, size_t size)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
     {
-        dump_node(G_AS_PTR(uvector_get_at(v, i)), f);
+        return false;
     }
-    fputs("}\n", f);
 
+    bool ok = fgets(buf, size, f) != NULL;
     fclose(f);
-    uvector_destroy(v);
+    if (ok)
+    {
+        buf[strcspn(buf, "\n")] = 0;
+    }
+
+    return ok;
+}
+
+// Size of data (or unified) CPU cache of the given level as reported by
+// sysfs, falls back to typical values when sysfs is not available.
+size_t get_cache_size(unsigned int level)
+{
+    static size_t sizes[4];
+    char path[128];
+    char buf[32];
+
+    UASSERT(level >= 1 && level <= 3);
+    if (sizes[level])
+    {
+        return sizes[level];
+    }
+
+    for (int i = 0; ; i++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        if (!read_sysfs_string(path, buf, sizeof(buf)))
+        {
+            break;
+        }
+        if ((unsigned int)atoi(buf) != level)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        if (!read_sysfs_string(path, buf, sizeof(buf)) || strcmp(buf, "Instruction") == 0)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        if (read_sysfs_string(path, buf, sizeof(buf)))
+        {
+            char *suffix;
+            size_t size = strtoul(buf, &suffix, 10);
+            if (*suffix == 'K')
+            {
+                size <<= 10;
+            }
+            else if (*suffix == 'M')
+            {
+                size <<= 20;
+            }
+            sizes[level] = size;
+            break;
+        }
+    }
+
+    if (!sizes[level])
+    {
+        const size_t defaults[] = {0, 32 << 10, 256 << 10, 8 << 20};
+        sizes[level] = defaults[level];
+    }
+
+    return sizes[level];
 }
@@ -7,11 +7,32 @@
 #include <string.h>
 #include "huffman.h"
 
-char *hcode2str(const hcode_t *code);
+// Longest escaped symbol, "\\x{ffff}" for 16-bit ones, and the terminator.
+#define ESCAPED_SYMBOL_SIZE 9
+
+// Both write to the buffer and return it, hcode2str() needs
+// MAX_HCODE_LENGTH + 1 bytes.
+char *hcode2str(const hcode_t *code, char *s);
 hcode_t str2hcode(const char *str, size_t str_len);
-char *escape_symbol(int in);
+char *escape_symbol(int in, char *out);
 char *escape_string(const char *in);
 void dump_table(const htable_t *table, const hstat_t *stat);
-void generate_graph(const ugeneric_t *nodes, size_t count, size_t page);
+
+// --dump-tree logs building of the tree to TREE_LOG_FILE, a line per node:
+//   leaf ID FREQUENCY SYMBOL
+//   merge ID LEFT_ID RIGHT_ID FREQUENCY
+// Leaves go first, frame k of the tree is the forest after k merges, frames
+// are rendered to treeNNN.dot files on demand (--render-tree).
+#define TREE_LOG_FILE "tree.log"
+FILE *open_tree_log(void);
+void log_tree_node(FILE *f, const hnode_t *node);
+void render_tree_log(const char *log_file, size_t first, size_t last);
+
+double get_time(void);
+size_t get_cache_size(unsigned int level);
+size_t get_peak_rss(void);
+void preallocate_file(const char *path, size_t size);
+bool copy_file_data(int in_fd, int out_fd, size_t size);
+bool replace_file(const char *new_path, const char *path);
 
 #endif
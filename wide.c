@@ -0,0 +1,478 @@
+#include <ugeneric.h>
+#include "bitio.h"
+#include "util.h"
+#include "wide.h"
+
+struct _wide_decoder {
+    hnode_t *root;
+    uint32_t *peek; // symbol | code length << 16, 0 length for long codes
+    uint8_t nbits;
+};
+
+void update_wide_stat(hstat_t *stats, umemchunk_t m)
+{
+    const uint8_t *data = m.data;
+    size_t j;
+
+    for (j = 0; j + 1 < m.size; j += 2)
+    {
+        stats[data[j + 1]].frequencies[data[j]]++;
+    }
+    if (j < m.size)
+    {
+        stats[0].frequencies[data[j]]++;
+    }
+}
+
+static void gather_wide_len(const hnode_t *hnode, void *cb_data,
+                            char *path, size_t path_len)
+{
+    uint8_t *lens = cb_data;
+
+    if (hnode->is_leaf)
+    {
+        // The only symbol gets a 1-bit code.
+        lens[hnode->code] = path_len ? path_len : 1;
+    }
+}
+
+// Canonical codes from code lengths: codes of the same length are
+// consecutive numbers in symbol order and shorter codes come first. The
+// code is stored bit-reversed as the first bit sent is its MSB.
+static void assign_wide_codes(hwide_table_t *table)
+{
+    uint32_t count[MAX_HCODE_LENGTH + 1] = {0};
+    uint64_t next[MAX_HCODE_LENGTH + 1] = {0};
+    uint64_t code = 0;
+
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        count[table->lens[i]]++;
+    }
+    count[0] = 0;
+    for (size_t len = 1; len <= table->max_code_len; len++)
+    {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        uint8_t len = table->lens[i];
+        if (!len)
+        {
+            continue;
+        }
+        code = next[len]++;
+        table->codes[i] = 0;
+        for (uint8_t j = 0; j < len; j++)
+        {
+            if (code & (1LLU << (len - 1 - j)))
+            {
+                table->codes[i] |= 1LLU << j;
+            }
+        }
+    }
+}
+
+static hwide_table_t *allocate_wide_table(void)
+{
+    hwide_table_t *table = uzalloc(sizeof(*table));
+    table->lens = uzalloc(WIDE_SYMBOLS_COUNT * sizeof(uint8_t));
+    table->codes = uzalloc(WIDE_SYMBOLS_COUNT * sizeof(uint64_t));
+    return table;
+}
+
+hwide_table_t *build_wide_table(const hstat_t *stats, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(stats);
+    UASSERT_INPUT(cfg);
+
+    char path[MAX_HCODE_LENGTH + 1] = {0};
+    uint32_t *frequencies = umalloc(WIDE_SYMBOLS_COUNT * sizeof(uint32_t));
+    hwide_table_t *table = allocate_wide_table();
+    hcfg_t quiet = *cfg;
+
+    // Graphs of a tree this large are of no use.
+    quiet.dump_tree = false;
+
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        frequencies[i] = stats[i >> 8].frequencies[i & 0xff];
+    }
+    hnode_t *root = build_tree_from_frequencies(&quiet, frequencies, WIDE_SYMBOLS_COUNT);
+    traverse_htree(root, gather_wide_len, table->lens, path, 0, SIZE_MAX);
+    destroy_tree(root);
+    ufree(frequencies);
+
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        if (table->lens[i])
+        {
+            table->symbols_count++;
+            if (table->lens[i] > table->max_code_len)
+            {
+                table->max_code_len = table->lens[i];
+            }
+        }
+    }
+    UASSERT(table->max_code_len <= PAIR_LEN_SHIFT);
+    assign_wide_codes(table);
+
+    if (cfg->verbose)
+    {
+        printf("Wide table: %u symbols, max code length %u.\n", table->symbols_count, table->max_code_len);
+    }
+
+    return table;
+}
+
+// Packed table: flags, number of symbols, gaps between consecutive symbols
+// present and code lengths of the symbols (in nibbles when all of them fit,
+// in bytes otherwise). Integers are varints, 7 bits per byte.
+#define WIDE_PACKED_NIBBLES 0x01
+
+void pack_wide_table(const hwide_table_t *table, ubuffer_t *output)
+{
+    UASSERT_INPUT(table);
+    UASSERT_INPUT(output);
+
+    uint8_t flags = (table->max_code_len < 16) ? WIDE_PACKED_NIBBLES : 0;
+    uint32_t previous = 0;
+    uint8_t nibbles = 0;
+    size_t count = 0;
+
+    ubuffer_append_byte(output, flags);
+    append_varint(output, table->symbols_count);
+    for (uint32_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        if (table->lens[i])
+        {
+            append_varint(output, count++ ? i - previous - 1 : i);
+            previous = i;
+        }
+    }
+
+    count = 0;
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        uint8_t len = table->lens[i];
+        if (!len)
+        {
+            continue;
+        }
+        if (!(flags & WIDE_PACKED_NIBBLES))
+        {
+            ubuffer_append_byte(output, len);
+        }
+        else if (count++ % 2)
+        {
+            ubuffer_append_byte(output, nibbles | (len << 4));
+        }
+        else
+        {
+            nibbles = len;
+        }
+    }
+    if ((flags & WIDE_PACKED_NIBBLES) && (count % 2))
+    {
+        ubuffer_append_byte(output, nibbles);
+    }
+}
+
+// Returns NULL when data is truncated or lengths don't make a complete
+// prefix code (a single symbol has a 1-bit code).
+hwide_table_t *unpack_wide_table(const uint8_t *data, size_t size)
+{
+    UASSERT_INPUT(data);
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    hwide_table_t *table = allocate_wide_table();
+    uint32_t *symbols = NULL;
+    uint64_t kraft = 0; // sum of 2^(PAIR_LEN_SHIFT - len)
+    uint32_t count, gap;
+    uint64_t symbol = 0;
+    uint8_t flags;
+
+    if (p == end)
+    {
+        goto corrupted;
+    }
+    flags = *p++;
+    if (!read_varint(&p, end, &count) || count == 0 || count > WIDE_SYMBOLS_COUNT)
+    {
+        goto corrupted;
+    }
+
+    symbols = umalloc(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!read_varint(&p, end, &gap))
+        {
+            goto corrupted;
+        }
+        symbol += i ? (uint64_t)gap + 1 : gap;
+        if (symbol >= WIDE_SYMBOLS_COUNT)
+        {
+            goto corrupted;
+        }
+        symbols[i] = symbol;
+    }
+
+    if ((size_t)(end - p) < ((flags & WIDE_PACKED_NIBBLES) ? (count + 1) / 2 : count))
+    {
+        goto corrupted;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t len = (flags & WIDE_PACKED_NIBBLES) ? (p[i / 2] >> (4 * (i % 2))) & 0x0f : p[i];
+        if (len == 0 || len > PAIR_LEN_SHIFT)
+        {
+            goto corrupted;
+        }
+        kraft += 1LLU << (PAIR_LEN_SHIFT - len);
+        if (kraft > (1LLU << PAIR_LEN_SHIFT))
+        {
+            goto corrupted;
+        }
+        table->lens[symbols[i]] = len;
+        if (len > table->max_code_len)
+        {
+            table->max_code_len = len;
+        }
+    }
+    table->symbols_count = count;
+    if (count == 1 ? table->max_code_len != 1 : kraft != (1LLU << PAIR_LEN_SHIFT))
+    {
+        goto corrupted;
+    }
+
+    ufree(symbols);
+    assign_wide_codes(table);
+    return table;
+
+corrupted:
+    ufree(symbols);
+    destroy_wide_table(table);
+    return NULL;
+}
+
+void dump_wide_table(const hwide_table_t *table)
+{
+    UASSERT_INPUT(table);
+
+    printf("Wide table, %u symbols, max code length %u:\n", table->symbols_count, table->max_code_len);
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        if (table->lens[i])
+        {
+            hcode_t hcode = {.len = table->lens[i], .present = true, .code = table->codes[i]};
+            char symbol[ESCAPED_SYMBOL_SIZE];
+            char code[MAX_HCODE_LENGTH + 1];
+            printf("%10s%6u      %s\n", escape_symbol(i, symbol), hcode.len, hcode2str(&hcode, code));
+        }
+    }
+}
+
+void destroy_wide_table(hwide_table_t *table)
+{
+    if (table)
+    {
+        ufree(table->lens);
+        ufree(table->codes);
+        ufree(table);
+    }
+}
+
+hencoder_t *build_wide_encoder(const hwide_table_t *table, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(table);
+    UASSERT_INPUT(cfg);
+
+    hencoder_t *encoder = uzalloc(sizeof(*encoder));
+    encoder->cfg = cfg;
+    encoder->type = HENCODER_SCALAR;
+    encoder->max_code_len = table->max_code_len;
+    encoder->wide_codes = umalloc(WIDE_SYMBOLS_COUNT * sizeof(uint64_t));
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        encoder->wide_codes[i] = PAIR_CODE(table->codes[i], table->lens[i]);
+    }
+
+    return encoder;
+}
+
+umemchunk_t encode_block_wide(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer)
+{
+    const uint8_t *in = input.data;
+    const uint8_t *end = in + input.size;
+    const uint64_t *codes = encoder->wide_codes;
+    const uint64_t code_mask = (1LLU << PAIR_LEN_SHIFT) - 1;
+    bit_writer_t bw;
+    uint64_t code;
+
+    bit_writer_init(&bw, buffer, input.size, encoder->max_code_len);
+    while (end - in >= 2)
+    {
+        code = codes[in[0] | (in[1] << 8)];
+        put_bits(&bw, code & code_mask, code >> PAIR_LEN_SHIFT);
+        in += 2;
+    }
+    if (in < end)
+    {
+        code = codes[in[0]];
+        put_bits(&bw, code & code_mask, code >> PAIR_LEN_SHIFT);
+    }
+
+    return bit_writer_finish(&bw, buffer);
+}
+
+// Tree for codes longer than the peek table, internal nodes have no string
+// representation as the tree is never dumped.
+static hnode_t *create_wide_node(harena_t *arena)
+{
+    hnode_t *node = arena_alloc(arena, sizeof(*node));
+    memset(node, 0, sizeof(*node));
+    node->code = -1;
+    return node;
+}
+
+static hnode_t *build_wide_tree(const hwide_table_t *table)
+{
+    harena_t *arena = arena_create(TREE_ARENA_CHUNK_SIZE);
+    hnode_t *root = create_wide_node(arena);
+    root->arena = arena;
+
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        hnode_t *node = root;
+        uint8_t len = table->lens[i];
+        if (!len)
+        {
+            continue;
+        }
+        for (uint8_t j = 0; j < len; j++)
+        {
+            hnode_t **link = ((table->codes[i] >> j) & 1) ? &node->right : &node->left;
+            if (!*link)
+            {
+                *link = create_wide_node(arena);
+            }
+            node = *link;
+        }
+        node->is_leaf = true;
+        node->code = i;
+    }
+
+    return root;
+}
+
+hdecoder_t *build_wide_decoder(const hwide_table_t *table, const hcfg_t *cfg)
+{
+    UASSERT_INPUT(table);
+    UASSERT_INPUT(cfg);
+
+    hdecoder_t *decoder = uzalloc(sizeof(*decoder));
+    hwide_decoder_t *wide = uzalloc(sizeof(*wide));
+    decoder->cfg = cfg;
+    decoder->type = HDECODER_TREE;
+    decoder->wide = wide;
+
+    wide->root = build_wide_tree(table);
+    wide->nbits = table->max_code_len < WIDE_PEEK_NBITS ? table->max_code_len : WIDE_PEEK_NBITS;
+    wide->peek = ucalloc(1 << wide->nbits, sizeof(uint32_t));
+    for (size_t i = 0; i < WIDE_SYMBOLS_COUNT; i++)
+    {
+        uint8_t len = table->lens[i];
+        if (!len || len > wide->nbits)
+        {
+            continue;
+        }
+        // Every index starting with the code maps to the symbol.
+        for (size_t j = 0; j < (1U << (wide->nbits - len)); j++)
+        {
+            wide->peek[table->codes[i] | (j << len)] = i | (len << 16);
+        }
+    }
+    decoder->table_size = (1 << wide->nbits) * sizeof(uint32_t);
+
+    if (cfg->verbose)
+    {
+        printf("Using wide decoder, %zu bytes of lookup table.\n", decoder->table_size);
+    }
+
+    return decoder;
+}
+
+void destroy_wide_decoder(hwide_decoder_t *wide)
+{
+    if (wide)
+    {
+        destroy_tree(wide->root);
+        ufree(wide->peek);
+        ufree(wide);
+    }
+}
+
+// Two bytes are written per symbol, the last symbol of an odd-sized block
+// writes one byte past original_size. Decoding stops at the end of the
+// input, so corrupted data yields shorter output.
+umemchunk_t decode_block_wide(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer,
+                              size_t original_size)
+{
+    const hwide_decoder_t *wide = decoder->wide;
+    uint8_t *out = buffer->data;
+    uint8_t *out_end = out + original_size;
+    bit_reader_t br;
+
+    bit_reader_init(&br, input.data, input.size);
+    while (out < out_end)
+    {
+        uint32_t item, symbol;
+        unsigned int len;
+
+        bit_reader_refill(&br);
+        item = wide->peek[bit_reader_peek(&br, wide->nbits)];
+        len = item >> 16;
+        if (len && len <= br.avail)
+        {
+            symbol = item & 0xffff;
+            bit_reader_skip(&br, len);
+        }
+        else
+        {
+            const hnode_t *node = wide->root;
+            while (!node->is_leaf)
+            {
+                if (!br.avail)
+                {
+                    bit_reader_refill(&br);
+                    if (!br.avail)
+                    {
+                        goto out;
+                    }
+                }
+                node = bit_reader_peek(&br, 1) ? node->right : node->left;
+                bit_reader_skip(&br, 1);
+                if (!node)
+                {
+                    goto out;
+                }
+            }
+            symbol = node->code;
+        }
+        out[0] = symbol;
+        out[1] = symbol >> 8;
+        out += 2;
+    }
+
+out:;
+    size_t size = out - (uint8_t *)buffer->data;
+    umemchunk_t output = {
+        .data = buffer->data,
+        .size = size < original_size ? size : original_size,
+    };
+
+    return output;
+}
@@ -0,0 +1,40 @@
+#ifndef __WIDE_H__
+#define __WIDE_H__
+
+#include "huffman.h"
+
+// 16-bit symbol codec: every pair of bytes (little-endian) is one symbol,
+// the last byte of an odd-sized block is coded as a symbol with zero high
+// byte. Stat of this codec is get_stat_count() == 256 histograms, symbol s
+// is counted in stats[s >> 8].frequencies[s & 0xff].
+#define WIDE_SYMBOLS_COUNT 65536
+
+// Width of the first-level decoding table (256 KB at most, fits L2 cache),
+// codes longer than that are decoded by walking the tree.
+#define WIDE_PEEK_NBITS 16
+
+// Sparse code table, only symbols present in the data have codes.
+typedef struct {
+    uint8_t *lens; // code length of every symbol, 0 for absent ones
+    uint64_t *codes; // canonical codes, LSB corresponds to root of the htree
+    uint32_t symbols_count;
+    uint8_t max_code_len;
+} hwide_table_t;
+
+void update_wide_stat(hstat_t *stats, umemchunk_t m);
+
+hwide_table_t *build_wide_table(const hstat_t *stats, const hcfg_t *cfg);
+void pack_wide_table(const hwide_table_t *table, ubuffer_t *output);
+hwide_table_t *unpack_wide_table(const uint8_t *data, size_t size);
+void dump_wide_table(const hwide_table_t *table);
+void destroy_wide_table(hwide_table_t *table);
+
+hencoder_t *build_wide_encoder(const hwide_table_t *table, const hcfg_t *cfg);
+umemchunk_t encode_block_wide(const hencoder_t *encoder, umemchunk_t input, ubuffer_t *buffer);
+
+hdecoder_t *build_wide_decoder(const hwide_table_t *table, const hcfg_t *cfg);
+void destroy_wide_decoder(hwide_decoder_t *wide);
+umemchunk_t decode_block_wide(const hdecoder_t *decoder, umemchunk_t input, ubuffer_t *buffer,
+                              size_t original_size);
+
+#endif